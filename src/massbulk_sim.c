@@ -48,6 +48,7 @@ struct USBSimMass {
     struct USBSim sm_USBSim;
 
     UBYTE sm_DevAddr;
+    UBYTE sm_Config;
 
     struct massbulk_Endpoint {
 #define STATE_IDLE              0
@@ -56,20 +57,38 @@ struct USBSimMass {
 #define STATE_SETUP_OUT         3
 #define STATE_IN                4
 #define STATE_OUT               5
+#define STATE_HALT              6
         UBYTE ep_State;
         UBYTE ep_Toggle;
         UBYTE ep_Reply;
-        UBYTE ep_BuffReady;
-        UBYTE ep_BuffPtr;
-        UBYTE ep_BuffLen;
+        UBYTE ep_Token;         /* Last token PID seen */
+        UBYTE ep_Last;          /* The IN packet awaiting ACK ends its phase */
+        UWORD ep_BuffPtr;
+        UWORD ep_BuffLen;
+        UWORD ep_Sent;          /* Bytes of the IN packet awaiting ACK */
         UBYTE ep_Buff[256];
         struct UsbSetupData ep_SetupData;
     } sm_EP[3], *sm_Endpoint;
+
+    /* Bulk-Only Transport */
+#define PHASE_CBW       0
+#define PHASE_DATA_IN   1
+#define PHASE_DATA_OUT  2
+#define PHASE_CSW       3
+    UBYTE sm_Phase;
+    UBYTE sm_Status;
+    UBYTE sm_SenseKey;
+    ULONG sm_Tag;
+    ULONG sm_DataLeft;          /* Host's dCBWDataTransferLength still to go */
+    ULONG sm_RespLen;           /* Bytes the command has to return */
+    ULONG sm_RespPtr;
 };
 
 #define EP_CONTROL      0
-#define EP_BULK_IN      1
-#define EP_BULK_OUT     2
+#define EP_BULK_OUT     1
+#define EP_BULK_IN      2
+
+#define MASSBULK_BLOCKS         2048    /* 1M of 512 byte blocks */
 
 #ifdef AROS_BIG_ENDIAN
 #define CONST_WORD2LE(x) ((((x) & 0x00ff) <<  8) | \
@@ -129,14 +148,14 @@ struct UsbStdEPDesc const massbulk_EPDesc[2] = {
         .bDescriptorType = UDT_ENDPOINT,
         .bEndpointAddress = 0x01,
         .bmAttributes = 2,
-        .wMaxPacketSize = CONST_WORD2LE(0x200),
+        .wMaxPacketSize = CONST_WORD2LE(64),  /* Full speed bulk */
         .bInterval = 0
     }, {
         .bLength= sizeof(struct UsbStdEPDesc),
         .bDescriptorType = UDT_ENDPOINT,
         .bEndpointAddress = 0x82,
         .bmAttributes = 2,
-        .wMaxPacketSize = CONST_WORD2LE(0x200),
+        .wMaxPacketSize = CONST_WORD2LE(64),  /* Full speed bulk */
         .bInterval = 0
     }
 };
@@ -148,6 +167,9 @@ struct smUsbStdStrDesc
     UWORD bString[12];         /* UNICODE encoded string */
 };
 
+/* The wire layout of the CBW and CSW. The structures are not packed,
+ * so massbulk_BulkOut() and massbulk_BulkIn() go bytewise.
+ */
 #define CBW_SIGNATURE   0x43425355
 
 struct smCBW {
@@ -207,45 +229,52 @@ struct smUsbStdStrDesc const massbulk_StrDesc[] = {
     }
 };
 
+static inline ULONG sm_GetLE32(const UBYTE *p)
+{
+    return ((ULONG)p[3] << 24) | ((ULONG)p[2] << 16) | ((ULONG)p[1] << 8) | p[0];
+}
+
+static inline void sm_PutLE32(UBYTE *p, ULONG val)
+{
+    p[0] = (val >>  0) & 0xff;
+    p[1] = (val >>  8) & 0xff;
+    p[2] = (val >> 16) & 0xff;
+    p[3] = (val >> 24) & 0xff;
+}
+
+/* Append to the control IN reply, up to what the host's wLength has left.
+ * A reply that comes up short of wLength ends with a short packet.
+ */
 static UBYTE sm_AppendData(struct massbulk_Endpoint *ep, UWORD *lengthp, int desc_len, CONST_APTR desc)
 {
-    int err;
     int length = *lengthp;
-    int len = ep->ep_BuffLen - ep->ep_BuffPtr;
-    UBYTE *data = &ep->ep_Buff[ep->ep_BuffPtr];
+    int len = sizeof(ep->ep_Buff) - ep->ep_BuffLen;
 
-    D2(ebug("Append %d bytes to buffer (%d left of %d), want to send %d\n", desc_len, len, ep->ep_BuffLen, length));
+    D2(ebug("Append %d bytes to buffer (%d used), want to send %d\n", desc_len, ep->ep_BuffLen, length));
 
-    if (len != length) {
-        D2(ebug("Setup length %d, expected %d\n", length, len));
-    }
-    if (length > len) {
-        err = PID_NAK;
-    } else if (length < len) {
+    if (len > length)
         len = length;
-        err = PID_NAK;
-    } else {
-        err = PID_ACK;
-    }
-
     if (len > desc_len)
         len = desc_len;
 
-    CopyMem(desc, data, len);
-    length -= len;
-    ep->ep_BuffPtr += len;
+    CopyMem(desc, &ep->ep_Buff[ep->ep_BuffLen], len);
+    ep->ep_BuffLen += len;
 
-    *lengthp = length;
+    *lengthp = length - len;
 
-    return err;
+    return 0;
 }
 
 #define CTLREQ(type,req)        (((type) << 8) | (req))
 
+/* Returns 0 on success, or PID_STALL for an unsupported request.
+ * IN requests run at the SETUP, and fill ep_Buff with the reply.
+ * OUT requests run at the status stage.
+ */
 static UBYTE massbulk_SetupInOut(struct USBSimMass *sm, struct massbulk_Endpoint *ep)
 {
     struct UsbSetupData *setup = &ep->ep_SetupData;
-    UBYTE err = PID_NAK;
+    UBYTE err = PID_STALL;
     UWORD value, index, length;
     UBYTE buff[4];
 
@@ -261,6 +290,24 @@ static UBYTE massbulk_SetupInOut(struct USBSimMass *sm, struct massbulk_Endpoint
         sm->sm_DevAddr = value;
         err = 0;
         break;
+    case CTLREQ(URTF_OUT | URTF_STANDARD | URTF_DEVICE, USR_SET_CONFIGURATION):
+        D2(ebug("SetConfiguration: %d\n", value));
+        if (value <= 1) {
+            sm->sm_Config = value;
+            sm->sm_EP[EP_BULK_OUT].ep_Toggle = 0;
+            sm->sm_EP[EP_BULK_IN].ep_Toggle = 0;
+            sm->sm_Phase = PHASE_CBW;
+            err = 0;
+        }
+        break;
+    case CTLREQ(URTF_OUT | URTF_STANDARD | URTF_ENDPOINT, USR_CLEAR_FEATURE):
+        D2(ebug("ClearFeature: %d [%d]\n", value, index));
+        if (value == 0 && ((index & 0x0f) == EP_BULK_OUT || (index & 0x0f) == EP_BULK_IN)) {
+            sm->sm_EP[index & 0x0f].ep_Toggle = 0;
+            sm->sm_EP[index & 0x0f].ep_State = STATE_IDLE;
+            err = 0;
+        }
+        break;
     case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_DESCRIPTOR):
         D2(ebug("GetDescriptor: %d [%d]\n", (value>>8) & 0xff, index));
         switch ((value>>8) & 0xff) {
@@ -272,15 +319,15 @@ static UBYTE massbulk_SetupInOut(struct USBSimMass *sm, struct massbulk_Endpoint
             if (err == 0 && length > 0)
                 err = sm_AppendData(ep, &length, sizeof(massbulk_IntDesc), &massbulk_IntDesc);
             if (err == 0 && length > 0)
-                err = sm_AppendData(ep, &length, sizeof(massbulk_EPDesc), &massbulk_EPDesc[0]);
+                err = sm_AppendData(ep, &length, sizeof(massbulk_EPDesc[0]), &massbulk_EPDesc[0]);
             if (err == 0 && length > 0)
-                err = sm_AppendData(ep, &length, sizeof(massbulk_EPDesc), &massbulk_EPDesc[1]);
+                err = sm_AppendData(ep, &length, sizeof(massbulk_EPDesc[1]), &massbulk_EPDesc[1]);
             break;
         case UDT_INTERFACE:
             err = sm_AppendData(ep, &length, sizeof(massbulk_IntDesc), &massbulk_IntDesc);
             break;
         case UDT_ENDPOINT:
-            err = sm_AppendData(ep, &length, sizeof(massbulk_EPDesc), &massbulk_EPDesc);
+            err = sm_AppendData(ep, &length, sizeof(massbulk_EPDesc[0]), &massbulk_EPDesc[0]);
             break;
         case UDT_STRING:
             if ((value & 0xff) <= 3) {
@@ -294,7 +341,7 @@ static UBYTE massbulk_SetupInOut(struct USBSimMass *sm, struct massbulk_Endpoint
         break;
     case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_CONFIGURATION):
         D2(ebug("GetConfiguration: %d [%d]\n", value, index));
-        buff[0] = 0;
+        buff[0] = sm->sm_Config;
         err = sm_AppendData(ep, &length, 1, buff);
         break;
     case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_STATUS): /* GetStatus */
@@ -322,21 +369,19 @@ static UBYTE massbulk_SetupInOut(struct USBSimMass *sm, struct massbulk_Endpoint
         }
         break;
     case CTLREQ(URTF_OUT | URTF_CLASS | URTF_INTERFACE, 0xff): /* Bulk-Only Mass Storage Reset */
-        if (value == 0 && length == 0)
-            err = PID_ACK;
-        else
-            err = PID_NAK;
+        if (value == 0 && length == 0) {
+            sm->sm_Phase = PHASE_CBW;
+            err = 0;
+        }
         break;
-    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_INTERFACE, 0xfe): /* Get Max Lun */
+    case CTLREQ(URTF_IN | URTF_CLASS | URTF_INTERFACE, 0xfe): /* Get Max Lun */
         if (value == 0 && length == 1) {
             buff[0] = 0;
             err = sm_AppendData(ep, &length, 1, buff);
         }
-        err = PID_ACK;
         break;
     default:
-        D(ebug("Unknown request - NAK\n"));
-        err = PID_NAK;
+        D(ebug("Unknown request - STALL\n"));
         break;
     }
 
@@ -344,10 +389,237 @@ static UBYTE massbulk_SetupInOut(struct USBSimMass *sm, struct massbulk_Endpoint
     return err;
 }
 
+/* Run the SCSI command of a CBW, and pick the next Bulk-Only phase.
+ * Replies are built in the bulk IN endpoint's buffer; READ(10)
+ * returns zeroes past its end.
+ */
+static void massbulk_Command(struct USBSimMass *sm, const UBYTE *cbw)
+{
+    struct massbulk_Endpoint *ep = &sm->sm_EP[EP_BULK_IN];
+    const UBYTE *cb = &cbw[15];
+    UBYTE *resp = ep->ep_Buff;
+    ULONG resplen = 0;
+    int i;
+
+    sm->sm_Tag = sm_GetLE32(&cbw[4]);
+    sm->sm_DataLeft = sm_GetLE32(&cbw[8]);
+    sm->sm_Status = CSWSTATUS_PASSED;
+
+    for (i = 0; i < sizeof(ep->ep_Buff); i++)
+        resp[i] = 0;
+
+    D(ebug("CBW tag %08x, SCSI $%02x, %d bytes %s\n", sm->sm_Tag, cb[0], sm->sm_DataLeft, (cbw[12] & CBWFLAG_DIRECTION) ? "IN" : "OUT"));
+
+    switch (cb[0]) {
+    case 0x00:  /* TEST UNIT READY */
+    case 0x1b:  /* START STOP UNIT */
+    case 0x1e:  /* PREVENT ALLOW MEDIUM REMOVAL */
+    case 0x2a:  /* WRITE(10) - the data is dropped */
+    case 0x35:  /* SYNCHRONIZE CACHE */
+        break;
+    case 0x03:  /* REQUEST SENSE */
+        resp[0] = 0x70;         /* Current error */
+        resp[2] = sm->sm_SenseKey;
+        resp[7] = 10;
+        resp[12] = sm->sm_SenseKey ? 0x20 : 0x00;   /* Invalid opcode */
+        sm->sm_SenseKey = 0;
+        resplen = (cb[4] < 18) ? cb[4] : 18;
+        break;
+    case 0x12:  /* INQUIRY */
+        resp[0] = 0x00;         /* Direct access */
+        resp[1] = 0x80;         /* Removable */
+        resp[2] = 0x02;         /* SCSI-2 */
+        resp[3] = 0x02;
+        resp[4] = 36 - 5;
+        CopyMem("SimBulk MassDrv         1.0 ", &resp[8], 28);
+        resplen = (cb[4] < 36) ? cb[4] : 36;
+        break;
+    case 0x1a:  /* MODE SENSE(6) - only the header, so
+                 * the usual larger request comes back short
+                 */
+        resp[0] = 3;
+        resplen = (cb[4] < 4) ? cb[4] : 4;
+        break;
+    case 0x25:  /* READ CAPACITY(10) */
+        resp[0] = ((MASSBULK_BLOCKS - 1) >> 24) & 0xff;
+        resp[1] = ((MASSBULK_BLOCKS - 1) >> 16) & 0xff;
+        resp[2] = ((MASSBULK_BLOCKS - 1) >>  8) & 0xff;
+        resp[3] = ((MASSBULK_BLOCKS - 1) >>  0) & 0xff;
+        resp[6] = 512 >> 8;
+        resplen = 8;
+        break;
+    case 0x28:  /* READ(10) */
+        resplen = ((cb[7] << 8) | cb[8]) * 512;
+        break;
+    default:
+        D(ebug("Unknown SCSI command $%02x\n", cb[0]));
+        sm->sm_Status = CSWSTATUS_FAILED;
+        sm->sm_SenseKey = 0x05; /* Illegal request */
+        break;
+    }
+
+    sm->sm_RespLen = resplen;
+    sm->sm_RespPtr = 0;
+
+    if (sm->sm_DataLeft == 0)
+        sm->sm_Phase = PHASE_CSW;
+    else if ((cbw[12] & CBWFLAG_DIRECTION) == CBWFLAG_DIRECTION_IN)
+        sm->sm_Phase = PHASE_DATA_IN;
+    else
+        sm->sm_Phase = PHASE_DATA_OUT;
+}
+
+/* Bulk OUT data. Returns the handshake.
+ */
+static UBYTE massbulk_BulkOut(struct USBSimMass *sm, const UBYTE *buff, size_t len)
+{
+    switch (sm->sm_Phase) {
+    case PHASE_CBW:
+        if (len != 31 || sm_GetLE32(buff) != CBW_SIGNATURE) {
+            D(ebug("Invalid CBW (%d bytes)\n", len));
+            return PID_STALL;
+        }
+        massbulk_Command(sm, buff);
+        return PID_ACK;
+    case PHASE_DATA_OUT:
+        if (len > sm->sm_DataLeft)
+            len = sm->sm_DataLeft;
+        sm->sm_DataLeft -= len;
+        if (sm->sm_DataLeft == 0 || len < AROS_LE2WORD(massbulk_EPDesc[0].wMaxPacketSize))
+            sm->sm_Phase = PHASE_CSW;
+        return PID_ACK;
+    default:
+        /* The host has to collect the CSW first */
+        return PID_NAK;
+    }
+}
+
+/* Bulk IN data. Returns the bytes put in buff, and
+ * sets *pidp to the DATA PID or the handshake.
+ */
+static size_t massbulk_BulkIn(struct USBSimMass *sm, struct massbulk_Endpoint *ep, UBYTE *pidp, UBYTE *buff, size_t len)
+{
+    size_t i, n;
+
+    switch (sm->sm_Phase) {
+    case PHASE_DATA_IN:
+        n = len;
+        if (n > sm->sm_RespLen - sm->sm_RespPtr)
+            n = sm->sm_RespLen - sm->sm_RespPtr;
+        if (n > sm->sm_DataLeft)
+            n = sm->sm_DataLeft;
+        for (i = 0; i < n; i++)
+            buff[i] = (sm->sm_RespPtr + i < sizeof(ep->ep_Buff)) ? ep->ep_Buff[sm->sm_RespPtr + i] : 0;
+        /* A short packet ends the data phase early,
+         * and the residue goes in the CSW.
+         */
+        ep->ep_Last = (n < len) || (n == sm->sm_DataLeft);
+        break;
+    case PHASE_CSW:
+        if (len < 13) {
+            *pidp = PID_STALL;
+            return 0;
+        }
+        sm_PutLE32(&buff[0], CSW_SIGNATURE);
+        sm_PutLE32(&buff[4], sm->sm_Tag);
+        sm_PutLE32(&buff[8], sm->sm_DataLeft);
+        buff[12] = sm->sm_Status;
+        n = 13;
+        ep->ep_Last = TRUE;
+        break;
+    default:
+        *pidp = PID_NAK;
+        return 0;
+    }
+
+    ep->ep_Sent = n;
+    *pidp = ep->ep_Toggle ? PID_DATA1 : PID_DATA0;
+    return n;
+}
+
+/* The host ACKed our last IN packet */
+static void massbulk_BulkAcked(struct USBSimMass *sm, struct massbulk_Endpoint *ep)
+{
+    switch (sm->sm_Phase) {
+    case PHASE_DATA_IN:
+        sm->sm_RespPtr += ep->ep_Sent;
+        sm->sm_DataLeft -= ep->ep_Sent;
+        if (ep->ep_Last)
+            sm->sm_Phase = PHASE_CSW;
+        break;
+    case PHASE_CSW:
+        sm->sm_Phase = PHASE_CBW;
+        break;
+    }
+}
+
+/* SETUP or OUT data. Returns the handshake.
+ */
+static UBYTE massbulk_Data(struct USBSimMass *sm, struct massbulk_Endpoint *ep, UBYTE pid, const UBYTE *buff, size_t len)
+{
+    UBYTE reply;
+
+    if (ep->ep_Token == PID_SETUP) {
+        /* Corrupt SETUPs get no handshake at all */
+        if (ep != &sm->sm_EP[EP_CONTROL] || pid != PID_DATA0 || len != 8)
+            return 0;
+
+        CopyMem(buff, &ep->ep_SetupData, len);
+        ep->ep_Toggle = 1;
+        ep->ep_BuffPtr = 0;
+        ep->ep_BuffLen = 0;
+        if (ep->ep_SetupData.bmRequestType & URTF_IN) {
+            if (massbulk_SetupInOut(sm, ep) == 0)
+                ep->ep_State = STATE_SETUP_IN;
+            else
+                ep->ep_State = STATE_HALT;
+        } else {
+            ep->ep_State = STATE_SETUP_OUT;
+        }
+        return PID_ACK;
+    }
+
+    if (ep->ep_State == STATE_HALT)
+        return PID_STALL;
+
+    /* A repeat of data we already took is ACKed and dropped */
+    if ((pid == PID_DATA1) != (ep->ep_Toggle != 0))
+        return PID_ACK;
+
+    switch (ep - sm->sm_EP) {
+    case EP_CONTROL:
+        if (ep->ep_State == STATE_SETUP_OUT &&
+            (ep->ep_BuffLen + len) <= AROS_LE2WORD(ep->ep_SetupData.wLength) &&
+            (ep->ep_BuffLen + len) <= sizeof(ep->ep_Buff)) {
+            CopyMem(buff, &ep->ep_Buff[ep->ep_BuffLen], len);
+            ep->ep_BuffLen += len;
+            reply = PID_ACK;
+        } else if (ep->ep_State == STATE_SETUP_IN && len == 0) {
+            /* Status stage of a control read */
+            ep->ep_State = STATE_IDLE;
+            reply = PID_ACK;
+        } else {
+            ep->ep_State = STATE_HALT;
+            reply = PID_STALL;
+        }
+        break;
+    case EP_BULK_OUT:
+        reply = massbulk_BulkOut(sm, buff, len);
+        break;
+    default:
+        reply = PID_STALL;
+        break;
+    }
+
+    if (reply == PID_ACK)
+        ep->ep_Toggle ^= 1;
+
+    return reply;
+}
+
 static void massbulk_Out(struct USBSim *sim, UBYTE pid, const UBYTE *buff, size_t len)
 {
     struct USBSimMass *sm = (struct USBSimMass *)sim;
-    int i;
     struct massbulk_Endpoint *ep;
 
     if (pid == PID_SETUP || pid == PID_OUT || pid == PID_IN) {
@@ -360,6 +632,7 @@ static void massbulk_Out(struct USBSim *sim, UBYTE pid, const UBYTE *buff, size_
             return;
 
         sm->sm_Endpoint = &sm->sm_EP[epid];
+        sm->sm_Endpoint->ep_Token = pid;
     }
 
     ep = sm->sm_Endpoint;
@@ -368,67 +641,37 @@ static void massbulk_Out(struct USBSim *sim, UBYTE pid, const UBYTE *buff, size_
 
     switch (pid) {
     case PID_SETUP:
-        for (i = 0; i < 3; i++) {
-            sm->sm_EP[i].ep_Toggle = FALSE;
-            sm->sm_EP[i].ep_Reply = 0;
-            sm->sm_EP[i].ep_BuffPtr = 0;
-            sm->sm_EP[i].ep_BuffReady = 0;
-            sm->sm_EP[i].ep_State = STATE_IDLE;
-        }
+        /* A SETUP always goes through, and clears a halt */
         ep->ep_State = STATE_SETUP;
-        ep->ep_Reply = PID_NAK;
+        ep->ep_Toggle = 0;
+        ep->ep_Reply = 0;
         break;
     case PID_IN:
-        ep->ep_Reply = (ep->ep_Toggle ? PID_DATA1 : PID_DATA0);
-        if (ep->ep_State != STATE_SETUP)
-            ep->ep_State = STATE_IN;
+        ep->ep_Sent = 0;
+        ep->ep_Last = FALSE;
+        /* Status stage of a control write is always DATA1 */
+        if (ep->ep_State == STATE_SETUP_OUT)
+            ep->ep_Toggle = 1;
         break;
     case PID_OUT:
-        if (ep->ep_State != STATE_SETUP)
-            ep->ep_State = STATE_OUT;
+        /* Status stage of a control read is always DATA1 */
+        if (ep->ep_State == STATE_SETUP_IN)
+            ep->ep_Toggle = 1;
         ep->ep_Reply = PID_NAK;
         break;
     case PID_DATA0:
     case PID_DATA1:
-        if (((pid == PID_DATA1) && !ep->ep_Toggle) ||
-            ((pid == PID_DATA0) && ep->ep_Toggle)) {
-            ep->ep_Reply = PID_NAK;
-        } else if (ep->ep_State == STATE_SETUP && len == 8) {
-            CopyMem(buff, &ep->ep_SetupData, len);
-            ep->ep_State = (ep->ep_SetupData.bmRequestType & 0x80) ? STATE_SETUP_IN : STATE_SETUP_OUT;
-            if (ep->ep_State == STATE_SETUP_IN) {
-                massbulk_SetupInOut(sm, ep);
-            } else {
-                ep->ep_BuffReady = TRUE;
-                ep->ep_BuffPtr = 0;
-            }
-            ep->ep_Reply = PID_ACK;
-        } else if (ep->ep_State == STATE_SETUP_OUT && ep->ep_BuffReady) {
-            if ((ep->ep_BuffPtr + len) <= AROS_LE2WORD(ep->ep_SetupData.wLength)) {
-                CopyMem(buff, &ep->ep_Buff[ep->ep_BuffPtr], len);
-                ep->ep_BuffPtr += len;
-                ep->ep_Reply = PID_ACK;
-            } else {
-                ep->ep_Reply = PID_NAK;
-            }
-        } else if (ep->ep_State == STATE_SETUP_IN && len == 0) {
-            ep->ep_State = STATE_IDLE;
-            ep->ep_Reply = PID_ACK;
-        } else if (ep->ep_State == STATE_OUT) {
-            if ((ep->ep_BuffPtr + len) <= sizeof(ep->ep_Buff)) {
-                CopyMem(buff, &ep->ep_Buff[ep->ep_BuffPtr], len);
-                ep->ep_BuffPtr += len;
-                ep->ep_Reply = PID_ACK;
-            } else {
-                ep->ep_Reply = PID_NAK;
-            }
-        } else {
-            ep->ep_Reply = PID_NAK;
-        }
+        ep->ep_Reply = massbulk_Data(sm, ep, pid, buff, len);
         break;
     case PID_ACK:
-        ep->ep_Reply = PID_STALL;
-        ep->ep_Toggle = !ep->ep_Toggle;
+        /* The host took our IN packet */
+        ep->ep_Toggle ^= 1;
+        if (ep->ep_State == STATE_SETUP_IN)
+            ep->ep_BuffPtr += ep->ep_Sent;
+        else if (ep->ep_State == STATE_SETUP_OUT)
+            ep->ep_State = STATE_IDLE;
+        else if (ep == &sm->sm_EP[EP_BULK_IN])
+            massbulk_BulkAcked(sm, ep);
         break;
     default:
         ep->ep_Reply = PID_STALL;
@@ -439,43 +682,68 @@ static void massbulk_Out(struct USBSim *sim, UBYTE pid, const UBYTE *buff, size_
     D(ebug("OUT PID %x, State %d, Reply %d\n", pid, ep->ep_State, ep->ep_Reply));
 }
 
-static void massbulk_In(struct USBSim *sim, UBYTE *pidp, UBYTE *buff, size_t len)
+/* Returns the bytes of DATA0/DATA1 put in buff, which
+ * may be fewer than len.
+ */
+static size_t massbulk_In(struct USBSim *sim, UBYTE *pidp, UBYTE *buff, size_t len)
 {
     struct USBSimMass *sm = (struct USBSimMass *)sim;
     struct massbulk_Endpoint *ep;
+    size_t n = 0;
 
     ep = sm->sm_Endpoint;
-    *pidp = ep->ep_Reply;
- 
-    D(ebug("IN PID %x, State %d\n", *pidp, ep->ep_State));
 
-    switch (ep->ep_Reply) {
-    case PID_DATA0:
-    case PID_DATA1:
-        if ((ep->ep_State == STATE_SETUP_IN || ep->ep_State == STATE_IN) &&
-                ep->ep_BuffReady) {
-            if ((ep->ep_BuffPtr + len) <= ep->ep_BuffLen) {
-                CopyMem(buff, &ep->ep_Buff[ep->ep_BuffPtr], len);
-                ep->ep_BuffPtr += len;
-                ep->ep_Reply = PID_ACK;
-            } else {
-                ep->ep_Reply = PID_NAK;
-            }
-        } else if (ep->ep_State == STATE_SETUP_OUT && len == 0) {
-            ep->ep_Reply = massbulk_SetupInOut(sm, ep);
+    D(ebug("IN Token %x, State %d\n", ep->ep_Token, ep->ep_State));
+
+    if (ep->ep_Token != PID_IN) {
+        /* Handshake for the SETUP or OUT data */
+        *pidp = ep->ep_Reply;
+    } else if (ep->ep_State == STATE_HALT) {
+        *pidp = PID_STALL;
+    } else if (ep->ep_State == STATE_SETUP_IN) {
+        n = ep->ep_BuffLen - ep->ep_BuffPtr;
+        if (n > len)
+            n = len;
+        CopyMem(&ep->ep_Buff[ep->ep_BuffPtr], buff, n);
+        ep->ep_Sent = n;
+        *pidp = ep->ep_Toggle ? PID_DATA1 : PID_DATA0;
+    } else if (ep->ep_State == STATE_SETUP_OUT) {
+        /* Status stage of a control write - run the request */
+        if (massbulk_SetupInOut(sm, ep) == 0) {
+            *pidp = PID_DATA1;
         } else {
-            ep->ep_Reply = PID_NAK;
+            ep->ep_State = STATE_HALT;
+            *pidp = PID_STALL;
         }
-        break;
-    case PID_ACK:
-        ep->ep_Reply = PID_NAK;
+    } else if (ep == &sm->sm_EP[EP_BULK_IN]) {
+        n = massbulk_BulkIn(sm, ep, pidp, buff, len);
+    } else {
+        *pidp = PID_NAK;
+    }
 
-        break;
-    case PID_NAK:
-        break;
+    D(ebug("IN PID %x, State %d, %d bytes\n", *pidp, ep->ep_State, n));
+
+    return n;
+}
+
+static void massbulk_Reset(struct USBSim *sim)
+{
+    struct USBSimMass *sm = (struct USBSimMass *)sim;
+    int i;
+
+    sm->sm_DevAddr = 0;
+    sm->sm_Config = 0;
+    sm->sm_Phase = PHASE_CBW;
+    sm->sm_SenseKey = 0;
+
+    for (i = 0; i < 3; i++) {
+        sm->sm_EP[i].ep_State = STATE_IDLE;
+        sm->sm_EP[i].ep_Toggle = 0;
+        sm->sm_EP[i].ep_Reply = 0;
+        sm->sm_EP[i].ep_Token = 0;
     }
 
-    D(ebug("IN PID %x, State %d, Reply %d\n", *pidp, ep->ep_State, ep->ep_Reply));
+    sm->sm_Endpoint = &sm->sm_EP[0];
 }
 
 struct USBSim *massbulk_Attach(void)
@@ -483,6 +751,7 @@ struct USBSim *massbulk_Attach(void)
     struct USBSimMass *sm;
 
     sm = AllocMem(sizeof(*sm), MEMF_ANY | MEMF_CLEAR);
+    sm->sm_USBSim.reset = massbulk_Reset;
     sm->sm_USBSim.out = massbulk_Out;
     sm->sm_USBSim.in = massbulk_In;
 
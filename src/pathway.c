@@ -37,6 +37,8 @@
  *
  * Unit number 16 is the debug (simulation) unit,
  * which has a Mass Storage Bulk-only simulation.
+ * It is available in optimized builds too, unless
+ * built with SL811HS_SIM=0.
  */
 struct pathway_base { ULONG addr; ULONG data; LONG irq; } pb_Base[17] = {
     { 0xd80001, 0xd80005, INTB_EXTER },  /* Unit 0: A1200 clockport */
@@ -26,7 +26,7 @@
 /* Theory of operation:
  *
  *  Packets (iou) move from:
- *    sl711hs_BeginIO -> sl811hs_CommandTask -> sl_PacketsReady
+ *    sl711hs_BeginIO -> sl811hs_CommandTask -> endpoint queue (sl811hs_Ready)
  *
  *  They are then converted to an Xfer, and the endpoint is marked
  *  as busy while the Xfer is allocated.
@@ -35,39 +35,46 @@
  *
  *      --------------------- sl811hs_Timer -----------------------------
  *     V                                                                 |
- *    iou -> Xfer -> XfersActive -> (IRQ) -> XfersDone (NAK) -> timer.device /
+ *    iou -> Xfer -> (ACTIVE) -> (IRQ) -> DoneRing (NAK) -> timer.device /
  *            ^          ^                             (ACK)
  *            |           --- sl811hs_Xfer -------------/ \----> ReplyMsg(iou)
  *            |                                           |
  *            |                                           v
  *             \--------------- sl811hs_Xfer -------- XfersFree
  *
- * sl811hs_BeginIO simply passes non-IOF_QUICK IORequests to the CommandTask
+ * sl811hs_BeginIO answers root hub requests that need neither the chip
+ * nor a sleep itself (see sl811hs_RootQuick), issues the first packet of
+ * a bulk or interrupt transfer itself when the CommandTask is asleep and
+ * nothing else is waiting (see sl811hs_DirectIssue), and passes everything
+ * else to the CommandTask
  *
  * The CommandTask waits for signals on its timer reply port,
  *                           signals on its interrupt signal, or
  *                           signals on its MsgPort
- *    * If a timer reply:
- *      * For each message in the timer reply port (an iou),
- *        * Remove the iou 
- *        * AddTail the iou to sl_PacketsReady
+ *    * If a timer reply (the timer wheel's tick):
+ *      * Turn the timer wheel by one slot
+ *      * For each iou in the slot:
+ *        * If its NAK timeout has passed, reply with NAKTIMEOUT
+ *        * Otherwise, queue the iou on its endpoint
  *    * If a interrupt signal:
- *      * For each message in XfersDone
- *        * Remove the Xfer
- *        * Process the status, then AddTail the Xfer to XfersDone
+ *      * For each Xfer in sl_DoneRing[]
+ *        * Take the Xfer off the ring
+ *        * Process the status
  *    * For each packet on the MsgPort, determine if we need to do
  *      Root Hub emulation, or some other non-transfer operation
  *       * If so, do the operation, and reply the message
- *       * Otherwise, add it to the tail of the sl_PacketsReady queue
- *    * While we have a packet in sl_PacketsReady:
+ *         (a root hub interrupt request with nothing to report
+ *          waits on sl_RootIntWait for the next port change)
+ *       * Otherwise, add it to the tail of its endpoint queue
+ *    * While we have a packet on an endpoint queue:
  *       * If the Endpoint is not busy:
  *           * Allocate a Xfer for it from XfersFree
  *           * If we can't allocate an Xfer from XfersFree for the iou, break
  *           * Mark the Endpoint as busy
  *           * Set the sl811hs registers for the Xfer
- *           * Remove the packet from sl_PacketsReady
- *           * Move Xfer to XfersActive
- *    * For each Xfer in XfersDone:
+ *           * Remove the packet from its endpoint queue
+ *           * Hand the Xfer to the interrupt (XFER_ACTIVE)
+ *    * For each Xfer in sl_DoneRing[]:
  *       * If the status was NAK, check for timeout/retry
  *          * If waiting for a timeout, skip to next Xfer
  *          * If flags & NAKTIMEOUT:
@@ -78,13 +85,11 @@
  *             * Otherwise, schedule a timeout:
  *                  * Move Xfer to XfersFree
  *                  * Mark endpoint as not busy
- *                  * AddTail packet to sl_PacketsReady
+ *                  * AddTail packet to its endpoint queue
  *                  * Schedule timeout
- *                    * RemHead() Timeout from TimeoutsFree
- *                    * If no free Timeouts:
- *                        * AllocMem a new one
- *                        * Copy timer request from strcut sl811hs to Timeout
- *                    * Send Timeout as an IORequest to timer.device
+ *                    * Get a Timeout from the NAK timer pool
+ *                    * Insert the iou in the timer wheel slot
+ *                      for its retry time
  *          * If !(flags & NAKTIMEOUT):
  *             * If on the 3rd retry:
  *                * Move Xfer to XfersFree
@@ -94,21 +99,103 @@
  *             * Otherwise, schedule a timeout
  *                  * Move Xfer to XfersFree
  *                  * Mark endpoint as not busy
- *                  * AddTail packet to sl_PacketsReady
+ *                  * AddTail packet to its endpoint queue
  *                  * Schedule timeout
- *                    * RemHead() Timeout from TimeoutsFree
- *                    * If no free Timeouts:
- *                        * AllocMem a new one
- *                        * Copy timer request from strcut sl811hs to Timeout
- *                    * Send Timeout as an IORequest to timer.device
+ *                    * Get a Timeout from the NAK timer pool
+ *                    * Insert the iou in the timer wheel slot
+ *                      for its retry time
+ *
+ * Ping-pong (sl_PingPong):
+ *
+ *  While a full-sized bulk packet is on the wire on one channel, the
+ *  next packet of the same iou is loaded into the other channel's half
+ *  of the FIFO (sl811hs_XferStage), with the opposite data toggle, and
+ *  hung off the active Xfer's 'chain'. When the active packet is ACKed,
+ *  sl811hs_IntServer arms the staged one immediately, so the bus does
+ *  not idle while the CommandTask processes the completion. Anything
+ *  other than a clean, full-sized ACK leaves the staged Xfer unarmed,
+ *  and the CommandTask frees it and falls back to sl811hs_Perform.
+ *
+ * Frame scheduling (sl_FrameSched):
+ *
+ *  The endpoint queues are issued by sl811hs_Schedule(), round-robin
+ *  within each class: periodic packets first, then control, then bulk,
+ *  within the time left in the current USB frame. NAKed interrupt and
+ *  iso packets are put in the slot of sl_FrameTable[] for the frame
+ *  they are due in, counting iouh_Interval from the SOF timer interrupt,
+ *  rather than put on the timer wheel.
+ *
+ * Isochronous streaming:
+ *
+ *  UHCMD_ISOXFER requests are queued on their endpoint, in a class of
+ *  their own that sl811hs_Schedule() does not touch. Every frame,
+ *  sl811hs_IsoStage() loads the next packet of each iso endpoint into
+ *  a free channel, and sl811hs_IntServer arms it at the next SOF. Iso
+ *  packets are never retried; sl811hs_IsoComplete() records how each
+ *  one went, and the stream moves on to the next frame.
+ *
+ * Direct issue (sl_DirectIssue):
+ *
+ *  The CommandTask holds sl_TaskLock whenever it is not in Wait(). If
+ *  sl811hs_BeginIO can get the lock without waiting for it, nothing of
+ *  the CommandTask's is half done, so it queues a new bulk or interrupt
+ *  request on its endpoint and runs sl811hs_Schedule() itself, provided
+ *  nothing is already waiting to be issued. The completion then goes
+ *  through the CommandTask as usual.
+ *
+ * Interrupt moderation (sl_IrqBatch, sl_IrqFrames):
+ *
+ *  Optionally, sl811hs_IntServer holds back the signal for a completed
+ *  packet until sl_IrqBatch of them are done, or sl_IrqFrames SOFs have
+ *  gone by since the first one, whichever comes first. Port changes,
+ *  and SOFs the frame scheduler asked for, still wake the CommandTask
+ *  at once, and take everything held along with them. This needs the
+ *  SOF timer, so it is not available on the simulator.
+ *
+ * Software interrupt core (sl_SoftMode):
+ *
+ *  Optionally, sl811hs_IntServer Cause()s a software interrupt for
+ *  completed packets rather than signal the CommandTask, and that
+ *  drains sl_DoneRing[], retries or replies, and issues the next
+ *  packets itself (see sl811hs_SoftIntServer). The CommandTask is
+ *  left with everything that may block: commands, port changes,
+ *  resets and the timer wheel.
+ *
+ * Poll mode (sl_PollMode):
+ *
+ *  Optionally, the CommandTask spins on INTSTATUS for a bounded time
+ *  while packets are on the wire, instead of waiting for the interrupt
+ *  (see sl811hs_Poll). Completion latency is measured either way.
+ *
+ * Interrupt-level continuation (sl_IrqContinue):
+ *
+ *  A bulk packet that is cleanly ACKed in the middle of the stream is
+ *  retired by sl811hs_IntServer itself (sl811hs_XferContinue), and its
+ *  Xfer is immediately loaded with the packet after the one on the wire.
+ *  The CommandTask is only signalled for the end of the stream, errors,
+ *  NAKs and aborts.
+ *
+ * Xfer ownership:
+ *
+ *  An Xfer in XFER_ACTIVE belongs to sl811hs_IntServer, and every other
+ *  state to the CommandTask. The CommandTask sets XFER_ACTIVE as the last
+ *  thing before it arms the channel, and the interrupt hands the Xfer back
+ *  through sl_DoneRing[], a single producer, single consumer ring. A
+ *  ping-pong packet is staged the same way, published on 'chain' behind
+ *  a barrier and stamped with the generation it follows, and the data
+ *  toggles are only written by the CommandTask, so the packet path needs
+ *  no Disable(). Queueing an iso packet on sl_IsoStaged for the next
+ *  SOF, and killing packets on a USB reset, still do.
  *
  */
 
 #include <aros/debug.h>
 #include <aros/macros.h>
 
+#include <exec/alerts.h>
 #include <exec/errors.h>
 #include <exec/lists.h>
+#include <exec/semaphores.h>
 
 #include <devices/timer.h>
 #include <devices/usbhardware.h>
@@ -116,11 +203,21 @@
 #include <devices/usb_hub.h>
 
 #include <proto/exec.h>
+#include <proto/timer.h>
 #include <proto/utility.h>
 
 #include "sl811hs.h"
+#include "sl811hs_bus.h"
 #include "sl811hs_sim.h"
 
+/* This file is the driver core, and is compiled once per bus
+ * backend (see sl811hs_bus_hw.c and sl811hs_bus_sim.c), so that
+ * every register access is resolved at compile time.
+ */
+#ifndef SL811HS_BUS_SIM
+#error "sl811hs.c must be built through sl811hs_bus_hw.c or sl811hs_bus_sim.c"
+#endif
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x)   ((sizeof(x)/sizeof((x)[0])))
 #endif
@@ -143,6 +240,62 @@
 
 #define DEFAULT_INTERVAL        32      /* 32x125us frames */
 
+/* Scheduling classes, in priority order */
+#define SCHED_ISO       0       /* Served by sl811hs_IsoStage() */
+#define SCHED_PERIODIC  1
+#define SCHED_CONTROL   2
+#define SCHED_BULK      3
+#define SCHED_CLASSES   4
+
+/* Endpoint context, allocated on first use */
+struct sl811hs_EP {
+    struct MinNode ep_Node;             /* On sl_EPRing[ep_Class], or sl_EPIdle */
+    struct sl811hs_EP *ep_Hash;         /* Next on the sl_EPHash[] chain */
+    UWORD ep_Key;                       /* See sl811hs_EPKey() */
+    UBYTE ep_Class;                     /* SCHED_* */
+    UBYTE ep_Toggle;                    /* Data toggle of the next packet */
+    UBYTE ep_Busy;                      /* Xfers in use for this endpoint */
+    UWORD ep_MaxPktSize;                /* Largest iouh_MaxPktSize seen */
+    ULONG ep_Naks;                      /* NAKs, all time */
+    ULONG ep_NakStreak;                 /* NAKs since the last ACK */
+    struct MinList ep_Packets;          /* Packets waiting for a transaction */
+};
+
+#define SL811HS_EP_HASH         32      /* Power of 2 */
+
+#define SL811HS_FRAME_SLOTS     32      /* Power of 2 */
+
+#define SL811HS_DONE_RING       4       /* Power of 2, no fewer than sl_Xfer[] */
+
+/* Keeps the compiler from moving memory accesses across it. The
+ * CPU does not reorder them as seen by an interrupt on the same CPU.
+ */
+#define SL811HS_BARRIER()       __asm__ __volatile__ ("" : : : "memory")
+
+#define SL811HS_WHEEL_BITS      6
+#define SL811HS_WHEEL_SLOTS     (1 << SL811HS_WHEEL_BITS)
+#define SL811HS_WHEEL_LEVELS    3       /* 64ms, 4s and 4m spans */
+#define SL811HS_WHEEL_TICK      8       /* uFrames per wheel slot */
+
+#define SL811HS_NAK_BACKOFF_MAX 512     /* uFrames, adaptive NAK backoff limit */
+
+#define SL811HS_POOL_NAKTIMERS  16      /* NAK timers per pool chunk */
+#define SL811HS_POOL_EPS        8       /* Endpoint contexts per pool chunk */
+
+/* Pool of fixed-size objects, carved out of chunks that are
+ * only given back to the system at detach. Every object must
+ * start with a MinNode, which links it while it is free.
+ */
+struct sl811hs_Pool {
+    struct MinList sp_Free;             /* Free objects */
+    struct MinList sp_Chunks;           /* Chunks allocated */
+    ULONG sp_Size;                      /* Bytes per object */
+    ULONG sp_Grow;                      /* Objects per chunk */
+    ULONG sp_Used;                      /* Objects handed out */
+    ULONG sp_Peak;                      /* High-water mark of sp_Used */
+    BOOL  sp_NoGrow;                    /* No AllocMem(), see sl811hs_SoftIntServer */
+};
+
 #define C_HUB_LOCAL_POWER       0
 #define C_HUB_OVER_CURRENT      1
 #define PORT_CONNECTION         0
@@ -162,6 +315,7 @@
 
 struct sl811hs {
     struct Node sl_Node;        /* For public use by that which allocates us */
+    const struct sl811hs_Bus *sl_Bus;   /* Must follow sl_Node, see struct sl811hs_Head */
 
     /* Clockport Interface */
     int sl_Irq;
@@ -175,36 +329,119 @@ struct sl811hs {
     /* Internal state */
     UBYTE sl_State;
 
-    UBYTE sl_CurrAddr;
+    UBYTE sl_CurrAddr;                  /* Address of the next data cycle */
+    BOOL  sl_AutoInc;                   /* Autoincrement can be trusted */
+    ULONG sl_AddrEpoch;                 /* sl_IrqCount at the last address cycle */
+
+    UBYTE sl_Shadow[16];                /* Last value written to each register */
+    UWORD sl_ShadowValid;               /* Which sl_Shadow[] entries are valid */
+    volatile UWORD sl_ShadowStale;      /* Registers written by sl811hs_IntServer */
+    volatile BOOL sl_InIrq;             /* sl811hs_IntServer is running */
 
     BOOL  sl_PortScanned;
     UWORD sl_PortStatus;
     UWORD sl_PortChange;
 
     BYTE  sl_Errata;
+    volatile ULONG sl_IrqCount;         /* Bumped by every sl811hs_IntServer run */
+
+    /* FIFO burst routines, selected by sl811hs_Attach() */
+    void (*sl_FifoWrite)(struct sl811hs *sl, UBYTE base, const UBYTE *data, UBYTE len);
+    void (*sl_FifoRead)(struct sl811hs *sl, UBYTE base, UBYTE *data, UBYTE len);
 
     UBYTE sl_PacketStatus;
 
     struct Task *sl_CommandTask;
     struct MsgPort *sl_CommandPort;
 
-    ULONG sl_DevEP_Toggle[128];         /* Upper 16-bits are OUT toggle,
-                                         * lower 16-bits are IN toggle
-                                         */
+    struct sl811hs_EP *sl_EPHash[SL811HS_EP_HASH]; /* Endpoint contexts, by key */
+    struct sl811hs_EP *sl_EPLast;       /* Last endpoint looked up */
+    struct sl811hs_Pool sl_EPPool;      /* struct sl811hs_EP */
 
+    /* Held by the CommandTask while it changes the port state, and by
+     * sl811hs_BeginIO while it answers a root hub request from it.
+     */
+    struct SignalSemaphore sl_RootLock;
     UBYTE sl_RootDevAddr;
     UBYTE sl_RootConfiguration;
-
-    struct MinList sl_NakTimersFree;    /* Free NAK timers */
-    struct MinList sl_PacketsDelayed;   /* Running NAK timers */
-    struct MinList sl_PacketsReady;     /* Packets waiting for a transaction */
+    struct MinList sl_RootIntWait;      /* Root hub interrupt requests, waiting for a change */
+
+    struct sl811hs_Pool sl_NakPool;     /* struct sl811hs_NakTimer */
+    struct MinList sl_Wheel[SL811HS_WHEEL_LEVELS][SL811HS_WHEEL_SLOTS]; /* NAKed packets, by due tick */
+    ULONG sl_WheelNow;                  /* Wheel ticks so far */
+    ULONG sl_WheelPending;              /* Packets on sl_Wheel[][] */
+    struct timerequest sl_WheelTick;    /* The wheel's one timer request */
+    BOOL  sl_WheelTicking;              /* sl_WheelTick is at timer.device */
+
+    UBYTE sl_NakPolicy;                 /* SL811HS_NAKPOLICY_* */
+    ULONG sl_NakImmediate;              /* NAKs retried at once */
+    ULONG sl_NakDeferred;               /* NAKs retried in a later frame */
+    ULONG sl_NakGiveUp;                 /* Requests replied with a NAK error */
+    struct MinList sl_FrameTable[SL811HS_FRAME_SLOTS]; /* NAKed periodic packets, by due frame */
+    ULONG sl_FramePending;              /* Packets in sl_FrameTable[] */
+    struct MinList sl_EPRing[SCHED_CLASSES]; /* Endpoints with packets waiting */
+    struct MinList sl_EPIdle;           /* Endpoints with nothing waiting */
+    struct MinList sl_IsoStaged;        /* Iso Xfers to arm at the next SOF */
+    volatile BOOL sl_BulkYield;         /* Periodic or control packets are waiting */
     struct MinList sl_XfersFree;        /* Xfers available */
-    struct MinList sl_XfersActive;      /* Xfers in-flight */
-    struct MinList sl_XfersDone;        /* Xfers holding done packets */
+    struct sl811hs_Xfer *sl_DoneRing[SL811HS_DONE_RING]; /* Xfers holding done packets */
+    volatile UBYTE sl_DoneHead;         /* Next slot to fill, by the interrupt only */
+    volatile UBYTE sl_DoneTail;         /* Next slot to drain, by the CommandTask only */
+
+    BOOL  sl_PingPong;                  /* Stage bulk packets on the idle channel */
+    BOOL  sl_IrqContinue;               /* Continue bulk streams from the interrupt */
+
+    /* Held by the CommandTask except while it waits for work */
+    struct SignalSemaphore sl_TaskLock;
+    volatile UWORD sl_CoreBusy;         /* sl_TaskLock and sl_RootLock holds, see sl811hs_CoreObtain() */
+    BOOL  sl_DirectIssue;               /* Issue from sl811hs_BeginIO when idle */
+
+    BOOL  sl_FrameSched;                /* Schedule transfers by USB frame */
+    volatile BOOL sl_FrameWanted;       /* SOF timer interrupt is enabled */
+    volatile ULONG sl_Frame;            /* SOF timer interrupts seen */
+    ULONG sl_FrameSeen;                 /* sl_Frame at the last sl811hs_FrameTick() */
+    BOOL  sl_FrameDeferred;             /* Packets are waiting for frame time */
+
+    UBYTE sl_IrqBatch;                  /* Completions per CommandTask wakeup */
+    UBYTE sl_IrqFrames;                 /* ..or frames to hold the first one */
+    volatile BOOL sl_IrqModerated;      /* SOF timer interrupt is enabled for that */
+    volatile UWORD sl_IrqHeld;          /* Completions not signalled yet */
+    volatile ULONG sl_IrqHeldFrame;     /* sl_Frame at the first of them */
+    volatile ULONG sl_IrqWakeups;       /* CommandTask wakeups, since attach */
+    volatile ULONG sl_IrqSaved;         /* ..and wakeups saved by holding back */
+    UBYTE sl_IntEnable;                 /* INTENABLE, as set by sl811hs_FrameArm() */
+
+    BOOL  sl_SoftMode;                  /* Process completions in sl_SoftInt */
+    struct Interrupt sl_SoftInt;        /* ..Cause()d by sl811hs_IntServer */
+    ULONG sl_SoftRuns;                  /* sl_SoftInt runs that did the work */
+    ULONG sl_SoftDeferred;              /* ..and that left it to the CommandTask */
+
+    BOOL  sl_PollMode;                  /* Spin on INTSTATUS while packets are on the wire */
+    volatile BOOL sl_Polling;           /* sl811hs_Poll() is spinning */
+    ULONG sl_EClockFreq;                /* E-clock ticks per second */
+    struct sl811hs_Latency {            /* Packet armed to completion seen, in E-clock ticks */
+        ULONG lt_Count;
+        ULONG lt_Total;
+        ULONG lt_Max;
+    } sl_Latency[3];                    /* By interrupt, by polling, by software interrupt */
+    struct sl811hs_Latency sl_AbortLatency; /* AbortIO() to reply */
+#define SL811HS_ABORT_SLOTS 4
+    struct sl811hs_Abort {              /* ..for the last few AbortIO() calls */
+        struct IORequest *ab_Req;
+        ULONG ab_Start;
+    } sl_Abort[SL811HS_ABORT_SLOTS];
+    UBYTE sl_AbortNext;
+    ULONG sl_AbortDeferred;             /* Aborts not replied by AbortIO() */
+    volatile BOOL sl_AbortPending;      /* ..or to the CommandTask, see sl811hs_CancelFlagged() */
 
     struct sl811hs_Xfer {
         struct MinNode node;
         int ab;         /* 0 for A, 8 for B */
+#define XFER_FREE       0       /* On sl_XfersFree */
+#define XFER_STAGED     1       /* Loaded, waiting for 'chain' owner to ACK */
+#define XFER_ACTIVE     2       /* On the wire, owned by the interrupt */
+#define XFER_DONE       3       /* On sl_DoneRing[], owned by the CommandTask */
+        volatile UBYTE state;
         UBYTE ctl;      /* HOSTCONTROL value */
         UBYTE base;     /* Location in FIFO */
         UBYTE maxlen;
@@ -214,10 +451,26 @@ struct sl811hs {
         UBYTE dev;
         UBYTE *data;
         IPTR nstate;    /* Next IOU state */
+        ULONG frame;    /* Packet index of an iso request */
         struct IOUsbHWReq *iou;
+        struct sl811hs_EP *ep;
+        struct sl811hs_Xfer *chain;     /* Staged packet to arm on ACK */
+        volatile UBYTE gen;     /* Bumped when the interrupt re-uses the Xfer */
+        UBYTE chaingen; /* 'gen' of the Xfer this one was staged behind */
+        ULONG armed;    /* E-clock when armed by sl811hs_XferIssue(), or 0 */
+        BOOL polled;    /* Completion was seen by sl811hs_Poll() */
+        struct {        /* OUT payload already loaded in the FIFO window */
+            struct IOUsbHWReq *iou;
+            UBYTE *data;
+            UBYTE len;
+        } fifo;
     } sl_Xfer[2];
-#if DEBUG
+#if SL811HS_BUS_SIM
     struct sl811hs_sim sl_Sim;
+#if SL811HS_SIM_STRESS
+    ULONG sl_SimArmed;                  /* Xfers handed to the interrupt */
+    ULONG sl_SimDrained;                /* ..and taken back by the CommandTask */
+#endif
 #endif
 };
 
@@ -263,14 +516,160 @@ static const char const *CmdNames[] = {
 #endif
 
 
-static inline void resume(struct sl811hs *sl)
+/* Bus backend primitives
+ *
+ * Exactly one set is compiled into each instance of the core.
+ */
+#if SL811HS_BUS_SIM
+static inline void bus_Addr(struct sl811hs *sl, UBYTE addr)
+{
+    sl811hs_sim_Write(&sl->sl_Sim, 0, addr);
+}
+
+static inline UBYTE bus_Read(struct sl811hs *sl)
+{
+    return sl811hs_sim_Read(&sl->sl_Sim, 1);
+}
+
+static inline void bus_Write(struct sl811hs *sl, UBYTE val)
+{
+    sl811hs_sim_Write(&sl->sl_Sim, 1, val);
+}
+
+static inline void bus_Resume(struct sl811hs *sl)
+{
+    /* Resume is a no-op for the sim */
+}
+
+static inline void bus_Idle(struct sl811hs *sl)
+{
+    sl811hs_sim_Idle(&sl->sl_Sim);
+}
+#else
+static inline void bus_Addr(struct sl811hs *sl, UBYTE addr)
+{
+    *(sl->sl_Addr) = addr;
+}
+
+static inline UBYTE bus_Read(struct sl811hs *sl)
+{
+    return *(sl->sl_Data);
+}
+
+static inline void bus_Write(struct sl811hs *sl, UBYTE val)
+{
+    *(sl->sl_Data) = val;
+}
+
+static inline void bus_Resume(struct sl811hs *sl)
 {
-#if DEBUG
-    if (sl->sl_Addr == NULL) {
-        /* Resume is a no-op for the sim */
-    } else
-#endif
     *(sl->sl_Data) = 0;
+}
+
+static inline void bus_Idle(struct sl811hs *sl)
+{
+    /* The chip's interrupt needs no help */
+}
+#endif
+
+/* Register shadow
+ *
+ * Registers that simply latch the written value are shadowed,
+ * so that writing back the value the chip already holds costs
+ * no bus cycles at all. HOSTCTRL is only shadowed while disarmed,
+ * as the chip clears ARM on its own. INTSTATUS is write-to-clear,
+ * and is never shadowed.
+ *
+ * The shadow belongs to the CommandTask. Writes made by
+ * sl811hs_IntServer bypass it, and are only recorded in
+ * sl_ShadowStale, which the CommandTask folds in before it
+ * trusts the shadow again.
+ */
+#define SL811HS_SHADOW_MASK     ((1 << SL811HS_HOSTBASE) | \
+                                 (1 << SL811HS_HOSTLEN) | \
+                                 (1 << SL811HS_HOSTID) | \
+                                 (1 << SL811HS_HOSTDEVICEADDR) | \
+                                 (1 << SL811HS_CONTROL1) | \
+                                 (1 << SL811HS_INTENABLE) | \
+                                 (1 << (SL811HS_HOSTBASE + 8)) | \
+                                 (1 << (SL811HS_HOSTLEN + 8)) | \
+                                 (1 << (SL811HS_HOSTID + 8)) | \
+                                 (1 << (SL811HS_HOSTDEVICEADDR + 8)) | \
+                                 (1 << SL811HS_SOFLOW) | \
+                                 (1 << SL811HS_CONTROL2))
+
+static inline void sl811hs_ShadowInvalidate(struct sl811hs *sl)
+{
+    sl->sl_ShadowValid = 0;
+}
+
+static inline void sl811hs_ShadowSync(struct sl811hs *sl)
+{
+    if (sl->sl_ShadowStale) {
+        Disable();
+        sl->sl_ShadowValid &= ~sl->sl_ShadowStale;
+        sl->sl_ShadowStale = 0;
+        Enable();
+    }
+}
+
+static inline BOOL sl811hs_ShadowMatch(struct sl811hs *sl, UBYTE addr, UBYTE val)
+{
+    if (addr >= ARRAY_SIZE(sl->sl_Shadow))
+        return FALSE;
+
+    sl811hs_ShadowSync(sl);
+
+    return ((sl->sl_ShadowValid & (1 << addr)) && sl->sl_Shadow[addr] == val) ? TRUE : FALSE;
+}
+
+static inline void sl811hs_ShadowUpdate(struct sl811hs *sl, UBYTE addr, UBYTE val)
+{
+    if (addr >= ARRAY_SIZE(sl->sl_Shadow))
+        return;
+
+    if ((SL811HS_SHADOW_MASK & (1 << addr)) ||
+        (((addr & 7) == SL811HS_HOSTCTRL) && !(val & SL811HS_HOSTCTRL_ARM))) {
+        sl->sl_Shadow[addr] = val;
+        sl->sl_ShadowValid |= (1 << addr);
+    } else {
+        sl->sl_ShadowValid &= ~(1 << addr);
+    }
+}
+
+/* Address tracking
+ *
+ * sl_CurrAddr is the address of the next data cycle. When the
+ * autoincrement can be trusted, and sl811hs_IntServer has not
+ * run since the last address cycle, the chip already points
+ * there, and the address cycle is skipped.
+ *
+ * The address is always recorded before the address port is
+ * written, so the address save/restore in sl811hs_IntServer is
+ * correct at any point. Its own register accesses leave
+ * sl_AddrEpoch at the bumped sl_IrqCount, so after the restore it
+ * sets it one behind, as resume() does, which forces a fresh
+ * address cycle on the next access.
+ */
+static inline void sl811hs_SetAddr(struct sl811hs *sl, UBYTE addr)
+{
+    if (sl->sl_AutoInc &&
+        sl->sl_CurrAddr == addr &&
+        sl->sl_AddrEpoch == sl->sl_IrqCount)
+        return;
+
+    sl->sl_AddrEpoch = sl->sl_IrqCount;
+    sl->sl_CurrAddr = addr;
+    bus_Addr(sl, addr);
+}
+
+static inline void resume(struct sl811hs *sl)
+{
+    bus_Resume(sl);
+
+    /* The wakeup write lands wherever the chip was pointing */
+    sl->sl_AddrEpoch = sl->sl_IrqCount - 1;
+    sl811hs_ShadowInvalidate(sl);
 
     D2(ebug("\n"));
 }
@@ -279,84 +678,160 @@ static inline UBYTE rb(struct sl811hs *sl, UBYTE addr)
 {
     UBYTE val;
 
-    sl->sl_CurrAddr = addr;
+    sl811hs_SetAddr(sl, addr);
 
-#if DEBUG
-    if (sl->sl_Addr == NULL) {
-        sl811hs_sim_Write(&sl->sl_Sim, 0, addr);
-        val = sl811hs_sim_Read(&sl->sl_Sim, 1);
-    } else
-#endif
-    {
-        *(sl->sl_Addr) = addr;
-        val = *(sl->sl_Data);
-    }
+    val = bus_Read(sl);
+    sl->sl_CurrAddr = addr + 1;
 
-    D2(ebug("%02x = %02x\n", sl->sl_CurrAddr, val));
+    D2(ebug("%02x = %02x\n", addr, val));
     return val;
 }
 
 static inline void wb(struct sl811hs *sl, UBYTE addr, UBYTE val)
 {
-    sl->sl_CurrAddr = addr;
-    D2(ebug("%02x = %02x\n", sl->sl_CurrAddr, val));
+    if (sl->sl_InIrq) {
+        D2(ebug("%02x = %02x (irq)\n", addr, val));
+        sl811hs_SetAddr(sl, addr);
+        bus_Write(sl, val);
+        sl->sl_CurrAddr = addr + 1;
+        if (addr < ARRAY_SIZE(sl->sl_Shadow))
+            sl->sl_ShadowStale |= (1 << addr);
+        return;
+    }
 
-#if DEBUG
-    if (sl->sl_Addr == NULL) {
-        sl811hs_sim_Write(&sl->sl_Sim, 0, addr);
-        sl811hs_sim_Write(&sl->sl_Sim, 1, val);
+    if (sl811hs_ShadowMatch(sl, addr, val)) {
+        D2(ebug("%02x = %02x (shadowed)\n", addr, val));
         return;
     }
-#endif
 
-    *(sl->sl_Addr) = addr;
-    *(sl->sl_Data) = val;
+    D2(ebug("%02x = %02x\n", addr, val));
+    sl811hs_SetAddr(sl, addr);
+
+    bus_Write(sl, val);
+    sl->sl_CurrAddr = addr + 1;
+
+    sl811hs_ShadowUpdate(sl, addr, val);
 }
 
+/* SL811HS <= 1.5 has a broken autoincrement under certain
+ * conditions, so sl_AutoInc is FALSE for those, and
+ * sl811hs_SetAddr() issues an address cycle for every byte.
+ */
 static inline UBYTE rn(struct sl811hs *sl)
 {
+    UBYTE addr = sl->sl_CurrAddr;
     UBYTE val;
-    sl->sl_CurrAddr++;
 
-#if DEBUG
-    if (sl->sl_Addr == NULL) {
-        val = sl811hs_sim_Read(&sl->sl_Sim, 1);
-    } else
-#endif
-    {
-        /* SL811HS < 1.5 has a broken
-         * autoincrement under certain conditions.
-         */
-        if (sl->sl_Errata <= SL811HS_ERRATA_1_5) {
-           *(sl->sl_Addr) = sl->sl_CurrAddr;
-        }
-        val = *(sl->sl_Data);
-    }
+    sl811hs_SetAddr(sl, addr);
+
+    val = bus_Read(sl);
+    sl->sl_CurrAddr = addr + 1;
 
-    D2(ebug("%02x = %02x\n", sl->sl_CurrAddr, val));
+    D2(ebug("%02x = %02x\n", addr, val));
     return val;
 }
 
 static inline void wn(struct sl811hs *sl, UBYTE val)
 {
-    sl->sl_CurrAddr++;
+    UBYTE addr = sl->sl_CurrAddr;
 
-    D2(ebug("%02x = %02x\n", sl->sl_CurrAddr, val));
+    D2(ebug("%02x = %02x\n", addr, val));
 
-#if DEBUG
-    if (sl->sl_Addr == NULL) {
-        sl811hs_sim_Write(&sl->sl_Sim, 1, val);
-        return;
-    }
+    sl811hs_SetAddr(sl, addr);
+
+    bus_Write(sl, val);
+    sl->sl_CurrAddr = addr + 1;
+
+    sl811hs_ShadowUpdate(sl, addr, val);
+}
+
+/* FIFO bursts
+ *
+ * The burst routines do not keep sl_CurrAddr up to date for
+ * every byte, so if sl811hs_IntServer runs in the middle of a
+ * burst (and moves the address pointer) the whole burst is
+ * simply repeated. The damage is confined to the FIFO bytes
+ * that are rewritten (or re-read) anyway.
+ *
+ * Only revision 1.5 parts are accepted by sl811hs_UnitAttach()
+ * and sl811hs_ResetHW(), so the hardware only has the errata
+ * routines. A single address cycle burst can be added once a
+ * revision with a trustworthy autoincrement is accepted.
+ */
+
+/* SL811HS <= 1.5 has a broken autoincrement under certain
+ * conditions, so every byte gets its own address cycle.
+ */
+static void sl811hs_FifoWriteErrata(struct sl811hs *sl, UBYTE base, const UBYTE *data, UBYTE len)
+{
+    volatile UBYTE *addr = sl->sl_Addr;
+    volatile UBYTE *port = sl->sl_Data;
+    ULONG irqs;
+    UBYTE i;
+
+    do {
+        irqs = sl->sl_IrqCount;
+        sl->sl_AddrEpoch = irqs;
+        sl->sl_CurrAddr = base;
+        for (i = 0; i < len; i++) {
+            *addr = base + i;
+            *port = data[i];
+        }
+    } while (irqs != sl->sl_IrqCount);
+
+    sl->sl_CurrAddr = base + len;
+}
+
+static void sl811hs_FifoReadErrata(struct sl811hs *sl, UBYTE base, UBYTE *data, UBYTE len)
+{
+    volatile UBYTE *addr = sl->sl_Addr;
+    volatile UBYTE *port = sl->sl_Data;
+    ULONG irqs;
+    UBYTE i;
+
+    do {
+        irqs = sl->sl_IrqCount;
+        sl->sl_AddrEpoch = irqs;
+        sl->sl_CurrAddr = base;
+        for (i = 0; i < len; i++) {
+            *addr = base + i;
+            data[i] = *port;
+        }
+    } while (irqs != sl->sl_IrqCount);
+
+    sl->sl_CurrAddr = base + len;
+}
+
+#if SL811HS_BUS_SIM
+static void sl811hs_FifoWriteSim(struct sl811hs *sl, UBYTE base, const UBYTE *data, UBYTE len)
+{
+    sl811hs_SetAddr(sl, base);
+    sl->sl_CurrAddr = base + len;
+    while (len--)
+        sl811hs_sim_Write(&sl->sl_Sim, 1, *(data++));
+}
+
+static void sl811hs_FifoReadSim(struct sl811hs *sl, UBYTE base, UBYTE *data, UBYTE len)
+{
+    sl811hs_SetAddr(sl, base);
+    sl->sl_CurrAddr = base + len;
+    while (len--)
+        *(data++) = sl811hs_sim_Read(&sl->sl_Sim, 1);
+}
 #endif
 
-    /* SL811HS < 1.5 has a broken
-     * autoincrement under certain conditions.
-     */
-    if (sl->sl_Errata <= SL811HS_ERRATA_1_5) {
-        *(sl->sl_Addr) = sl->sl_CurrAddr;
-    }
-    *(sl->sl_Data) = val;
+static inline void sl811hs_FifoWrite(struct sl811hs *sl, UBYTE base, const UBYTE *data, UBYTE len)
+{
+    D2(ebug("FIFO %02x <= %d bytes\n", base, len));
+    if (len > 0)
+        sl->sl_FifoWrite(sl, base, data, len);
+}
+
+static inline void sl811hs_FifoRead(struct sl811hs *sl, UBYTE base, UBYTE *data, UBYTE len)
+{
+    D2(ebug("FIFO %02x => %d bytes\n", base, len));
+    if (len > 0)
+        sl->sl_FifoRead(sl, base, data, len);
 }
 
 static inline BOOL iouIsOut(struct IOUsbHWReq *iou)
@@ -367,918 +842,1958 @@ static inline BOOL iouIsOut(struct IOUsbHWReq *iou)
     return (iou->iouh_Dir == UHDIR_OUT) ? TRUE : FALSE;
 }
 
-static inline BOOL sl811hs_ToggleState(struct sl811hs *sl, struct IOUsbHWReq *iou)
+/* Data toggles live in the endpoint context, and only the
+ * CommandTask writes them. While a stream is on the wire, the
+ * toggle is carried by the DATA bit in each Xfer's 'ctl', which
+ * is all sl811hs_XferContinue() looks at, and the endpoint is
+ * brought up to date from the packet the CommandTask retires.
+ */
+static inline BOOL sl811hs_ToggleState(struct sl811hs_EP *ep)
 {
-    int dev = iou->iouh_DevAddr & 127;
-    int ep  = iou->iouh_Endpoint & 0xf;
-    if (iouIsOut(iou))
-        ep += 16;
+    return ep->ep_Toggle ? TRUE : FALSE;
+}
 
-    return (sl->sl_DevEP_Toggle[dev] & (1 << ep)) ? TRUE : FALSE;
+static inline void sl811hs_ToggleRetire(struct sl811hs_EP *ep, UBYTE ctl, BOOL acked)
+{
+    ep->ep_Toggle = ((ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0) ^ (acked ? 1 : 0);
 }
 
-static inline void sl811hs_ToggleFlip(struct sl811hs *sl, struct IOUsbHWReq *iou)
+static inline void sl811hs_ToggleClear(struct sl811hs_EP *ep)
 {
-    int dev = iou->iouh_DevAddr & 127;
-    int ep  = iou->iouh_Endpoint & 0xf;
-    if (iouIsOut(iou))
-        ep += 16;
+    ep->ep_Toggle = 0;
+}
 
-   sl->sl_DevEP_Toggle[dev] ^= (1 << ep);
+static inline void sl811hs_ToggleSet(struct sl811hs_EP *ep)
+{
+    ep->ep_Toggle = 1;
 }
 
-static inline void sl811hs_ToggleClear(struct sl811hs *sl, struct IOUsbHWReq *iou)
+/* Add another chunk of objects to a pool */
+static BOOL sl811hs_PoolGrow(struct sl811hs_Pool *sp)
 {
-    int dev = iou->iouh_DevAddr & 127;
-    int ep  = iou->iouh_Endpoint & 0xf;
-    if (iouIsOut(iou))
-        ep += 16;
+    struct MinNode *chunk;
+    UBYTE *obj;
+    ULONG i;
+
+    chunk = AllocMem(sizeof(*chunk) + sp->sp_Size * sp->sp_Grow, MEMF_ANY);
+    if (chunk == NULL)
+        return FALSE;
+
+    AddTail((struct List *)&sp->sp_Chunks, (struct Node *)chunk);
 
+    obj = (UBYTE *)(chunk + 1);
+    for (i = 0; i < sp->sp_Grow; i++, obj += sp->sp_Size)
+        AddTail((struct List *)&sp->sp_Free, (struct Node *)obj);
 
-    sl->sl_DevEP_Toggle[dev] &= ~(1 << ep);
+    return TRUE;
 }
 
-static inline void sl811hs_ToggleSet(struct sl811hs *sl, struct IOUsbHWReq *iou)
+/* Set up a pool, with its first chunk already allocated */
+static void sl811hs_PoolInit(struct sl811hs_Pool *sp, ULONG size, ULONG grow)
 {
-    int dev = iou->iouh_DevAddr & 127;
-    int ep  = iou->iouh_Endpoint & 0xf;
-    if (iouIsOut(iou))
-        ep += 16;
-
-    sl->sl_DevEP_Toggle[dev] |= 1 << ep;
+    NEWLIST(&sp->sp_Free);
+    NEWLIST(&sp->sp_Chunks);
+    sp->sp_Size = (size + sizeof(IPTR) - 1) & ~(sizeof(IPTR) - 1);
+    sp->sp_Grow = grow;
+    sp->sp_Used = 0;
+    sp->sp_Peak = 0;
+
+    /* If this fails, we'll try again on first use */
+    sl811hs_PoolGrow(sp);
 }
 
-static void sl811hs_XferIssue(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+static APTR sl811hs_PoolGet(struct sl811hs_Pool *sp)
 {
-    UBYTE ctl, *data, len;
-    
-    ctl = xfer->ctl;
-    data = xfer->data;
-    len = xfer->len;
+    struct MinNode *obj;
 
-    if (sl->sl_PortStatus & (1 << PORT_LOW_SPEED))
-        ctl |= SL811HS_HOSTCTRL_PREAMBLE;
+    obj = (struct MinNode *)RemHead((struct List *)&sp->sp_Free);
+    if (obj == NULL) {
+        if (sp->sp_NoGrow || !sl811hs_PoolGrow(sp))
+            return NULL;
+        obj = (struct MinNode *)RemHead((struct List *)&sp->sp_Free);
+    }
 
-    if (sl811hs_ToggleState(sl, xfer->iou))
-        ctl |= SL811HS_HOSTCTRL_DATA1;
-    else
-        ctl |= SL811HS_HOSTCTRL_DATA0;
+    if (++sp->sp_Used > sp->sp_Peak)
+        sp->sp_Peak = sp->sp_Used;
 
-    ctl |= SL811HS_HOSTCTRL_ENABLE | SL811HS_HOSTCTRL_ARM;
+    return obj;
+}
 
-    if (((ctl & SL811HS_HOSTCTRL_DIR) == SL811HS_HOSTCTRL_DIR_OUT) && (len > 0)) {
-        wb(sl, xfer->base, *(data++));
-        for (len--; len > 0; len--, data++)
-            wn(sl, *data);
+static void sl811hs_PoolPut(struct sl811hs_Pool *sp, APTR obj)
+{
+    /* Most recently used first, as it is likely still in cache */
+    AddHead((struct List *)&sp->sp_Free, (struct Node *)obj);
+    sp->sp_Used--;
+}
+
+/* Are there at least 'want' free objects, without growing? */
+static BOOL sl811hs_PoolSpare(struct sl811hs_Pool *sp, ULONG want)
+{
+    struct MinNode *obj;
+
+    ForeachNode(&sp->sp_Free, obj) {
+        if (want == 0)
+            break;
+        want--;
     }
 
-  
-    Disable();
-    AddTail((struct List *)&sl->sl_XfersActive, (struct Node *)xfer);
-    Enable();
+    return (want == 0) ? TRUE : FALSE;
+}
 
-    wb(sl, xfer->ab + SL811HS_HOSTBASE, xfer->base);
-    wn(sl, xfer->len);
-    wn(sl, xfer->pidep);
-    wn(sl, xfer->dev);
+static void sl811hs_PoolFree(struct sl811hs_Pool *sp)
+{
+    struct MinNode *chunk;
 
-    D2(ebug("%p DATA%d %s\n", xfer->iou, (ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0, PIDNAME(SL811HS_HOSTID_PID_of(xfer->pidep))));
+    while ((chunk = (struct MinNode *)RemHead((struct List *)&sp->sp_Chunks)))
+        FreeMem(chunk, sizeof(*chunk) + sp->sp_Size * sp->sp_Grow);
+
+    NEWLIST(&sp->sp_Free);
+}
+
+/* Endpoint contexts
+ *
+ * Each (device, endpoint, direction) in use has a context,
+ * found through a small hash, with the last lookup cached.
+ */
+static inline UWORD sl811hs_EPKey(struct IOUsbHWReq *iou)
+{
+    UWORD key = ((iou->iouh_DevAddr & 0x7f) << 5) |
+                ((iou->iouh_Endpoint & 0xf) << 1);
+
+    /* Control endpoints are bidirectional */
+    if (iou->iouh_Req.io_Command != UHCMD_CONTROLXFER && !iouIsOut(iou))
+        key |= 1;
+
+    return key;
+}
+
+static inline ULONG sl811hs_EPHash(UWORD key)
+{
+    return (key ^ (key >> 5)) & (SL811HS_EP_HASH - 1);
+}
 
-#ifndef DEBUG
-    /* Errata 1.5, section 2 */
-    if (!(sl->sl_PortStatus & (1 << PORT_LOW_SPEED))) {
-        int ticks = (xfer->len >> 3) + 3;
-        if (rb(sl, SL811HS_SOFHIGH) <= ticks)
-            ctl |= SL811HS_HOSTCTRL_SYNCSOF;
+static struct sl811hs_EP *sl811hs_EPFind(struct sl811hs *sl, UWORD key)
+{
+    struct sl811hs_EP *ep;
+
+    ep = sl->sl_EPLast;
+    if (ep && ep->ep_Key == key)
+        return ep;
+
+    for (ep = sl->sl_EPHash[sl811hs_EPHash(key)]; ep; ep = ep->ep_Hash) {
+        if (ep->ep_Key == key) {
+            sl->sl_EPLast = ep;
+            return ep;
+        }
     }
-#endif
 
-    xfer->ctl = ctl;
-    wb(sl, xfer->ab + SL811HS_HOSTCTRL, ctl);
+    return NULL;
 }
 
-AROS_INTH1(sl811hs_IntServer, struct sl811hs *, sl)
+static struct sl811hs_EP *sl811hs_EPAlloc(struct sl811hs *sl, UWORD key)
 {
-    AROS_INTFUNC_INIT
+    struct sl811hs_EP *ep;
+    ULONG hash = sl811hs_EPHash(key);
 
-    UBYTE status;
-    UBYTE curraddr;
+    ep = sl811hs_PoolGet(&sl->sl_EPPool);
+    if (ep == NULL)
+        return NULL;
 
-    curraddr = sl->sl_CurrAddr;
-    status = rb(sl, SL811HS_INTSTATUS);
+    ep->ep_Key = key;
+    ep->ep_Class = 0;
+    ep->ep_Toggle = 0;
+    ep->ep_Busy = 0;
+    ep->ep_MaxPktSize = 0;
+    ep->ep_Naks = 0;
+    ep->ep_NakStreak = 0;
+    NEWLIST(&ep->ep_Packets);
+    AddTail((struct List *)&sl->sl_EPIdle, (struct Node *)ep);
+
+    ep->ep_Hash = sl->sl_EPHash[hash];
+    sl->sl_EPHash[hash] = ep;
+    sl->sl_EPLast = ep;
+
+    return ep;
+}
 
-    D2(ebug("IntStatus %02x\n", status));
-    if (status & SL811HS_INTMASK_CHANGED) {
-        sl->sl_PortScanned = FALSE;
+static void sl811hs_EPFree(struct sl811hs *sl, struct sl811hs_EP *ep)
+{
+    struct sl811hs_EP **epp;
+
+    for (epp = &sl->sl_EPHash[sl811hs_EPHash(ep->ep_Key)]; *epp; epp = &(*epp)->ep_Hash) {
+        if (*epp == ep) {
+            *epp = ep->ep_Hash;
+            break;
+        }
     }
 
-    if (status & SL811HS_INTMASK_USB_A) {
-        if (sl->sl_Xfer[0].iou != NULL) {
-            Remove((struct Node *)&sl->sl_Xfer[0]);
-            AddTail((struct List *)&sl->sl_XfersDone, (struct Node *)&sl->sl_Xfer[0]);
+    if (sl->sl_EPLast == ep)
+        sl->sl_EPLast = NULL;
+
+    Remove((struct Node *)ep);
+    sl811hs_PoolPut(&sl->sl_EPPool, ep);
+}
+
+/* After a USB reset: all toggles are DATA0 again, and
+ * idle endpoints are forgotten.
+ */
+static void sl811hs_EPReset(struct sl811hs *sl)
+{
+    struct sl811hs_EP *ep, *ep_next;
+    int i;
+
+    for (i = 0; i < SCHED_CLASSES; i++) {
+        ForeachNode(&sl->sl_EPRing[i], ep) {
+            ep->ep_Toggle = 0;
+            ep->ep_NakStreak = 0;
         }
     }
 
-#ifdef ENABLE_B
-    if (status & SL811HS_INTMASK_USB_B) {
-        if (sl->sl_Xfer[1].iou != NULL) {
-            Remove((struct Node *)&sl->sl_Xfer[1]);
-            AddTail((struct List *)&sl->sl_XfersDone, (struct Node *)&sl->sl_Xfer[1]);
+    ForeachNodeSafe(&sl->sl_EPIdle, ep, ep_next) {
+        if (ep->ep_Busy) {
+            ep->ep_Toggle = 0;
+            ep->ep_NakStreak = 0;
+        } else {
+            sl811hs_EPFree(sl, ep);
         }
     }
-#endif
+}
 
-    wb(sl, SL811HS_INTSTATUS, status);
+/* Forget any FIFO payload held on behalf of an IORequest,
+ * as its buffer belongs to the caller again once replied.
+ * (iou == NULL forgets everything)
+ */
+static void sl811hs_FifoForget(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    int i;
 
-    /* Reset the address pointer */
-    sl->sl_CurrAddr = curraddr;
-    if (sl->sl_Addr != NULL)
-        *(sl->sl_Addr) = curraddr;
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        if (iou == NULL || sl->sl_Xfer[i].fifo.iou == iou)
+            sl->sl_Xfer[i].fifo.iou = NULL;
+    }
+}
 
-    /* Mask out anything we care about */
-    status &= SL811HS_INTMASK_CHANGED |
-              SL811HS_INTMASK_USB_A |
-              SL811HS_INTMASK_USB_B;
+/* FIFO partitioning
+ *
+ * The 240 byte FIFO is split into one window per channel. The
+ * split is only changed while both channels are idle, and is
+ * sized by what is waiting on the endpoint queues:
+ *
+ *  - Up to 64 byte packets (control, interrupt, bulk) fit in
+ *    an even 120/120 split, which also allows bulk ping-pong.
+ *  - A larger isochronous packet gets one large window, and
+ *    the other channel keeps a small one for control traffic.
+ */
+#define SL811HS_FIFO_MINWIN     8
 
-    if (status) {
-        Signal(sl->sl_CommandTask, (1 << sl->sl_SigDone));
-        D2(RawPutChar('!'));
-    }
+static UBYTE sl811hs_FifoDemand(struct IOUsbHWReq *iou)
+{
+    ULONG want = iou->iouh_MaxPktSize;
 
-    return status ? TRUE : FALSE;
+    if (iou->iouh_Req.io_Command != UHCMD_ISOXFER && want > 64)
+        want = 64;
+    if (want < SL811HS_FIFO_MINWIN)
+        want = SL811HS_FIFO_MINWIN;
+    if (want > SL811HS_FIFO_SIZE - SL811HS_FIFO_MINWIN)
+        want = SL811HS_FIFO_SIZE - SL811HS_FIFO_MINWIN;
 
-    AROS_INTFUNC_EXIT
+    return (want + SL811HS_FIFO_MINWIN - 1) & ~(SL811HS_FIFO_MINWIN - 1);
 }
 
-#define DRV1_STATE_DONE             ((IPTR)0)
-
-#define DRV1_STATE_SETUP_START      ((IPTR)1)
-#define DRV1_STATE_SETUP_IN         ((IPTR)2)
-#define DRV1_STATE_SETUP_OUT        ((IPTR)3)
-#define DRV1_STATE_SETUP_STATUS     ((IPTR)4)
+static void sl811hs_FifoPartition(struct sl811hs *sl, UBYTE lena)
+{
+    struct sl811hs_Xfer *a = &sl->sl_Xfer[0];
+    struct sl811hs_Xfer *b = &sl->sl_Xfer[1];
 
-#define DRV1_STATE_BULK_IN          ((IPTR)10)
-#define DRV1_STATE_BULK_OUT         ((IPTR)11)
+    /* Everything in the FIFO moves */
+    sl811hs_FifoForget(sl, NULL);
 
-#define DRV1_STATE_INT_IN           ((IPTR)20)
-#define DRV1_STATE_INT_OUT          ((IPTR)21)
+    a->base = SL811HS_FIFO_BASE;
+    a->maxlen = lena;
+    b->base = SL811HS_FIFO_BASE + lena;
+    b->maxlen = SL811HS_FIFO_SIZE - lena;
 
-#define DRV1_STATE_ISO_IN           ((IPTR)30)
-#define DRV1_STATE_ISO_OUT          ((IPTR)31)
+    D(ebug("FIFO: USB-A %02x+%d, USB-B %02x+%d\n", a->base, a->maxlen, b->base, b->maxlen));
+}
 
-BYTE sl811hs_ControlXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+static void sl811hs_FifoAdapt(struct sl811hs *sl)
 {
-    struct UsbSetupData *sd = &iou->iouh_SetupData;
+    struct sl811hs_EP *ep;
+    UBYTE want = SL811HS_FIFO_SIZE / 2;
+    int i;
 
-    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
-        return UHIOERR_USBOFFLINE;
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        if (sl->sl_Xfer[i].state != XFER_FREE)
+            return;
+    }
 
-    if ((iou->iouh_Length != AROS_LE2WORD(sd->wLength)) ||
-        (iou->iouh_Endpoint != 0))
-        return UHIOERR_BADPARAMS;
+    /* All packets of an endpoint have the same size */
+    for (i = 0; i < SCHED_CLASSES; i++) {
+        ForeachNode(&sl->sl_EPRing[i], ep) {
+            UBYTE demand = sl811hs_FifoDemand((struct IOUsbHWReq *)GetHead(&ep->ep_Packets));
+            if (demand > want)
+                want = demand;
+        }
+    }
 
-    iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_SETUP_START;
+    if (sl->sl_Xfer[0].maxlen != want)
+        sl811hs_FifoPartition(sl, want);
+}
 
-    return IOERR_UNITBUSY;
-} 
+static ULONG sl811hs_FifoLayout(struct sl811hs *sl)
+{
+    return ((ULONG)sl->sl_Xfer[0].base << 24) |
+           ((ULONG)sl->sl_Xfer[0].maxlen << 16) |
+           ((ULONG)sl->sl_Xfer[1].base << 8) |
+           ((ULONG)sl->sl_Xfer[1].maxlen << 0);
+}
+
+/* Completion accounting for sl811hs_SimAudit(). An Xfer is armed
+ * when the CommandTask hands it to the interrupt (XFER_ACTIVE or
+ * XFER_STAGED), and drained when it comes back, off sl_DoneRing[] or
+ * freed before it ever completed. The interrupt moving an Xfer on
+ * from one packet to the next does neither.
+ */
+#if SL811HS_BUS_SIM && SL811HS_SIM_STRESS
+#define SIM_ARMED(sl)       ((sl)->sl_SimArmed++)
+#define SIM_DRAINED(sl)     ((sl)->sl_SimDrained++)
+#else
+#define SIM_ARMED(sl)       do { } while (0)
+#define SIM_DRAINED(sl)     do { } while (0)
+#endif
 
-BYTE sl811hs_BulkXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+static void sl811hs_XferFree(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
 {
-    LONG len = iou->iouh_Length;
+    if (xfer->state == XFER_ACTIVE || xfer->state == XFER_STAGED)
+        SIM_DRAINED(sl);
 
-    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
-        return UHIOERR_USBOFFLINE;
+    if (xfer->ep) {
+        xfer->ep->ep_Busy--;
+        xfer->ep = NULL;
+    }
+    xfer->state = XFER_FREE;
+    xfer->chain = NULL;
+    xfer->iou = NULL;
+    AddTail((struct List *)&sl->sl_XfersFree, (struct Node *)xfer);
+}
 
-    if (len > 64)
-        len = 64;
+/* Completion ring
+ *
+ * Done Xfers go from the interrupt to the CommandTask through
+ * sl_DoneRing[]. The interrupt only ever writes sl_DoneHead, and
+ * the CommandTask only sl_DoneTail, so neither side needs Disable().
+ * An Xfer is in the ring at most once, so the ring never fills.
+ */
+static inline void sl811hs_DonePush(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+{
+    UBYTE head = sl->sl_DoneHead;
 
-    if (len > iou->iouh_MaxPktSize)
-        len = iou->iouh_MaxPktSize;
+    xfer->state = XFER_DONE;
+    sl->sl_DoneRing[head & (SL811HS_DONE_RING - 1)] = xfer;
+    SL811HS_BARRIER();
+    sl->sl_DoneHead = head + 1;
+}
 
-    iou->iouh_Actual = 0;
+static inline struct sl811hs_Xfer *sl811hs_DonePop(struct sl811hs *sl)
+{
+    UBYTE tail = sl->sl_DoneTail;
+    struct sl811hs_Xfer *xfer;
 
-    /* Mark as bulk transfer phase */
-    switch (iou->iouh_Dir) {
-    case UHDIR_IN:
-        iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_BULK_IN;
-        break;
-    case UHDIR_OUT:
-        iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_BULK_OUT;
-        break;
-    default:
-        return UHIOERR_BADPARAMS;
-    }
+    if (tail == sl->sl_DoneHead)
+        return NULL;
 
-    return IOERR_UNITBUSY;
-} 
+    SL811HS_BARRIER();
+    xfer = sl->sl_DoneRing[tail & (SL811HS_DONE_RING - 1)];
+    SL811HS_BARRIER();
+    sl->sl_DoneTail = tail + 1;
+    SIM_DRAINED(sl);
 
-BYTE sl811hs_InterruptXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+    return xfer;
+}
+
+static inline BOOL sl811hs_DonePending(struct sl811hs *sl)
 {
-    iou->iouh_Actual = 0;
+    return (sl->sl_DoneHead != sl->sl_DoneTail) ? TRUE : FALSE;
+}
 
-    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
-        return UHIOERR_USBOFFLINE;
+/* Is anything on the wire? Only the interrupt moves an
+ * Xfer out of XFER_ACTIVE, so this needs no Disable().
+ */
+static inline BOOL sl811hs_XferBusy(struct sl811hs *sl)
+{
+    int i;
 
-    /* Mark as setup transfer phase */
-    switch (iou->iouh_Dir) {
-    case UHDIR_IN:
-        iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_INT_IN;
-        break;
-    case UHDIR_OUT:
-        iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_INT_OUT;
-        break;
-    default:
-        return UHIOERR_BADPARAMS;
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        if (sl->sl_Xfer[i].state == XFER_ACTIVE)
+            return TRUE;
     }
 
-    return IOERR_UNITBUSY;
-} 
+    return FALSE;
+}
 
-BYTE sl811hs_IsoXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+#if SL811HS_BUS_SIM && SL811HS_SIM_STRESS
+/* The simulated devices answer every packet as soon as it is armed,
+ * so once every interrupt is in, nothing can be left on the wire,
+ * every done Xfer must be on the ring, and every Xfer armed and
+ * not drained yet must still be out of the CommandTask's hands.
+ * Anything else is a lost (or doubled) completion, and stops the
+ * machine.
+ */
+static void sl811hs_SimAudit(struct sl811hs *sl)
 {
-    iou->iouh_Actual = 0;
-
-    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
-        return UHIOERR_USBOFFLINE;
-
-    /* Mark as setup transfer phase */
-    switch (iou->iouh_Dir) {
-    case UHDIR_IN:
-        iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_INT_IN;
-        break;
-    case UHDIR_OUT:
-        iou->iouh_DriverPrivate1 = (APTR)DRV1_STATE_INT_OUT;
-        break;
-    default:
-        return UHIOERR_BADPARAMS;
+    UBYTE queued = sl->sl_DoneHead - sl->sl_DoneTail;
+    int i, active = 0, done = 0, out = 0;
+
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        if (sl->sl_Xfer[i].state == XFER_ACTIVE)
+            active++;
+        else if (sl->sl_Xfer[i].state == XFER_DONE)
+            done++;
+        if (sl->sl_Xfer[i].state != XFER_FREE)
+            out++;
     }
 
-    return IOERR_UNITBUSY;
+    if (active || done != queued ||
+        sl->sl_SimArmed - sl->sl_SimDrained != out) {
+        bug("[%s] Lost completion: %d active, %d done, %d on the ring, %lu armed, %lu drained\n",
+            sl->sl_Node.ln_Name, active, done, queued,
+            (unsigned long)sl->sl_SimArmed, (unsigned long)sl->sl_SimDrained);
+        Alert(AT_DeadEnd | AN_Unknown);
+    }
 }
+#endif
 
-static BYTE sl811hs_XferStatus(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+/* Called just before sl_TaskLock is let go of, for the CommandTask to Wait() */
+static inline void sl811hs_Idle(struct sl811hs *sl)
 {
-    LONG err = 0;
-    int ab = xfer->ab;
-    struct IOUsbHWReq *iou = xfer->iou;
-    struct IORequest *io = &iou->iouh_Req;
-    UBYTE status;
-    int data;
+    bus_Idle(sl);
+#if SL811HS_BUS_SIM && SL811HS_SIM_STRESS
+    sl811hs_SimAudit(sl);
+#endif
+}
 
-    status = rb(sl, SL811HS_HOSTSTATUS + ab);
-    data = (xfer->ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0;
+/* Claim the smallest free window that fits the packet */
+static struct sl811hs_Xfer *sl811hs_XferClaim(struct sl811hs *sl, UBYTE want)
+{
+    struct sl811hs_Xfer *xfer, *best = NULL;
 
-    D2(ebug("%p DATA%d PID_%s Status %02x\n", iou, data, PIDNAME(SL811HS_HOSTID_PID_of(xfer->pidep)), status));
-   
-    if (io->io_Flags & IOF_ABORT) {
-        D(ebug("%p DATA%d ABORT\n", iou, data));
-        err = IOERR_ABORTED;
+    ForeachNode(&sl->sl_XfersFree, xfer) {
+        if (xfer->maxlen < want)
+            continue;
+        if (best == NULL || xfer->maxlen < best->maxlen)
+            best = xfer;
     }
-   
-    if (status & SL811HS_HOSTSTATUS_ERROR) {
-        D(ebug("%p DATA%d ERROR\n", iou, data));
-        err = UHIOERR_HOSTERROR;
-    } else if (status & SL811HS_HOSTSTATUS_STALL) {
-        D(ebug("%p DATA%d STALL\n", iou));
-    } else if (status & SL811HS_HOSTSTATUS_OVERFLOW) {
-        D(ebug("%p DATA%d OVERFLOW\n", iou, data));
-        err = UHIOERR_OVERFLOW;
-    } else if (status & SL811HS_HOSTSTATUS_TIMEOUT) {
-        D(ebug("%p DATA%d TIMEOUT\n", iou, data));
-        err  = UHIOERR_TIMEOUT;
-    } else if (status & SL811HS_HOSTSTATUS_NAK) {
-        D(ebug("%p DATA%d NAK %d.%d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep)));
-        err = UHIOERR_NAK;
-    } else if (status & SL811HS_HOSTSTATUS_ACK) {
-        int seq = (status & SL811HS_HOSTSTATUS_SEQ) ? 1 : 0;
-        err = 0;
-        if ((xfer->ctl & SL811HS_HOSTCTRL_DIR) && seq) {
-            D(ebug("%p DATA%d OUT SEQ %d.%d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep)));
-            D2(for (;;));
-        } else if (!(xfer->ctl & SL811HS_HOSTCTRL_DIR) && (seq != data)) {
-            D(ebug("%p DATA%d IN SEQ %d.%d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep)));
-            D2(for (;;));
+
+    if (best)
+        Remove((struct Node *)best);
+
+    return best;
+}
+
+/* Load the FIFO window and the channel registers for
+ * the packet described by xfer, but don't arm it.
+ */
+static void sl811hs_XferLoad(struct sl811hs *sl, struct sl811hs_Xfer *xfer, UBYTE ctl)
+{
+    UBYTE *data = xfer->data;
+    UBYTE len = xfer->len;
+
+    if ((ctl & SL811HS_HOSTCTRL_DIR) == SL811HS_HOSTCTRL_DIR_OUT) {
+        /* A NAKed OUT/SETUP is retried with the very same payload,
+         * which is still sitting in the FIFO window.
+         */
+        if (xfer->fifo.iou != xfer->iou ||
+            xfer->fifo.data != data ||
+            xfer->fifo.len != len) {
+            sl811hs_FifoWrite(sl, xfer->base, data, len);
+            xfer->fifo.iou = xfer->iou;
+            xfer->fifo.data = data;
+            xfer->fifo.len = len;
         } else {
-            D2(ebug("%p DATA%d ACK %d.%d State %d => %d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep), (int)(IPTR)iou->iouh_DriverPrivate1, (int)xfer->nstate));
-            iou->iouh_DriverPrivate1 = (APTR)xfer->nstate;
-            if (!(xfer->ctl & SL811HS_HOSTCTRL_ISO))
-                sl811hs_ToggleFlip(sl, xfer->iou);
+            D2(ebug("%p FIFO %02x already holds %d bytes\n", xfer->iou, xfer->base, len));
         }
     } else {
-        D(ebug("%p DATA%d HOSTSTATUS %02x?!\n", iou, data, status));
-        err = UHIOERR_HOSTERROR;
+        /* IN data will overwrite the window */
+        xfer->fifo.iou = NULL;
     }
 
-    if (err) {
-        D(ebug("Unsent/recvd: %d\n", rb(sl, SL811HS_HOSTTXLEFT)));
-#if DEBUG > 4
-        Forbid();
-        for (;;);
-#endif
-    }
+    wb(sl, xfer->ab + SL811HS_HOSTBASE, xfer->base);
+    wb(sl, xfer->ab + SL811HS_HOSTLEN, xfer->len);
+    wb(sl, xfer->ab + SL811HS_HOSTID, xfer->pidep);
+    wb(sl, xfer->ab + SL811HS_HOSTDEVICEADDR, xfer->dev);
 
-    io->io_Error = err;
-    if (err)
-        D(ebug("%p Error set as %d\n", iou, io->io_Error));
+    /* Only packets armed by sl811hs_XferIssue() are timed */
+    xfer->armed = 0;
+}
 
-    return err;
+/* Completion latency
+ *
+ * Measured from sl811hs_XferIssue() arming a packet to the CommandTask,
+ * or sl_SoftInt, taking it off sl_DoneRing[], and kept apart for
+ * completions seen by the interrupt, by sl811hs_Poll(), and by the
+ * software interrupt core, so the three can be compared.
+ */
+static inline ULONG sl811hs_EClock(struct sl811hs *sl)
+{
+    struct Device *TimerBase = sl->sl_TimeRequest->tr_node.io_Device;
+    struct EClockVal ev;
+
+    ReadEClock(&ev);
+    return ev.ev_lo ? ev.ev_lo : 1;
 }
 
+static void sl811hs_LatencyAdd(struct sl811hs_Latency *lt, ULONG ticks)
+{
+    /* Halve the history rather than carry 64 bits on m68k */
+    if (lt->lt_Total + ticks < lt->lt_Total) {
+        lt->lt_Total >>= 1;
+        lt->lt_Count = (lt->lt_Count + 1) >> 1;
+    }
 
-static BYTE sl811hs_XferComplete(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+    lt->lt_Count++;
+    lt->lt_Total += ticks;
+    if (ticks > lt->lt_Max)
+        lt->lt_Max = ticks;
+}
+
+static void sl811hs_LatencySample(struct sl811hs *sl, struct sl811hs_Xfer *xfer, BOOL soft)
 {
-    UBYTE *data;
-    BYTE err;
-    struct IOUsbHWReq *iou = xfer->iou;
+    if (!xfer->armed)
+        return;
 
-    ASSERT(xfer->pidep != 0);
-    ASSERT(xfer->iou != NULL);
+    sl811hs_LatencyAdd(&sl->sl_Latency[xfer->polled ? 1 : soft ? 2 : 0], sl811hs_EClock(sl) - xfer->armed);
+    xfer->armed = 0;
+}
 
-    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE))) {
-        err = iou->iouh_Req.io_Error = UHIOERR_USBOFFLINE;
-        return err;
+/* Abort latency
+ *
+ * sl811hs_UnitAbortIO() notes when it was called for a request, and
+ * sl811hs_AbortReplied() adds the time to its reply, whoever replies
+ * it, to sl_AbortLatency. Only the last SL811HS_ABORT_SLOTS aborts
+ * are timed, so one overtaken by later ones goes uncounted.
+ */
+static void sl811hs_AbortNote(struct sl811hs *sl, struct IORequest *ior)
+{
+    ULONG now = sl811hs_EClock(sl);
+    int i;
+
+    Disable();
+    for (i = 0; i < SL811HS_ABORT_SLOTS; i++) {
+        if (sl->sl_Abort[i].ab_Req == ior)
+            sl->sl_Abort[i].ab_Req = NULL;
     }
+    i = sl->sl_AbortNext++ % SL811HS_ABORT_SLOTS;
+    sl->sl_Abort[i].ab_Req = ior;
+    sl->sl_Abort[i].ab_Start = now;
+    Enable();
+}
 
-    err = sl811hs_XferStatus(sl, xfer);
+static void sl811hs_AbortReplied(struct sl811hs *sl, struct IORequest *ior)
+{
+    ULONG now;
+    int i;
 
-    if (!err) {
-        int i;
+    if (!(ior->io_Flags & IOF_ABORT))
+        return;
 
-        switch (SL811HS_HOSTID_PID_of(xfer->pidep)) {
-        case SL811HS_PID_SETUP:
-            D2(ebug("SETUP\n"));
-            err = 0;
-            break;
-        case SL811HS_PID_IN:
-            data = xfer->data;
-            D2(ebug("IN  %d bytes @%p+%d from %02x\n", xfer->len, iou->iouh_Data, iou->iouh_Actual, xfer->base));
-            *(data++) = rb(sl, xfer->base);
-            for (i = 1; i < xfer->len; i++, data++) {
-                *data = rn(sl);
-            }
-            iou->iouh_Actual += i;
-            err = 0;
-            break;
-        case SL811HS_PID_OUT:
-            D2(ebug("OUT %d bytes (of %d) @%p+%d\n", xfer->len, iou->iouh_Length - iou->iouh_Actual, iou->iouh_Data, iou->iouh_Actual));
-            iou->iouh_Actual += xfer->len;
-            err = 0;
-            break;
-        default:
-            D2(ebug("%s\n", PIDNAME(SL811HS_HOSTID_PID_of(xfer->pidep))));
+    now = sl811hs_EClock(sl);
+    Disable();
+    for (i = 0; i < SL811HS_ABORT_SLOTS; i++) {
+        if (sl->sl_Abort[i].ab_Req == ior) {
+            sl->sl_Abort[i].ab_Req = NULL;
+            sl811hs_LatencyAdd(&sl->sl_AbortLatency, now - sl->sl_Abort[i].ab_Start);
             break;
         }
     }
+    Enable();
+}
 
-    D2(ebug("%p Error %d\n", iou, err));
+/* Average, or worst, latency in microseconds */
+static ULONG sl811hs_LatencyUs(struct sl811hs *sl, struct sl811hs_Latency *lt, BOOL worst)
+{
+    ULONG ticks, khz = sl->sl_EClockFreq / 1000;
 
-    return err;
-}
+    if (lt->lt_Count == 0 || khz == 0)
+        return 0;
 
-enum sl811hs_Perform_e {
-    PERFORM_DONE = 0,
-    PERFORM_ACTIVE = 1
-};
+    ticks = worst ? lt->lt_Max : (lt->lt_Total / lt->lt_Count);
+    if (ticks < 0xffffffffUL / 1000)
+        return ticks * 1000 / khz;
+    return ticks / khz * 1000;
+}
 
-enum sl811hs_Perform_e sl811hs_Perform(struct sl811hs *sl, struct sl811hs_Xfer *xfer, struct IOUsbHWReq *iou)
+static void sl811hs_XferIssue(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
 {
-    int pid;
-    UBYTE ctl, *data, dev, ep;
-    int len;
-    IPTR nstate;
+    UBYTE ctl;
 
-    D2(ebug("%p on %d.%d using Xfer %p\n", iou, iou->iouh_DevAddr, iou->iouh_Endpoint, xfer));
+    ctl = xfer->ctl;
 
-    /* Port gone? */
-    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE))) {
-        iou->iouh_Req.io_Error = UHIOERR_USBOFFLINE;
-        return PERFORM_DONE;
-    }
+    if (sl->sl_PortStatus & (1 << PORT_LOW_SPEED))
+        ctl |= SL811HS_HOSTCTRL_PREAMBLE;
 
-    D2(ebug("%p => Xfer[%d]\n", iou, xfer->ab/8));
+    if (sl811hs_ToggleState(xfer->ep))
+        ctl |= SL811HS_HOSTCTRL_DATA1;
+    else
+        ctl |= SL811HS_HOSTCTRL_DATA0;
 
-    /* Reasonable defaults */
-    xfer->iou = iou;
-    len = iou->iouh_Length - iou->iouh_Actual;
-    data = (UBYTE *)iou->iouh_Data + iou->iouh_Actual;
-    dev = iou->iouh_DevAddr;
-    ep  = iou->iouh_Endpoint;
-    
-    D2(ebug("State %d\n", (int)(IPTR)(APTR)iou->iouh_DriverPrivate1));
-    switch ((IPTR)iou->iouh_DriverPrivate1) {
-    case DRV1_STATE_SETUP_START:
-        sl811hs_ToggleClear(sl, iou);
-        ctl = SL811HS_HOSTCTRL_DIR_OUT;
-        pid = SL811HS_PID_SETUP;
-        len = sizeof(iou->iouh_SetupData);
-        data = (UBYTE *)&iou->iouh_SetupData;
-        if (iou->iouh_Length == 0)
-            nstate = DRV1_STATE_SETUP_STATUS;
-        else {
-            if (iou->iouh_SetupData.bmRequestType & 0x80)
-                nstate = DRV1_STATE_SETUP_IN;
-            else
-                nstate = DRV1_STATE_SETUP_OUT;
-        }
-        break;
-    case DRV1_STATE_SETUP_IN:
-        if (len == 0)
-            goto setup_status;
-        ctl = SL811HS_HOSTCTRL_DIR_IN;
-        pid = SL811HS_PID_IN;
-        nstate = DRV1_STATE_SETUP_IN;
-        break;
-    case DRV1_STATE_SETUP_OUT:
-        if (len == 0)
-            goto setup_status;
-        ctl = SL811HS_HOSTCTRL_DIR_OUT;
-        pid = SL811HS_PID_OUT;
-        nstate = DRV1_STATE_SETUP_OUT;
-        break;
-    case DRV1_STATE_SETUP_STATUS:
-setup_status:
-        if (iou->iouh_Length && (iou->iouh_SetupData.bmRequestType & 0x80)) {
-            ctl = SL811HS_HOSTCTRL_DIR_OUT;
-            pid = SL811HS_PID_OUT;
-        } else {
-            ctl = SL811HS_HOSTCTRL_DIR_IN;
-            pid = SL811HS_PID_IN;
-        }
-        len = 0;
-        data = NULL;
-        nstate = DRV1_STATE_DONE;
-        break;
-    case DRV1_STATE_BULK_IN:
-        if (len == 0)
-            goto state_done;
+    ctl |= SL811HS_HOSTCTRL_ENABLE | SL811HS_HOSTCTRL_ARM;
 
-        if (len > 64)
-            len = 64;
+    sl811hs_XferLoad(sl, xfer, ctl);
 
-        ctl = SL811HS_HOSTCTRL_DIR_IN;
-        pid = SL811HS_PID_IN;
-        nstate = DRV1_STATE_BULK_IN;
-        break;
-    case DRV1_STATE_BULK_OUT:
-        if (len == 0)
-            goto state_done;
+    /* Hand it to the interrupt before it can complete */
+    SIM_ARMED(sl);
+    SL811HS_BARRIER();
+    xfer->state = XFER_ACTIVE;
 
-        if (len > 64)
-            len = 64;
+    D2(ebug("%p DATA%d %s\n", xfer->iou, (ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0, PIDNAME(SL811HS_HOSTID_PID_of(xfer->pidep))));
 
-        ctl = SL811HS_HOSTCTRL_DIR_OUT;
-        pid = SL811HS_PID_OUT;
-        nstate = DRV1_STATE_BULK_OUT;
-        break;
-    case DRV1_STATE_INT_IN:
-        ctl = SL811HS_HOSTCTRL_DIR_IN;
-        pid = SL811HS_PID_IN;
-        nstate = DRV1_STATE_DONE;
-        break;
-    case DRV1_STATE_INT_OUT:
-        ctl = SL811HS_HOSTCTRL_DIR_OUT;
-        pid = SL811HS_PID_OUT;
-        nstate = DRV1_STATE_DONE;
-        break;
-    case DRV1_STATE_ISO_IN:
-        ctl = SL811HS_HOSTCTRL_DIR_IN | SL811HS_HOSTCTRL_ISO;
-        pid = SL811HS_PID_IN;
-        nstate = DRV1_STATE_DONE;
-        break;
-    case DRV1_STATE_ISO_OUT:
-        ctl = SL811HS_HOSTCTRL_DIR_OUT | SL811HS_HOSTCTRL_ISO;
-        pid = SL811HS_PID_OUT;
-        nstate = DRV1_STATE_DONE;
-        break;
-    default:
-        D(ebug("Unexpected DriverPrivate1 state %p\n", iou->iouh_DriverPrivate1));
-        iou->iouh_Req.io_Error = IOERR_NOCMD;
-        /* FALLTHROUGH */
-    case DRV1_STATE_DONE:
-state_done:
-        D2(ebug("DONE: err = %d\n", iou->iouh_Req.io_Error));
-        return PERFORM_DONE;
-    }
+    xfer->ctl = ctl;
+    xfer->armed = sl811hs_EClock(sl);
+    wb(sl, xfer->ab + SL811HS_HOSTCTRL, ctl);
+}
 
-    if (len > xfer->maxlen) 
-        len = xfer->maxlen;
-    if (len > iou->iouh_MaxPktSize)
-        len = iou->iouh_MaxPktSize;
+#define DRV1_STATE_DONE             ((IPTR)0)
 
-    xfer->pidep = SL811HS_HOSTID_PIDEP(pid, ep);
-    xfer->ctl = ctl;
-    xfer->len = len;
-    xfer->iou = iou;
-    xfer->data = data;
-    xfer->dev = dev;
-    xfer->nstate = nstate;
+#define DRV1_STATE_SETUP_START      ((IPTR)1)
+#define DRV1_STATE_SETUP_IN         ((IPTR)2)
+#define DRV1_STATE_SETUP_OUT        ((IPTR)3)
+#define DRV1_STATE_SETUP_STATUS     ((IPTR)4)
 
-    sl811hs_XferIssue(sl, xfer);
-    return PERFORM_ACTIVE;
-}
+#define DRV1_STATE_BULK_IN          ((IPTR)10)
+#define DRV1_STATE_BULK_OUT         ((IPTR)11)
 
-static void sl811hs_msSleep(struct sl811hs *sl, int ms)
-{
-    struct timerequest *tr = sl->sl_TimeRequest;
+#define DRV1_STATE_INT_IN           ((IPTR)20)
+#define DRV1_STATE_INT_OUT          ((IPTR)21)
 
-    tr->tr_node.io_Command = TR_ADDREQUEST;
-    tr->tr_time.tv_secs = 0;
-    tr->tr_time.tv_micro = ms * 1000;
-    DoIO((struct IORequest *)tr);
-}
- 
-static void sl811hs_PortScan(struct sl811hs *sl)
-{
-    UBYTE state;
-    UWORD portstatus, portchange;
+#define DRV1_STATE_ISO_IN           ((IPTR)30)
+#define DRV1_STATE_ISO_OUT          ((IPTR)31)
 
-    if (sl->sl_PortScanned)
-        return;
+/* iouh_DriverPrivate1 holds the DRV1_STATE of a request, or the
+ * frame packet index of an isochronous one, in its low 24 bits, and
+ * which driver queue it is on in the top 8, so that sl811hs_Cancel()
+ * can take it off in one step.
+ */
+#define DRV1_QUEUE_SHIFT    24
+#define DRV1_STATE_MASK     ((1UL << DRV1_QUEUE_SHIFT) - 1)
+
+#define IOU_STATE(iou)  ((IPTR)(iou)->iouh_DriverPrivate1 & DRV1_STATE_MASK)
+#define IOU_SETSTATE(iou, st) \
+    ((iou)->iouh_DriverPrivate1 = (APTR)(((IPTR)(iou)->iouh_DriverPrivate1 & ~DRV1_STATE_MASK) | \
+                                         ((IPTR)(st) & DRV1_STATE_MASK)))
+#define IOU_QUEUE(iou)  ((IPTR)(iou)->iouh_DriverPrivate1 >> DRV1_QUEUE_SHIFT)
+#define IOU_SETQUEUE(iou, q) \
+    ((iou)->iouh_DriverPrivate1 = (APTR)(IOU_STATE(iou) | ((IPTR)(q) << DRV1_QUEUE_SHIFT)))
+#define   QUEUE_NONE    0       /* Being processed, or on the wire */
+#define   QUEUE_PORT    1       /* sl_CommandPort */
+#define   QUEUE_EP      2       /* ep_Packets of its endpoint */
+#define   QUEUE_WHEEL   3       /* sl_Wheel[][] */
+#define   QUEUE_FRAME   4       /* sl_FrameTable[] */
+#define   QUEUE_ROOT    5       /* sl_RootIntWait */
+
+/* Was the packet in xfer cleanly ACKed, and (for IN) did it
+ * bring in the full window with the expected data toggle?
+ */
+static BOOL sl811hs_XferAcked(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+{
+    UBYTE status;
+    BOOL ok;
 
-    portstatus = sl->sl_PortStatus;
-    portchange = sl->sl_PortChange;
- 
-    wb(sl, SL811HS_INTSTATUS, 0xff);
-    state = rb(sl, SL811HS_INTSTATUS);
+    if (xfer->iou->iouh_Req.io_Flags & IOF_ABORT)
+        return FALSE;
 
-    D(ebug("Port changed %04x: %02x\n", portstatus, state));
+    status = rb(sl, xfer->ab + SL811HS_HOSTSTATUS);
+    ok = ((status & (SL811HS_HOSTSTATUS_ACK |
+                     SL811HS_HOSTSTATUS_NAK |
+                     SL811HS_HOSTSTATUS_STALL |
+                     SL811HS_HOSTSTATUS_OVERFLOW |
+                     SL811HS_HOSTSTATUS_TIMEOUT |
+                     SL811HS_HOSTSTATUS_ERROR)) == SL811HS_HOSTSTATUS_ACK) ? TRUE : FALSE;
 
-    if (state & SL811HS_INTMASK_DETECT) {
-        portstatus &= ~((1 << PORT_CONNECTION) |
-                        (1 << PORT_ENABLE));
-        portchange |= (1 << PORT_CONNECTION) |
-                      (1 << PORT_ENABLE);
+    if (ok && !(xfer->ctl & SL811HS_HOSTCTRL_DIR)) {
+        BOOL seq = (status & SL811HS_HOSTSTATUS_SEQ) ? TRUE : FALSE;
+        BOOL data = (xfer->ctl & SL811HS_HOSTCTRL_DATA) ? TRUE : FALSE;
 
-        portstatus &= ~(1 << PORT_LOW_SPEED);
+        if (seq != data || rb(sl, xfer->ab + SL811HS_HOSTTXLEFT) != 0)
+            ok = FALSE;
+    }
 
-        wb(sl, SL811HS_INTSTATUS, SL811HS_INTMASK_DETECT);
-        if (rb(sl, SL811HS_INTSTATUS) & SL811HS_INTMASK_DETECT)
-            wb(sl, SL811HS_INTSTATUS, 0xff);
-    } else {
-        UBYTE ctrl1 = 0;
-        UBYTE ctrl2 = 0;
+    return ok;
+}
 
-        portstatus |= (1 << PORT_CONNECTION);
-        portchange |= (1 << PORT_CONNECTION);
+/* Called from sl811hs_IntServer when a packet with a staged
+ * successor completes. The successor is armed right away if
+ * the packet was cleanly ACKed, and the stream did not end
+ * with a short IN packet.
+ */
+static BOOL sl811hs_XferChain(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+{
+    struct sl811hs_Xfer *next = xfer->chain;
 
-        if (state & SL811HS_INTMASK_FULLSPEED) {
-            portstatus &= ~(1 << PORT_LOW_SPEED);
-        } else {
-            portstatus |= (1 << PORT_LOW_SPEED);
-        }
+    if (!sl811hs_XferAcked(sl, xfer))
+        return FALSE;
 
-        /* Update control registers for low or full speed connection */
-        if (portstatus & (1 << PORT_LOW_SPEED)) {
-            ctrl1 |= SL811HS_CONTROL1_LOW_SPEED;
-            ctrl2 |= SL811HS_CONTROL2_LOW_SPEED;
-        }
+    next->state = XFER_ACTIVE;
+    wb(sl, next->ab + SL811HS_HOSTCTRL, next->ctl);
 
-        wb(sl, SL811HS_CONTROL2, ctrl2 | SL811HS_CONTROL2_MASTER | SL811HS_CONTROL2_SOF_HIGH(0x2e));
-        wb(sl, SL811HS_SOFLOW, 0xe0);
-        wb(sl, SL811HS_CONTROL1, ctrl1 | SL811HS_CONTROL1_SOF_ENABLE);
+    return TRUE;
+}
 
-        portstatus |= (1 << PORT_ENABLE);
-        portchange |= (1 << PORT_ENABLE);
-    }
+/* Interrupt-level continuation (sl_IrqContinue)
+ *
+ * Called from sl811hs_IntServer for a completed bulk packet.
+ * If it was cleanly ACKed in the middle of the stream, the
+ * packet is retired right here, and xfer is re-used for the
+ * packet after the one now on the wire - armed at once if
+ * nothing else is, or staged behind the ping-pong partner.
+ *
+ * Returns FALSE if the CommandTask needs to see the packet,
+ * ie at the end of the stream, or on NAK, error or abort.
+ */
+static BOOL sl811hs_XferContinue(struct sl811hs *sl, struct sl811hs_Xfer *xfer, BOOL armed)
+{
+    struct IOUsbHWReq *iou = xfer->iou;
+    struct sl811hs_Xfer *last;
+    UBYTE *data, *end, ctl;
+    LONG len;
 
-    D(ebug("Port changed %04x: %sonnected, %s speed\n", portstatus,
-                (portstatus & (1 << PORT_CONNECTION)) ? "C" : "Disc",
-                (portstatus & (1 << PORT_LOW_SPEED)) ? "Low" : "Full"));
+    if (!sl->sl_IrqContinue)
+        return FALSE;
 
-    /* Update port status */
-    sl->sl_PortChange = portchange;
-    sl->sl_PortStatus = portstatus;
+    if (xfer->nstate != DRV1_STATE_BULK_IN &&
+        xfer->nstate != DRV1_STATE_BULK_OUT)
+        return FALSE;
 
-    sl->sl_PortScanned = TRUE;
-}
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        return FALSE;
 
+    if (xfer->chain && !armed)
+        return FALSE;
 
-BYTE sl811hs_ResetUSB(struct sl811hs *sl, BOOL inReset)
-{
-    D(ebug("%s\n", inReset ? "TRUE" : "FALSE"));
-    if (inReset) {
-        struct sl811hs_Xfer *xfer;
+    /* Give up the second channel if anything else is waiting */
+    if (armed && sl->sl_BulkYield)
+        return FALSE;
 
-        /* USB bus reset */
-        wb(sl, SL811HS_INTENABLE, 0);
-        wb(sl, SL811HS_CONTROL1, SL811HS_CONTROL1_USB_RESET);
-        sl811hs_msSleep(sl, 50);
+    if (!armed && !sl811hs_XferAcked(sl, xfer))
+        return FALSE;
 
-        sl->sl_PortStatus |= (1 << PORT_RESET);
-        sl->sl_PortStatus &= ~(1 << PORT_ENABLE);
-        sl->sl_PortChange |= (1 << PORT_RESET);
-        sl->sl_PortStatus |= (1 << PORT_ENABLE);
+    /* The packet on the wire after this one */
+    last = armed ? xfer->chain : xfer;
+    if (last->len < iou->iouh_MaxPktSize)
+        return FALSE;
 
-        /* Kill any in-flight transfers */
-        while ((xfer = (struct sl811hs_Xfer *)RemHead((struct List *)&sl->sl_XfersActive))) {
-            xfer->iou->iouh_Req.io_Error = UHIOERR_USBOFFLINE;
-            ReplyMsg((struct Message *)xfer->iou);
-            xfer->iou = NULL;
-            AddTail((struct List *)&sl->sl_XfersFree, (struct Node *)xfer);
-        }
+    data = last->data + last->len;
+    end = (UBYTE *)iou->iouh_Data + iou->iouh_Length;
+    if (data >= end)
+        return FALSE;
 
-        /* Reset all endpoint's toggles */
-        for (size_t i = 0; i < ARRAY_SIZE(sl->sl_DevEP_Toggle); i++) {
-            sl->sl_DevEP_Toggle[i] = 0;
-        }
-    } else {
-        /* NOTE - interrupts are still disabled! */
-        wb(sl, SL811HS_CONTROL1, 0);
+    len = end - data;
+    if (len > 64)
+        len = 64;
+    if (len > iou->iouh_MaxPktSize)
+        len = iou->iouh_MaxPktSize;
+    if (len > xfer->maxlen)
+        return FALSE;
 
-        sl->sl_PortScanned = FALSE;
-        sl811hs_PortScan(sl);
+    /* Retire the packet, as sl811hs_XferComplete() would */
+    if ((xfer->ctl & SL811HS_HOSTCTRL_DIR) == SL811HS_HOSTCTRL_DIR_IN)
+        sl811hs_FifoRead(sl, xfer->base, xfer->data, xfer->len);
+    iou->iouh_Actual += xfer->len;
 
-        if (sl->sl_PortStatus & (1 << PORT_CONNECTION)) {
-            /* Re-init host port registers */
-            wb(sl, SL811HS_HOSTBASE, sl->sl_Xfer[0].base);
-            wb(sl, SL811HS_HOSTLEN, 0x00);
-            wb(sl, SL811HS_HOSTID, SL811HS_HOSTID_PIDEP(SL811HS_PID_SOF, 0));   /* SL811HS_HOSTID */
-            wb(sl, SL811HS_HOSTDEVICEADDR, 0x00);
-            wb(sl, SL811HS_HOSTCTRL, SL811HS_HOSTCTRL_ARM);
+    /* Opposite data toggle from the last packet */
+    ctl = last->ctl & ~(SL811HS_HOSTCTRL_DATA | SL811HS_HOSTCTRL_SYNCSOF);
+    if (!(last->ctl & SL811HS_HOSTCTRL_DATA))
+        ctl |= SL811HS_HOSTCTRL_DATA1;
 
-            /* Initialize B */
-            wb(sl, SL811HS_HOSTBASE + 8, sl->sl_Xfer[1].base);
-            wb(sl, SL811HS_HOSTLEN + 8, 0);
-            wb(sl, SL811HS_HOSTID + 8, 0);
-            wb(sl, SL811HS_HOSTDEVICEADDR + 8, 0x00);
-            wb(sl, SL811HS_HOSTCTRL + 8, 0);
-        }
+    xfer->data = data;
+    xfer->len = len;
+    xfer->ctl = ctl;
+    xfer->gen++;
 
-        sl->sl_Xfer[0].iou = NULL;
-        wb(sl, SL811HS_INTENABLE, SL811HS_INTMASK_CHANGED |
-                                  SL811HS_INTMASK_USB_B |
-                                  SL811HS_INTMASK_USB_A);
+    sl811hs_XferLoad(sl, xfer, ctl);
 
-        sl->sl_PortStatus &= ~(1 << PORT_RESET);
-        sl->sl_PortChange |= (1 << PORT_RESET);
+    if (armed) {
+        struct sl811hs_Xfer *next = xfer->chain;
 
+        xfer->chain = NULL;
+        xfer->state = XFER_STAGED;
+        xfer->chaingen = next->gen;
+        next->chain = xfer;
+    } else {
+        wb(sl, xfer->ab + SL811HS_HOSTCTRL, ctl);
     }
 
-    return 0;
+    return TRUE;
 }
 
-BYTE sl811hs_ResetHW(struct sl811hs *sl)
+/* Interrupt service, for sl811hs_IntServer and sl811hs_Poll() */
+static BOOL sl811hs_Service(struct sl811hs *sl)
 {
-    /* Hardware reset */
-    sl->sl_State = UHSF_RESET;
+    UBYTE status, wake, done;
+    UBYTE curraddr;
+    int i;
 
-    sl->sl_Errata = rb(sl, SL811HS_HWREVISION);
+    curraddr = sl->sl_CurrAddr;
+    sl->sl_IrqCount++;
+    sl->sl_InIrq = TRUE;
+    status = rb(sl, SL811HS_INTSTATUS);
 
-    if (sl->sl_Errata != SL811HS_ERRATA_1_5) {
-        D(ebug("SL811HS revision 1.5 expected\n"));
-        return UHIOERR_HOSTERROR;
+    D2(ebug("IntStatus %02x\n", status));
+    if (status & SL811HS_INTMASK_CHANGED) {
+        sl->sl_PortScanned = FALSE;
     }
 
-    /* Reset */
-    sl->sl_RootDevAddr = 0;
+    wake = status & SL811HS_INTMASK_CHANGED;
 
-    /* Init controller */
-    wb(sl, SL811HS_CONTROL2, SL811HS_CONTROL2_MASTER | SL811HS_CONTROL2_SOF_HIGH(0x2e));
-    wb(sl, SL811HS_INTSTATUS, 0xff);
+    if ((status & SL811HS_INTMASK_SOF_TIMER) &&
+        (sl->sl_FrameWanted || sl->sl_IrqModerated)) {
+        struct sl811hs_Xfer *xfer;
 
-    /* Disable interrupts, wait 40ms */
-    wb(sl, SL811HS_INTENABLE, 0);
-    sl811hs_msSleep(sl, 40);
+        sl->sl_Frame++;
 
-    /* Reset USB */
-    sl811hs_ResetUSB(sl, TRUE);
-    sl811hs_ResetUSB(sl, FALSE);
+        /* This frame's isochronous packets go out first */
+        while ((xfer = (struct sl811hs_Xfer *)RemHead((struct List *)&sl->sl_IsoStaged))) {
+            xfer->state = XFER_ACTIVE;
+            wb(sl, xfer->ab + SL811HS_HOSTCTRL, xfer->ctl);
+        }
 
-    sl->sl_State = UHSF_OPERATIONAL;
-    return 0;
-}
+        if (sl->sl_FrameWanted)
+            wake |= SL811HS_INTMASK_SOF_TIMER;
+    }
 
-BYTE sl811hs_Suspend(struct sl811hs *sl)
-{
-    if (sl->sl_State != UHSF_OPERATIONAL)
-        return IOERR_UNITBUSY;
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        struct sl811hs_Xfer *xfer = &sl->sl_Xfer[i];
+        UBYTE mask = xfer->ab ? SL811HS_INTMASK_USB_B : SL811HS_INTMASK_USB_A;
+        BOOL armed = FALSE;
 
-    D(bug("%s:\n"));
-    sl->sl_State = UHSF_SUSPENDED;
-    sl->sl_PortStatus |= (1 << PORT_SUSPEND);
-    sl->sl_PortChange |= (1 << PORT_SUSPEND);
-    wb(sl, SL811HS_CONTROL1, SL811HS_CONTROL1_USB_RESET | SL811HS_CONTROL1_SUSPEND);
+        if (!(status & mask))
+            continue;
 
-    return 0;
-}
+        if (xfer->state != XFER_ACTIVE)
+            continue;
 
-BYTE sl811hs_Resume(struct sl811hs *sl)
-{
-    if (sl->sl_State != UHSF_SUSPENDED)
-        return IOERR_UNITBUSY;
+        /* A packet staged behind an earlier use of xfer is stale,
+         * see sl811hs_XferStage(), and is left for the CommandTask.
+         */
+        if (xfer->chain && xfer->chain->chaingen == xfer->gen)
+            armed = sl811hs_XferChain(sl, xfer);
 
-    D(bug("%s:\n"));
-    /* Single write to Data port to wake up */
-    sl->sl_State = UHSF_RESUMING;
-    resume(sl);
+        if (sl811hs_XferContinue(sl, xfer, armed))
+            continue;
 
-    sl->sl_PortStatus &= ~(1 << PORT_SUSPEND);
-    sl->sl_PortChange |= (1 << PORT_SUSPEND);
-    sl->sl_State = UHSF_OPERATIONAL;
+        xfer->polled = sl->sl_Polling;
+        sl811hs_DonePush(sl, xfer);
+        wake |= mask;
+    }
 
-    return 0;
-}
+    wb(sl, SL811HS_INTSTATUS, status);
 
+    /* Reset the address pointer, and mark the epoch stale, so
+     * the interrupted code will not trust it beyond the access
+     * it may be in the middle of.
+     */
+    sl->sl_CurrAddr = curraddr;
+    bus_Addr(sl, curraddr);
+    sl->sl_AddrEpoch = sl->sl_IrqCount - 1;
+    sl->sl_InIrq = FALSE;
 
-#ifdef AROS_BIG_ENDIAN
-#define CONST_WORD2LE(x) ((((x) & 0x00ff) <<  8) | \
-                         (((x) & 0xff00) >>  8))
-#else
-#define CONST_WORD2LE(x) (x)
-#endif
+    /* Mask out anything we care about. The chip flags SOF every
+     * frame, enabled or not, so it is only ours if we asked for it.
+     */
+    status &= SL811HS_INTMASK_CHANGED |
+              SL811HS_INTMASK_SOF_TIMER |
+              SL811HS_INTMASK_USB_A |
+              SL811HS_INTMASK_USB_B;
+    if (!sl->sl_FrameWanted && !sl->sl_IrqModerated)
+        status &= ~SL811HS_INTMASK_SOF_TIMER;
 
-struct UsbStdDevDesc const sl811hs_DevDesc = {
-    .bLength = sizeof(struct UsbStdDevDesc),
-    .bDescriptorType = UDT_DEVICE,
-    .bcdUSB = CONST_WORD2LE(0x0200),
-    .bDeviceClass = HUB_CLASSCODE, /* HUB */
-    .bDeviceSubClass = 0,
-    .bDeviceProtocol = 0, /* Full speed hub */
-    .bMaxPacketSize0 = 64,
-    .idVendor = CONST_WORD2LE(0x04b4), /* Cypress */
-    .idProduct = CONST_WORD2LE(0x2050), /* Cypress Hub */
-    .bcdDevice = CONST_WORD2LE(0x0100),        /* Version 1.0 */
-    .iManufacturer = 1,         /* String index 1 */
-    .iProduct = 2,              /* String index 2 */
-    .iSerialNumber = 0,
-    .bNumConfigurations = 1
-};
+    /* Interrupt moderation: if completions are all there is,
+     * hold them back until the batch is full, or too old.
+     */
+    done = wake & (SL811HS_INTMASK_USB_A | SL811HS_INTMASK_USB_B);
+    if (sl->sl_IrqModerated && wake == done && (done || sl->sl_IrqHeld)) {
+        if (done) {
+            if (sl->sl_IrqHeld == 0)
+                sl->sl_IrqHeldFrame = sl->sl_Frame;
+            sl->sl_IrqHeld += (done == (SL811HS_INTMASK_USB_A | SL811HS_INTMASK_USB_B)) ? 2 : 1;
+        }
 
-struct UsbStdCfgDesc const sl811hs_CfgDesc = {
-    .bLength = sizeof(struct UsbStdCfgDesc),
-    .bDescriptorType = UDT_CONFIGURATION,
-    .wTotalLength = CONST_WORD2LE(sizeof(struct UsbStdCfgDesc) + sizeof(struct UsbStdIfDesc) + sizeof(struct UsbStdEPDesc) + sizeof(struct UsbHubDesc)),
-    .bNumInterfaces = 1,
-    .bConfigurationValue = 1,
-    .iConfiguration = 0,
-    .bmAttributes = USCAF_ONE | USCAF_SELF_POWERED | USCAF_REMOTE_WAKEUP,
-    .bMaxPower = 0,     /* Self-powered */
-};
+        if (sl->sl_IrqHeld < sl->sl_IrqBatch &&
+            (sl->sl_Frame - sl->sl_IrqHeldFrame) < sl->sl_IrqFrames) {
+            if (done)
+                sl->sl_IrqSaved++;
+            wake = 0;
+        } else if (!done && !sl811hs_DonePending(sl)) {
+            /* The CommandTask has taken them already */
+            sl->sl_IrqHeld = 0;
+            wake = 0;
+        } else if (!done) {
+            /* Too old. This costs the wakeup that
+             * the first completion held had saved.
+             */
+            sl->sl_IrqSaved--;
+            wake = SL811HS_INTMASK_SOF_TIMER;
+        }
+    }
 
-struct UsbStdIfDesc const sl811hs_IntDesc = {
-    .bLength = sizeof(struct UsbStdIfDesc),
-    .bDescriptorType = UDT_INTERFACE,
-    .bInterfaceNumber = 0,
-    .bAlternateSetting = 0,
-    .bNumEndpoints = 1,
-    .bInterfaceClass = HUB_CLASSCODE,       /* Hub */
-    .bInterfaceSubClass = 0,
-    .bInterfaceProtocol = 0,    /* Fullspeed */
-    .iInterface = 0,
-};
+    /* Only wake the CommandTask if it has work to do. If
+     * completions are all there is, sl811hs_Poll() takes them
+     * itself, or else sl_SoftInt does.
+     */
+    if (wake) {
+        BOOL doneonly = !(wake & ~(SL811HS_INTMASK_USB_A | SL811HS_INTMASK_USB_B));
+
+        sl->sl_IrqHeld = 0;
+        if (doneonly && sl->sl_Polling) {
+            /* Not even a signal to end its spin */
+        } else if (doneonly && sl->sl_SoftMode) {
+            Cause(&sl->sl_SoftInt);
+        } else {
+            sl->sl_IrqWakeups++;
+            Signal(sl->sl_CommandTask, (1 << sl->sl_SigDone));
+        }
+        D2(RawPutChar('!'));
+    }
 
-struct UsbStdEPDesc const sl811hs_EPDesc = {
-    .bLength= sizeof(struct UsbStdEPDesc),
-    .bDescriptorType = UDT_ENDPOINT,
-    .bEndpointAddress = 0x81,
-    .bmAttributes = 3,
-    .wMaxPacketSize = CONST_WORD2LE(2),
-    .bInterval = 255
-};
+    return status ? TRUE : FALSE;
+}
 
-struct slUsbStdStrDesc
+static AROS_INTH1(sl811hs_IntServer, struct sl811hs *, sl)
 {
-    UBYTE bLength;             /* Size of this descriptor in bytes */
-    UBYTE bDescriptorType;     /* UDT_STRING Descriptor Type */
-    UWORD bString[8];          /* UNICODE encoded string */
-};
+    AROS_INTFUNC_INIT
 
-struct slUsbStdStrDesc const sl811hs_StrDesc[] = {
-    {
-        .bLength = sizeof(struct UsbStdStrDesc) + (1-1) * sizeof(UWORD),
-        .bDescriptorType = UDT_STRING,
-        .bString = { CONST_WORD2LE(0x0409) }, /* English, United States */
-    }, {
-        .bLength = sizeof(struct UsbStdStrDesc) + (7-1) * sizeof(UWORD),
-        .bDescriptorType = UDT_STRING,
-        .bString = { CONST_WORD2LE('C'), CONST_WORD2LE('y'),
-                     CONST_WORD2LE('p'), CONST_WORD2LE('r'),
-                     CONST_WORD2LE('e'), CONST_WORD2LE('s'),
-                     CONST_WORD2LE('s') },
-    }, {
-        .bLength = sizeof(struct UsbStdStrDesc) + (7-1) * sizeof(UWORD),
-        .bDescriptorType = UDT_STRING,
-        .bString = { CONST_WORD2LE('S'), CONST_WORD2LE('L'),
-                     CONST_WORD2LE('8'), CONST_WORD2LE('1'),
-                     CONST_WORD2LE('1'), CONST_WORD2LE('H'),
-                     CONST_WORD2LE('S') },
-    }
-};
+    return sl811hs_Service(sl);
 
-struct UsbHubDesc const sl811hs_HubDesc = {
-    .bLength = sizeof(struct UsbHubDesc),
-    .bDescriptorType = UDT_HUB,
-    .bNbrPorts = 1,
-    .wHubCharacteristics = 0,
-    .bPwrOn2PwrGood = 50/2,     /* 50ms */
-    .bHubContrCurrent = 25,     /* 25ma */
-    .DeviceRemovable = 0,
-    .PortPwrCtrlMask = 0xff,
-};
+    AROS_INTFUNC_EXIT
+}
 
-static int sl811hs_AppendData(struct sl811hs *sl, struct IOUsbHWReq *iou, UWORD *lengthp, int desc_len, CONST_APTR desc)
+/* Poll mode (sl_PollMode)
+ *
+ * While packets are on the wire, the CommandTask spins on INTSTATUS
+ * rather than Wait() for the interrupt, with the USB-A and USB-B done
+ * interrupts masked, so that it does not pay for the interrupt and the
+ * task switch, and the shared interrupt line is left alone. Completions
+ * it sees are not signalled, but taken off sl_DoneRing[] and followed
+ * by the next packets right away. It gives up after SL811HS_POLL_SPINS
+ * reads, when nothing is on the wire any more, or as soon as it has a
+ * signal to handle, and the interrupts take over again.
+ */
+#define SL811HS_POLL_SPINS      1024
+
+static void sl811hs_IsoStage(struct sl811hs *sl, BOOL dead);
+static void sl811hs_Schedule(struct sl811hs *sl, BOOL dead);
+static void sl811hs_FrameArm(struct sl811hs *sl);
+static void sl811hs_WheelArm(struct sl811hs *sl);
+static BOOL sl811hs_DoneDrain(struct sl811hs *sl, BOOL soft);
+
+/* Service INTSTATUS, if it shows anything, as the interrupt would */
+static BOOL sl811hs_PollService(struct sl811hs *sl)
 {
-    int err;
-    int length = *lengthp;
-    int len = iou->iouh_Length - iou->iouh_Actual;
-    UBYTE *data = (UBYTE *)iou->iouh_Data + iou->iouh_Actual;
+    const UBYTE busy = SL811HS_INTMASK_USB_A | SL811HS_INTMASK_USB_B | SL811HS_INTMASK_CHANGED;
 
-    D2(ebug("Append %d bytes to buffer (%d left of %d), want to send %d\n", desc_len, len, iou->iouh_Length, length));
+    if (!(rb(sl, SL811HS_INTSTATUS) & busy))
+        return FALSE;
 
-    if (len != length) {
-        D2(ebug("Setup length %d, expected %d\n", length, len));
+    Disable();
+    sl->sl_Polling = TRUE;
+    sl811hs_Service(sl);
+    sl->sl_Polling = FALSE;
+    Enable();
+
+    if (!sl811hs_DonePending(sl))
+        return FALSE;
+
+    sl811hs_DoneDrain(sl, FALSE);
+    sl811hs_IsoStage(sl, FALSE);
+    sl811hs_Schedule(sl, FALSE);
+    return TRUE;
+}
+
+static void sl811hs_Poll(struct sl811hs *sl, ULONG sigmask)
+{
+    BOOL drained = FALSE;
+    ULONG spins;
+
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        return;
+
+    wb(sl, SL811HS_INTENABLE, sl->sl_IntEnable & ~(SL811HS_INTMASK_USB_A | SL811HS_INTMASK_USB_B));
+
+    for (spins = 0; spins < SL811HS_POLL_SPINS; spins++) {
+        if (SetSignal(0, 0) & sigmask)
+            break;
+        if (!sl811hs_XferBusy(sl))
+            break;
+
+        if (sl811hs_PollService(sl))
+            drained = TRUE;
     }
-    if (length > len) {
-        err = UHIOERR_OVERFLOW;
-    } else if (length < len) {
-        len = length;
-        err = UHIOERR_RUNTPACKET;
-    } else {
-        err = 0;
+
+    wb(sl, SL811HS_INTENABLE, sl->sl_IntEnable);
+
+    /* Anything that completed while masked */
+    if (sl811hs_PollService(sl))
+        drained = TRUE;
+
+    /* What the completions queued for a frame, or a NAK retry */
+    if (drained) {
+        sl811hs_FrameArm(sl);
+        sl811hs_WheelArm(sl);
     }
+}
 
-    if (len > desc_len)
-        len = desc_len;
+static BYTE sl811hs_ControlXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    struct UsbSetupData *sd = &iou->iouh_SetupData;
 
-    CopyMem(desc, data, len);
-    length -= len;
-    iou->iouh_Actual += len;
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        return UHIOERR_USBOFFLINE;
 
-    *lengthp = length;
+    if ((iou->iouh_Length != AROS_LE2WORD(sd->wLength)) ||
+        (iou->iouh_Endpoint != 0))
+        return UHIOERR_BADPARAMS;
 
-    return err;
-}
+    IOU_SETSTATE(iou, DRV1_STATE_SETUP_START);
 
-#define CTLREQ(type,req)        (((type) << 8) | (req))
+    return IOERR_UNITBUSY;
+} 
 
-static BYTE sl811hs_ControlXferRoot(struct sl811hs *sl, struct IOUsbHWReq *iou)
+static BYTE sl811hs_BulkXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
 {
-    struct UsbSetupData *setup = &iou->iouh_SetupData;
-    BYTE err = UHIOERR_NAK;
-    UWORD value, index, length;
-    UBYTE buff[4];
+    LONG len = iou->iouh_Length;
 
-    value = AROS_LE2WORD(setup->wValue);
-    index = AROS_LE2WORD(setup->wIndex);
-    length = AROS_LE2WORD(setup->wLength);
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        return UHIOERR_USBOFFLINE;
 
-    iou->iouh_Actual = 0;
+    if (len > 64)
+        len = 64;
 
-    D2(ebug("%p value=$%04x, index=$%04x, length=$%04x\n", iou, value, index, length));
-    D2(ebug("%p bmRequestType=$%02x, bRequest=$%02x\n", iou, setup->bmRequestType, setup->bRequest));
-    switch (CTLREQ(setup->bmRequestType, setup->bRequest)) {
-    case CTLREQ(URTF_OUT | URTF_STANDARD | URTF_DEVICE, USR_SET_ADDRESS):
-        D2(ebug("SetAddress: %d\n", value));
-        sl->sl_RootDevAddr = value;
-        err = 0;
-        break;
-    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_DESCRIPTOR):
-        D2(ebug("GetDescriptor: %d [%d]\n", (value>>8) & 0xff, index));
-        switch ((value>>8) & 0xff) {
-        case UDT_DEVICE:
-            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_DevDesc), &sl811hs_DevDesc);
-            break;
-        case UDT_CONFIGURATION:
-            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_CfgDesc), &sl811hs_CfgDesc);
-            if (err == 0 && length > 0)
-                err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_IntDesc), &sl811hs_IntDesc);
-            if (err == 0 && length > 0)
-                err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_EPDesc), &sl811hs_EPDesc);
-            if (err == 0 && length > 0)
-                err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_HubDesc), &sl811hs_HubDesc);
-            break;
-        case UDT_INTERFACE:
-            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_IntDesc), &sl811hs_IntDesc);
-            break;
-        case UDT_ENDPOINT:
-            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_EPDesc), &sl811hs_EPDesc);
-            break;
-        case UDT_HUB:
-            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_HubDesc), &sl811hs_HubDesc);
-            break;
-        case UDT_STRING:
-            if ((value & 0xff) < 3) {
-                err = sl811hs_AppendData(sl, iou, &length, sl811hs_StrDesc[value & 0xff].bLength, &sl811hs_StrDesc[value & 0xff]);
-            }
-            break;
-        default:
-            break;
-        }
+    if (len > iou->iouh_MaxPktSize)
+        len = iou->iouh_MaxPktSize;
 
+    iou->iouh_Actual = 0;
+
+    /* Mark as bulk transfer phase */
+    switch (iou->iouh_Dir) {
+    case UHDIR_IN:
+        IOU_SETSTATE(iou, DRV1_STATE_BULK_IN);
         break;
-    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_CONFIGURATION):
-        D2(ebug("GetConfiguration: %d [%d]\n", value, index));
-        buff[0] = sl->sl_RootConfiguration;
-        err = sl811hs_AppendData(sl, iou, &length, 1, buff);
-        break;
-    case CTLREQ(URTF_OUT | URTF_STANDARD | URTF_DEVICE, USR_SET_CONFIGURATION):
-        D2(ebug("SetConfiguration: %d [%d]\n", value, index));
-        if (index == 0) {
-            sl->sl_RootConfiguration = value & 0xff;
-            err = 0;
-        }
+    case UHDIR_OUT:
+        IOU_SETSTATE(iou, DRV1_STATE_BULK_OUT);
         break;
-    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_STATUS): /* GetStatus */
+    default:
+        return UHIOERR_BADPARAMS;
+    }
+
+    return IOERR_UNITBUSY;
+} 
+
+static BYTE sl811hs_InterruptXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    iou->iouh_Actual = 0;
+
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        return UHIOERR_USBOFFLINE;
+
+    /* Mark as setup transfer phase */
+    switch (iou->iouh_Dir) {
+    case UHDIR_IN:
+        IOU_SETSTATE(iou, DRV1_STATE_INT_IN);
+        break;
+    case UHDIR_OUT:
+        IOU_SETSTATE(iou, DRV1_STATE_INT_OUT);
+        break;
+    default:
+        return UHIOERR_BADPARAMS;
+    }
+
+    return IOERR_UNITBUSY;
+} 
+
+static BYTE sl811hs_IsoXfer(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    iou->iouh_Actual = 0;
+
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        return UHIOERR_USBOFFLINE;
+
+    if (iou->iouh_Dir != UHDIR_IN && iou->iouh_Dir != UHDIR_OUT)
+        return UHIOERR_BADPARAMS;
+
+    /* No iso on low speed, and every packet must fit in one FIFO window */
+    if ((sl->sl_PortStatus & (1 << PORT_LOW_SPEED)) ||
+        iou->iouh_MaxPktSize == 0 ||
+        iou->iouh_MaxPktSize > SL811HS_FIFO_SIZE - SL811HS_FIFO_MINWIN)
+        return UHIOERR_BADPARAMS;
+
+    /* The packet index has to fit in IOU_STATE() */
+    if (((iou->iouh_Flags & UHFF_SL811HS_ISOFRAMES) ?
+         iou->iouh_Length : iou->iouh_Length / iou->iouh_MaxPktSize) > DRV1_STATE_MASK)
+        return UHIOERR_BADPARAMS;
+
+    if (iou->iouh_Flags & UHFF_SL811HS_ISOFRAMES) {
+        struct SL811HS_IsoFrame *f = iou->iouh_Data;
+        ULONG i;
+
+        for (i = 0; i < iou->iouh_Length; i++) {
+            if (f[i].if_Length > iou->iouh_MaxPktSize)
+                return UHIOERR_BADPARAMS;
+            f[i].if_Actual = 0;
+            f[i].if_Frame = 0;
+            f[i].if_Error = UHIOERR_NO_ERROR;
+        }
+    }
+
+    /* Next frame packet to send, see sl811hs_IsoStage() */
+    IOU_SETSTATE(iou, 0);
+
+    return IOERR_UNITBUSY;
+}
+
+static BYTE sl811hs_XferStatus(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+{
+    LONG err = 0;
+    int ab = xfer->ab;
+    struct IOUsbHWReq *iou = xfer->iou;
+    struct IORequest *io = &iou->iouh_Req;
+    UBYTE status;
+    int data;
+
+    status = rb(sl, SL811HS_HOSTSTATUS + ab);
+    data = (xfer->ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0;
+
+    /* Unless it is ACKed, the packet goes again with this toggle */
+    if (!(xfer->ctl & SL811HS_HOSTCTRL_ISO))
+        sl811hs_ToggleRetire(xfer->ep, xfer->ctl, FALSE);
+
+    D2(ebug("%p DATA%d PID_%s Status %02x\n", iou, data, PIDNAME(SL811HS_HOSTID_PID_of(xfer->pidep)), status));
+   
+    if (io->io_Flags & IOF_ABORT) {
+        D(ebug("%p DATA%d ABORT\n", iou, data));
+        err = IOERR_ABORTED;
+    }
+   
+    if (status & SL811HS_HOSTSTATUS_ERROR) {
+        D(ebug("%p DATA%d ERROR\n", iou, data));
+        err = UHIOERR_HOSTERROR;
+    } else if (status & SL811HS_HOSTSTATUS_STALL) {
+        D(ebug("%p DATA%d STALL\n", iou));
+    } else if (status & SL811HS_HOSTSTATUS_OVERFLOW) {
+        D(ebug("%p DATA%d OVERFLOW\n", iou, data));
+        err = UHIOERR_OVERFLOW;
+    } else if (status & SL811HS_HOSTSTATUS_TIMEOUT) {
+        D(ebug("%p DATA%d TIMEOUT\n", iou, data));
+        err  = UHIOERR_TIMEOUT;
+    } else if (status & SL811HS_HOSTSTATUS_NAK) {
+        D(ebug("%p DATA%d NAK %d.%d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep)));
+        xfer->ep->ep_Naks++;
+        xfer->ep->ep_NakStreak++;
+        err = UHIOERR_NAK;
+    } else if (status & SL811HS_HOSTSTATUS_ACK) {
+        int seq = (status & SL811HS_HOSTSTATUS_SEQ) ? 1 : 0;
+        err = 0;
+        xfer->ep->ep_NakStreak = 0;
+        if ((xfer->ctl & SL811HS_HOSTCTRL_DIR) && seq) {
+            D(ebug("%p DATA%d OUT SEQ %d.%d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep)));
+            D2(for (;;));
+        } else if (!(xfer->ctl & SL811HS_HOSTCTRL_DIR) && (seq != data)) {
+            D(ebug("%p DATA%d IN SEQ %d.%d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep)));
+            D2(for (;;));
+        } else {
+            D2(ebug("%p DATA%d ACK %d.%d State %d => %d\n", iou, data, xfer->dev, SL811HS_HOSTID_EP_of(xfer->pidep), (int)IOU_STATE(iou), (int)xfer->nstate));
+            IOU_SETSTATE(iou, xfer->nstate);
+            if (!(xfer->ctl & SL811HS_HOSTCTRL_ISO))
+                sl811hs_ToggleRetire(xfer->ep, xfer->ctl, TRUE);
+        }
+    } else {
+        D(ebug("%p DATA%d HOSTSTATUS %02x?!\n", iou, data, status));
+        err = UHIOERR_HOSTERROR;
+    }
+
+    if (err) {
+        D(ebug("Unsent/recvd: %d\n", rb(sl, SL811HS_HOSTTXLEFT)));
+#if DEBUG > 4
+        Forbid();
+        for (;;);
+#endif
+    }
+
+    io->io_Error = err;
+    if (err)
+        D(ebug("%p Error set as %d\n", iou, io->io_Error));
+
+    return err;
+}
+
+
+static BYTE sl811hs_XferComplete(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
+{
+    BYTE err;
+    struct IOUsbHWReq *iou = xfer->iou;
+    UBYTE left, len;
+
+    ASSERT(xfer->pidep != 0);
+    ASSERT(xfer->iou != NULL);
+
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE))) {
+        err = iou->iouh_Req.io_Error = UHIOERR_USBOFFLINE;
+        return err;
+    }
+
+    err = sl811hs_XferStatus(sl, xfer);
+
+    if (!err) {
+        switch (SL811HS_HOSTID_PID_of(xfer->pidep)) {
+        case SL811HS_PID_SETUP:
+            D2(ebug("SETUP\n"));
+            err = 0;
+            break;
+        case SL811HS_PID_IN:
+            /* HOSTTXLEFT is the part of the window the device did not fill */
+            left = rb(sl, xfer->ab + SL811HS_HOSTTXLEFT);
+            if (left > xfer->len)
+                left = xfer->len;
+            len = xfer->len - left;
+            D2(ebug("IN  %d bytes (of %d) @%p+%d from %02x\n", len, xfer->len, iou->iouh_Data, iou->iouh_Actual, xfer->base));
+            sl811hs_FifoRead(sl, xfer->base, xfer->data, len);
+            iou->iouh_Actual += len;
+
+            /* A short packet ends the data stage, see sl811hs_Perform() */
+            if (left) {
+                switch (IOU_STATE(iou)) {
+                case DRV1_STATE_SETUP_IN:
+                    IOU_SETSTATE(iou, DRV1_STATE_SETUP_STATUS);
+                    break;
+                case DRV1_STATE_BULK_IN:
+                    IOU_SETSTATE(iou, DRV1_STATE_DONE);
+                    break;
+                }
+            }
+            err = 0;
+            break;
+        case SL811HS_PID_OUT:
+            D2(ebug("OUT %d bytes (of %d) @%p+%d\n", xfer->len, iou->iouh_Length - iou->iouh_Actual, iou->iouh_Data, iou->iouh_Actual));
+            iou->iouh_Actual += xfer->len;
+            err = 0;
+            break;
+        default:
+            D2(ebug("%s\n", PIDNAME(SL811HS_HOSTID_PID_of(xfer->pidep))));
+            break;
+        }
+    }
+
+    D2(ebug("%p Error %d\n", iou, err));
+
+    return err;
+}
+
+enum sl811hs_Perform_e {
+    PERFORM_DONE = 0,
+    PERFORM_ACTIVE = 1
+};
+
+static enum sl811hs_Perform_e sl811hs_Perform(struct sl811hs *sl, struct sl811hs_Xfer *xfer, struct IOUsbHWReq *iou)
+{
+    int pid;
+    UBYTE ctl, *data, dev, ep;
+    int len;
+    IPTR nstate;
+
+    D2(ebug("%p on %d.%d using Xfer %p\n", iou, iou->iouh_DevAddr, iou->iouh_Endpoint, xfer));
+
+    /* Port gone? */
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE))) {
+        iou->iouh_Req.io_Error = UHIOERR_USBOFFLINE;
+        return PERFORM_DONE;
+    }
+
+    D2(ebug("%p => Xfer[%d]\n", iou, xfer->ab/8));
+
+    /* Reasonable defaults */
+    xfer->iou = iou;
+    len = iou->iouh_Length - iou->iouh_Actual;
+    data = (UBYTE *)iou->iouh_Data + iou->iouh_Actual;
+    dev = iou->iouh_DevAddr;
+    ep  = iou->iouh_Endpoint;
+    
+    D2(ebug("State %d\n", (int)IOU_STATE(iou)));
+    switch (IOU_STATE(iou)) {
+    case DRV1_STATE_SETUP_START:
+        sl811hs_ToggleClear(xfer->ep);
+        ctl = SL811HS_HOSTCTRL_DIR_OUT;
+        pid = SL811HS_PID_SETUP;
+        len = sizeof(iou->iouh_SetupData);
+        data = (UBYTE *)&iou->iouh_SetupData;
+        if (iou->iouh_Length == 0)
+            nstate = DRV1_STATE_SETUP_STATUS;
+        else {
+            if (iou->iouh_SetupData.bmRequestType & 0x80)
+                nstate = DRV1_STATE_SETUP_IN;
+            else
+                nstate = DRV1_STATE_SETUP_OUT;
+        }
+        break;
+    case DRV1_STATE_SETUP_IN:
+        if (len == 0)
+            goto setup_status;
+        ctl = SL811HS_HOSTCTRL_DIR_IN;
+        pid = SL811HS_PID_IN;
+        nstate = DRV1_STATE_SETUP_IN;
+        break;
+    case DRV1_STATE_SETUP_OUT:
+        if (len == 0)
+            goto setup_status;
+        ctl = SL811HS_HOSTCTRL_DIR_OUT;
+        pid = SL811HS_PID_OUT;
+        nstate = DRV1_STATE_SETUP_OUT;
+        break;
+    case DRV1_STATE_SETUP_STATUS:
+setup_status:
+        if (iou->iouh_Length && (iou->iouh_SetupData.bmRequestType & 0x80)) {
+            ctl = SL811HS_HOSTCTRL_DIR_OUT;
+            pid = SL811HS_PID_OUT;
+        } else {
+            ctl = SL811HS_HOSTCTRL_DIR_IN;
+            pid = SL811HS_PID_IN;
+        }
+        len = 0;
+        data = NULL;
+        nstate = DRV1_STATE_DONE;
+        break;
+    case DRV1_STATE_BULK_IN:
+        if (len == 0)
+            goto state_done;
+
+        if (len > 64)
+            len = 64;
+
+        ctl = SL811HS_HOSTCTRL_DIR_IN;
+        pid = SL811HS_PID_IN;
+        nstate = DRV1_STATE_BULK_IN;
+        break;
+    case DRV1_STATE_BULK_OUT:
+        if (len == 0)
+            goto state_done;
+
+        if (len > 64)
+            len = 64;
+
+        ctl = SL811HS_HOSTCTRL_DIR_OUT;
+        pid = SL811HS_PID_OUT;
+        nstate = DRV1_STATE_BULK_OUT;
+        break;
+    case DRV1_STATE_INT_IN:
+        ctl = SL811HS_HOSTCTRL_DIR_IN;
+        pid = SL811HS_PID_IN;
+        nstate = DRV1_STATE_DONE;
+        break;
+    case DRV1_STATE_INT_OUT:
+        ctl = SL811HS_HOSTCTRL_DIR_OUT;
+        pid = SL811HS_PID_OUT;
+        nstate = DRV1_STATE_DONE;
+        break;
+    case DRV1_STATE_ISO_IN:
+        ctl = SL811HS_HOSTCTRL_DIR_IN | SL811HS_HOSTCTRL_ISO;
+        pid = SL811HS_PID_IN;
+        nstate = DRV1_STATE_DONE;
+        break;
+    case DRV1_STATE_ISO_OUT:
+        ctl = SL811HS_HOSTCTRL_DIR_OUT | SL811HS_HOSTCTRL_ISO;
+        pid = SL811HS_PID_OUT;
+        nstate = DRV1_STATE_DONE;
+        break;
+    default:
+        D(ebug("Unexpected DriverPrivate1 state %d\n", (int)IOU_STATE(iou)));
+        iou->iouh_Req.io_Error = IOERR_NOCMD;
+        /* FALLTHROUGH */
+    case DRV1_STATE_DONE:
+state_done:
+        /* Bulk and control IN data stages that ended with a
+         * short packet are runts, see sl811hs_ReplyOrRetry()
+         */
+        if (!iou->iouh_Req.io_Error && iou->iouh_Actual < iou->iouh_Length &&
+            ((iou->iouh_Req.io_Command == UHCMD_BULKXFER && !iouIsOut(iou)) ||
+             (iou->iouh_Req.io_Command == UHCMD_CONTROLXFER && (iou->iouh_SetupData.bmRequestType & 0x80)))) {
+            D2(ebug("%p Runt, %d of %d bytes\n", iou, iou->iouh_Actual, iou->iouh_Length));
+            iou->iouh_Req.io_Error = UHIOERR_RUNTPACKET;
+        }
+        D2(ebug("DONE: err = %d\n", iou->iouh_Req.io_Error));
+        return PERFORM_DONE;
+    }
+
+    if (len > xfer->maxlen) 
+        len = xfer->maxlen;
+    if (len > iou->iouh_MaxPktSize)
+        len = iou->iouh_MaxPktSize;
+
+    xfer->pidep = SL811HS_HOSTID_PIDEP(pid, ep);
+    xfer->ctl = ctl;
+    xfer->len = len;
+    xfer->iou = iou;
+    xfer->data = data;
+    xfer->dev = dev;
+    xfer->nstate = nstate;
+
+    sl811hs_XferIssue(sl, xfer);
+    return PERFORM_ACTIVE;
+}
+
+/* Ping-pong: load the bulk packet that follows the one in 'active'
+ * into the other channel, so that sl811hs_IntServer can arm it the
+ * moment 'active' is ACKed.
+ */
+static void sl811hs_XferStage(struct sl811hs *sl, struct sl811hs_Xfer *active)
+{
+    struct IOUsbHWReq *iou = active->iou;
+    struct sl811hs_Xfer *xfer;
+    UBYTE *data;
+    LONG len;
+    UBYTE ctl, gen;
+
+    if (!sl->sl_PingPong)
+        return;
+
+    /* Leave the other channel to them */
+    if (sl->sl_BulkYield)
+        return;
+
+    /* sl811hs_XferContinue() may move 'active' on under us */
+    gen = active->gen;
+
+    if (active->nstate != DRV1_STATE_BULK_IN &&
+        active->nstate != DRV1_STATE_BULK_OUT)
+        return;
+
+    /* A short packet ends the stream */
+    if (active->len < iou->iouh_MaxPktSize)
+        return;
+
+    data = active->data + active->len;
+    len = ((UBYTE *)iou->iouh_Data + iou->iouh_Length) - data;
+    if (len <= 0)
+        return;
+
+    if (len > 64)
+        len = 64;
+    if (len > iou->iouh_MaxPktSize)
+        len = iou->iouh_MaxPktSize;
+
+    /* The idle window must hold the whole packet */
+    xfer = sl811hs_XferClaim(sl, len);
+    if (!xfer)
+        return;
+
+    /* Same direction and speed, opposite data toggle */
+    ctl = active->ctl & ~(SL811HS_HOSTCTRL_DATA | SL811HS_HOSTCTRL_SYNCSOF);
+    if (!(active->ctl & SL811HS_HOSTCTRL_DATA))
+        ctl |= SL811HS_HOSTCTRL_DATA1;
+
+    xfer->pidep = active->pidep;
+    xfer->dev = active->dev;
+    xfer->nstate = active->nstate;
+    xfer->iou = iou;
+    xfer->ep = active->ep;
+    xfer->ep->ep_Busy++;
+    xfer->data = data;
+    xfer->len = len;
+    xfer->ctl = ctl;
+    xfer->chain = NULL;
+
+    sl811hs_XferLoad(sl, xfer, ctl);
+
+    /* HOSTCTRL will be written by sl811hs_IntServer */
+    sl->sl_ShadowValid &= ~(1 << (xfer->ab + SL811HS_HOSTCTRL));
+
+    if (active->chain != NULL) {
+        sl811hs_XferFree(sl, xfer);
+        return;
+    }
+
+    /* Publish it, as sl811hs_DonePush() does, stamped with the
+     * generation of 'active' it follows. If the interrupt has
+     * moved 'active' on by the time it looks, the stamp no longer
+     * matches and the packet is never armed; it then reaches the
+     * CommandTask on sl_DoneRing[] with 'active', and is freed by
+     * sl811hs_DoneDrain() like any other staged packet.
+     */
+    xfer->chaingen = gen;
+    SIM_ARMED(sl);
+    xfer->state = XFER_STAGED;
+    SL811HS_BARRIER();
+    active->chain = xfer;
+    SL811HS_BARRIER();
+
+    if (active->state == XFER_ACTIVE && active->gen == gen) {
+        D2(ebug("%p DATA%d staged on USB%c\n", iou, (ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0, xfer->ab ? 'B' : 'A'));
+    } else {
+        D2(ebug("%p DATA%d too late to stage\n", iou, (ctl & SL811HS_HOSTCTRL_DATA) ? 1 : 0));
+    }
+}
+
+static void sl811hs_msSleep(struct sl811hs *sl, int ms)
+{
+    struct timerequest *tr = sl->sl_TimeRequest;
+
+    tr->tr_node.io_Command = TR_ADDREQUEST;
+    tr->tr_time.tv_secs = 0;
+    tr->tr_time.tv_micro = ms * 1000;
+    DoIO((struct IORequest *)tr);
+
+    /* DoIO() may have eaten the signal of a wheel tick */
+    if (sl->sl_WheelTicking && CheckIO((struct IORequest *)&sl->sl_WheelTick)) {
+        ULONG sigftime = (1 << tr->tr_node.io_Message.mn_ReplyPort->mp_SigBit);
+        SetSignal(sigftime, sigftime);
+    }
+}
+ 
+/* Returns TRUE if a connected device has gone away */
+static BOOL sl811hs_PortScan(struct sl811hs *sl)
+{
+    UBYTE state;
+    UWORD portstatus, portchange;
+    BOOL gone;
+
+    if (sl->sl_PortScanned)
+        return FALSE;
+
+    portstatus = sl->sl_PortStatus;
+    portchange = sl->sl_PortChange;
+ 
+    wb(sl, SL811HS_INTSTATUS, 0xff);
+    state = rb(sl, SL811HS_INTSTATUS);
+
+    D(ebug("Port changed %04x: %02x\n", portstatus, state));
+
+    if (state & SL811HS_INTMASK_DETECT) {
+        portstatus &= ~((1 << PORT_CONNECTION) |
+                        (1 << PORT_ENABLE));
+        portchange |= (1 << PORT_CONNECTION) |
+                      (1 << PORT_ENABLE);
+
+        portstatus &= ~(1 << PORT_LOW_SPEED);
+
+        wb(sl, SL811HS_INTSTATUS, SL811HS_INTMASK_DETECT);
+        if (rb(sl, SL811HS_INTSTATUS) & SL811HS_INTMASK_DETECT)
+            wb(sl, SL811HS_INTSTATUS, 0xff);
+    } else {
+        UBYTE ctrl1 = 0;
+        UBYTE ctrl2 = 0;
+
+        portstatus |= (1 << PORT_CONNECTION);
+        portchange |= (1 << PORT_CONNECTION);
+
+        if (state & SL811HS_INTMASK_FULLSPEED) {
+            portstatus &= ~(1 << PORT_LOW_SPEED);
+        } else {
+            portstatus |= (1 << PORT_LOW_SPEED);
+        }
+
+        /* Update control registers for low or full speed connection */
+        if (portstatus & (1 << PORT_LOW_SPEED)) {
+            ctrl1 |= SL811HS_CONTROL1_LOW_SPEED;
+            ctrl2 |= SL811HS_CONTROL2_LOW_SPEED;
+        }
+
+        wb(sl, SL811HS_CONTROL2, ctrl2 | SL811HS_CONTROL2_MASTER | SL811HS_CONTROL2_SOF_HIGH(0x2e));
+        wb(sl, SL811HS_SOFLOW, 0xe0);
+        wb(sl, SL811HS_CONTROL1, ctrl1 | SL811HS_CONTROL1_SOF_ENABLE);
+
+        portstatus |= (1 << PORT_ENABLE);
+        portchange |= (1 << PORT_ENABLE);
+    }
+
+    D(ebug("Port changed %04x: %sonnected, %s speed\n", portstatus,
+                (portstatus & (1 << PORT_CONNECTION)) ? "C" : "Disc",
+                (portstatus & (1 << PORT_LOW_SPEED)) ? "Low" : "Full"));
+
+    gone = ((sl->sl_PortStatus & (1 << PORT_CONNECTION)) &&
+            !(portstatus & (1 << PORT_CONNECTION))) ? TRUE : FALSE;
+
+    /* Update port status */
+    sl->sl_PortChange = portchange;
+    sl->sl_PortStatus = portstatus;
+
+    sl->sl_PortScanned = TRUE;
+
+    return gone;
+}
+
+
+static void sl811hs_ReplyOrRetry(struct sl811hs *sl, struct IOUsbHWReq *iou);
+
+/* Kill any in-flight transfers, and their staged successors
+ * (which share the same iou), and fail their requests with err.
+ * A done packet of a killed request is left on the ring without
+ * its iou, see sl811hs_DoneDrain().
+ * An iso request stays on its endpoint queue between packets,
+ * so it is left for sl811hs_IsoStage() to finish.
+ */
+static void sl811hs_XferKill(struct sl811hs *sl, BYTE err)
+{
+    struct sl811hs_Xfer *xfer;
+    struct IOUsbHWReq *iou;
+    struct MinList killed;
+    int i, j;
+
+    NEWLIST(&killed);
+
+    sl811hs_FifoForget(sl, NULL);
+    Disable();
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        BOOL iso;
+
+        xfer = &sl->sl_Xfer[i];
+        if (xfer->state != XFER_ACTIVE)
+            continue;
+
+        iso = (xfer->ctl & SL811HS_HOSTCTRL_ISO) ? TRUE : FALSE;
+        iou = xfer->iou;
+        sl811hs_XferFree(sl, xfer);
+        for (j = 0; j < ARRAY_SIZE(sl->sl_Xfer); j++) {
+            struct sl811hs_Xfer *other = &sl->sl_Xfer[j];
+            if (other->iou != iou)
+                continue;
+            if (other->state == XFER_STAGED ||
+                other->state == XFER_ACTIVE) {
+                sl811hs_XferFree(sl, other);
+            } else if (other->state == XFER_DONE) {
+                /* Still on sl_DoneRing[]: the iou is replied
+                 * here, so sl811hs_DoneDrain() only frees it.
+                 */
+                other->chain = NULL;
+                other->iou = NULL;
+            }
+        }
+
+        if (!iso)
+            AddTail((struct List *)&killed, (struct Node *)iou);
+    }
+    Enable();
+
+    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&killed))) {
+        iou->iouh_Req.io_Error = err;
+        sl811hs_ReplyOrRetry(sl, iou);
+    }
+}
+
+static BYTE sl811hs_ResetUSB(struct sl811hs *sl, BOOL inReset)
+{
+    D(ebug("%s\n", inReset ? "TRUE" : "FALSE"));
+    if (inReset) {
+        /* USB bus reset */
+        wb(sl, SL811HS_INTENABLE, 0);
+        wb(sl, SL811HS_CONTROL1, SL811HS_CONTROL1_USB_RESET);
+        sl811hs_msSleep(sl, 50);
+
+        sl->sl_PortStatus |= (1 << PORT_RESET);
+        sl->sl_PortStatus &= ~(1 << PORT_ENABLE);
+        sl->sl_PortChange |= (1 << PORT_RESET);
+        sl->sl_PortStatus |= (1 << PORT_ENABLE);
+
+        /* Kill any in-flight transfers */
+        sl811hs_XferKill(sl, UHIOERR_USBOFFLINE);
+
+        /* Reset all endpoint's toggles */
+        sl811hs_EPReset(sl);
+    } else {
+        /* NOTE - interrupts are still disabled! */
+        wb(sl, SL811HS_CONTROL1, 0);
+
+        sl->sl_PortScanned = FALSE;
+        sl811hs_PortScan(sl);
+
+        if (sl->sl_PortStatus & (1 << PORT_CONNECTION)) {
+            /* Re-init host port registers */
+            wb(sl, SL811HS_HOSTBASE, sl->sl_Xfer[0].base);
+            wb(sl, SL811HS_HOSTLEN, 0x00);
+            wb(sl, SL811HS_HOSTID, SL811HS_HOSTID_PIDEP(SL811HS_PID_SOF, 0));   /* SL811HS_HOSTID */
+            wb(sl, SL811HS_HOSTDEVICEADDR, 0x00);
+            wb(sl, SL811HS_HOSTCTRL, SL811HS_HOSTCTRL_ARM);
+
+            /* Initialize B */
+            wb(sl, SL811HS_HOSTBASE + 8, sl->sl_Xfer[1].base);
+            wb(sl, SL811HS_HOSTLEN + 8, 0);
+            wb(sl, SL811HS_HOSTID + 8, 0);
+            wb(sl, SL811HS_HOSTDEVICEADDR + 8, 0x00);
+            wb(sl, SL811HS_HOSTCTRL + 8, 0);
+        }
+
+        wb(sl, SL811HS_INTENABLE, SL811HS_INTMASK_CHANGED |
+                                  SL811HS_INTMASK_USB_B |
+                                  SL811HS_INTMASK_USB_A);
+
+        sl->sl_PortStatus &= ~(1 << PORT_RESET);
+        sl->sl_PortChange |= (1 << PORT_RESET);
+
+    }
+
+    return 0;
+}
+
+static BYTE sl811hs_ResetHW(struct sl811hs *sl)
+{
+    /* Hardware reset */
+    sl->sl_State = UHSF_RESET;
+
+    /* Don't trust anything we think we know about the chip */
+    sl811hs_ShadowInvalidate(sl);
+
+    sl->sl_Errata = rb(sl, SL811HS_HWREVISION) & 0xf0;
+
+    if (sl->sl_Errata != SL811HS_ERRATA_1_5) {
+        D(ebug("SL811HS revision 1.5 expected\n"));
+        return UHIOERR_HOSTERROR;
+    }
+
+    /* Reset */
+    sl->sl_RootDevAddr = 0;
+
+    /* Init controller */
+    wb(sl, SL811HS_CONTROL2, SL811HS_CONTROL2_MASTER | SL811HS_CONTROL2_SOF_HIGH(0x2e));
+    wb(sl, SL811HS_INTSTATUS, 0xff);
+
+    /* Disable interrupts, wait 40ms */
+    wb(sl, SL811HS_INTENABLE, 0);
+    sl811hs_msSleep(sl, 40);
+
+    /* Reset USB */
+    sl811hs_ResetUSB(sl, TRUE);
+    sl811hs_ResetUSB(sl, FALSE);
+
+    sl->sl_State = UHSF_OPERATIONAL;
+    return 0;
+}
+
+static BYTE sl811hs_Suspend(struct sl811hs *sl)
+{
+    if (sl->sl_State != UHSF_OPERATIONAL)
+        return IOERR_UNITBUSY;
+
+    D(bug("%s:\n"));
+    sl->sl_State = UHSF_SUSPENDED;
+    sl->sl_PortStatus |= (1 << PORT_SUSPEND);
+    sl->sl_PortChange |= (1 << PORT_SUSPEND);
+    wb(sl, SL811HS_CONTROL1, SL811HS_CONTROL1_USB_RESET | SL811HS_CONTROL1_SUSPEND);
+
+    return 0;
+}
+
+static BYTE sl811hs_Resume(struct sl811hs *sl)
+{
+    if (sl->sl_State != UHSF_SUSPENDED)
+        return IOERR_UNITBUSY;
+
+    D(bug("%s:\n"));
+    /* Single write to Data port to wake up */
+    sl->sl_State = UHSF_RESUMING;
+    resume(sl);
+
+    sl->sl_PortStatus &= ~(1 << PORT_SUSPEND);
+    sl->sl_PortChange |= (1 << PORT_SUSPEND);
+    sl->sl_State = UHSF_OPERATIONAL;
+
+    return 0;
+}
+
+
+#ifdef AROS_BIG_ENDIAN
+#define CONST_WORD2LE(x) ((((x) & 0x00ff) <<  8) | \
+                         (((x) & 0xff00) >>  8))
+#else
+#define CONST_WORD2LE(x) (x)
+#endif
+
+static struct UsbStdDevDesc const sl811hs_DevDesc = {
+    .bLength = sizeof(struct UsbStdDevDesc),
+    .bDescriptorType = UDT_DEVICE,
+    .bcdUSB = CONST_WORD2LE(0x0200),
+    .bDeviceClass = HUB_CLASSCODE, /* HUB */
+    .bDeviceSubClass = 0,
+    .bDeviceProtocol = 0, /* Full speed hub */
+    .bMaxPacketSize0 = 64,
+    .idVendor = CONST_WORD2LE(0x04b4), /* Cypress */
+    .idProduct = CONST_WORD2LE(0x2050), /* Cypress Hub */
+    .bcdDevice = CONST_WORD2LE(0x0100),        /* Version 1.0 */
+    .iManufacturer = 1,         /* String index 1 */
+    .iProduct = 2,              /* String index 2 */
+    .iSerialNumber = 0,
+    .bNumConfigurations = 1
+};
+
+static struct UsbStdCfgDesc const sl811hs_CfgDesc = {
+    .bLength = sizeof(struct UsbStdCfgDesc),
+    .bDescriptorType = UDT_CONFIGURATION,
+    .wTotalLength = CONST_WORD2LE(sizeof(struct UsbStdCfgDesc) + sizeof(struct UsbStdIfDesc) + sizeof(struct UsbStdEPDesc) + sizeof(struct UsbHubDesc)),
+    .bNumInterfaces = 1,
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = USCAF_ONE | USCAF_SELF_POWERED | USCAF_REMOTE_WAKEUP,
+    .bMaxPower = 0,     /* Self-powered */
+};
+
+static struct UsbStdIfDesc const sl811hs_IntDesc = {
+    .bLength = sizeof(struct UsbStdIfDesc),
+    .bDescriptorType = UDT_INTERFACE,
+    .bInterfaceNumber = 0,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 1,
+    .bInterfaceClass = HUB_CLASSCODE,       /* Hub */
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,    /* Fullspeed */
+    .iInterface = 0,
+};
+
+static struct UsbStdEPDesc const sl811hs_EPDesc = {
+    .bLength= sizeof(struct UsbStdEPDesc),
+    .bDescriptorType = UDT_ENDPOINT,
+    .bEndpointAddress = 0x81,
+    .bmAttributes = 3,
+    .wMaxPacketSize = CONST_WORD2LE(2),
+    .bInterval = 255
+};
+
+struct slUsbStdStrDesc
+{
+    UBYTE bLength;             /* Size of this descriptor in bytes */
+    UBYTE bDescriptorType;     /* UDT_STRING Descriptor Type */
+    UWORD bString[8];          /* UNICODE encoded string */
+};
+
+static struct slUsbStdStrDesc const sl811hs_StrDesc[] = {
+    {
+        .bLength = sizeof(struct UsbStdStrDesc) + (1-1) * sizeof(UWORD),
+        .bDescriptorType = UDT_STRING,
+        .bString = { CONST_WORD2LE(0x0409) }, /* English, United States */
+    }, {
+        .bLength = sizeof(struct UsbStdStrDesc) + (7-1) * sizeof(UWORD),
+        .bDescriptorType = UDT_STRING,
+        .bString = { CONST_WORD2LE('C'), CONST_WORD2LE('y'),
+                     CONST_WORD2LE('p'), CONST_WORD2LE('r'),
+                     CONST_WORD2LE('e'), CONST_WORD2LE('s'),
+                     CONST_WORD2LE('s') },
+    }, {
+        .bLength = sizeof(struct UsbStdStrDesc) + (7-1) * sizeof(UWORD),
+        .bDescriptorType = UDT_STRING,
+        .bString = { CONST_WORD2LE('S'), CONST_WORD2LE('L'),
+                     CONST_WORD2LE('8'), CONST_WORD2LE('1'),
+                     CONST_WORD2LE('1'), CONST_WORD2LE('H'),
+                     CONST_WORD2LE('S') },
+    }
+};
+
+static struct UsbHubDesc const sl811hs_HubDesc = {
+    .bLength = sizeof(struct UsbHubDesc),
+    .bDescriptorType = UDT_HUB,
+    .bNbrPorts = 1,
+    .wHubCharacteristics = 0,
+    .bPwrOn2PwrGood = 50/2,     /* 50ms */
+    .bHubContrCurrent = 25,     /* 25ma */
+    .DeviceRemovable = 0,
+    .PortPwrCtrlMask = 0xff,
+};
+
+static int sl811hs_AppendData(struct sl811hs *sl, struct IOUsbHWReq *iou, UWORD *lengthp, int desc_len, CONST_APTR desc)
+{
+    int err;
+    int length = *lengthp;
+    int len = iou->iouh_Length - iou->iouh_Actual;
+    UBYTE *data = (UBYTE *)iou->iouh_Data + iou->iouh_Actual;
+
+    D2(ebug("Append %d bytes to buffer (%d left of %d), want to send %d\n", desc_len, len, iou->iouh_Length, length));
+
+    if (len != length) {
+        D2(ebug("Setup length %d, expected %d\n", length, len));
+    }
+    if (length > len) {
+        err = UHIOERR_OVERFLOW;
+    } else if (length < len) {
+        len = length;
+        err = UHIOERR_RUNTPACKET;
+    } else {
+        err = 0;
+    }
+
+    if (len > desc_len)
+        len = desc_len;
+
+    CopyMem(desc, data, len);
+    length -= len;
+    iou->iouh_Actual += len;
+
+    *lengthp = length;
+
+    return err;
+}
+
+#define CTLREQ(type,req)        (((type) << 8) | (req))
+
+static BYTE sl811hs_ControlXferRoot(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    struct UsbSetupData *setup = &iou->iouh_SetupData;
+    BYTE err = UHIOERR_NAK;
+    UWORD value, index, length;
+    UBYTE buff[4];
+
+    value = AROS_LE2WORD(setup->wValue);
+    index = AROS_LE2WORD(setup->wIndex);
+    length = AROS_LE2WORD(setup->wLength);
+
+    iou->iouh_Actual = 0;
+
+    D2(ebug("%p value=$%04x, index=$%04x, length=$%04x\n", iou, value, index, length));
+    D2(ebug("%p bmRequestType=$%02x, bRequest=$%02x\n", iou, setup->bmRequestType, setup->bRequest));
+    switch (CTLREQ(setup->bmRequestType, setup->bRequest)) {
+    case CTLREQ(URTF_OUT | URTF_STANDARD | URTF_DEVICE, USR_SET_ADDRESS):
+        D2(ebug("SetAddress: %d\n", value));
+        sl->sl_RootDevAddr = value;
+        err = 0;
+        break;
+    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_DESCRIPTOR):
+        D2(ebug("GetDescriptor: %d [%d]\n", (value>>8) & 0xff, index));
+        switch ((value>>8) & 0xff) {
+        case UDT_DEVICE:
+            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_DevDesc), &sl811hs_DevDesc);
+            break;
+        case UDT_CONFIGURATION:
+            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_CfgDesc), &sl811hs_CfgDesc);
+            if (err == 0 && length > 0)
+                err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_IntDesc), &sl811hs_IntDesc);
+            if (err == 0 && length > 0)
+                err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_EPDesc), &sl811hs_EPDesc);
+            if (err == 0 && length > 0)
+                err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_HubDesc), &sl811hs_HubDesc);
+            break;
+        case UDT_INTERFACE:
+            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_IntDesc), &sl811hs_IntDesc);
+            break;
+        case UDT_ENDPOINT:
+            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_EPDesc), &sl811hs_EPDesc);
+            break;
+        case UDT_HUB:
+            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_HubDesc), &sl811hs_HubDesc);
+            break;
+        case UDT_STRING:
+            if ((value & 0xff) < 3) {
+                err = sl811hs_AppendData(sl, iou, &length, sl811hs_StrDesc[value & 0xff].bLength, &sl811hs_StrDesc[value & 0xff]);
+            }
+            break;
+        default:
+            break;
+        }
+
+        break;
+    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_CONFIGURATION):
+        D2(ebug("GetConfiguration: %d [%d]\n", value, index));
+        buff[0] = sl->sl_RootConfiguration;
+        err = sl811hs_AppendData(sl, iou, &length, 1, buff);
+        break;
+    case CTLREQ(URTF_OUT | URTF_STANDARD | URTF_DEVICE, USR_SET_CONFIGURATION):
+        D2(ebug("SetConfiguration: %d [%d]\n", value, index));
+        if (index == 0) {
+            sl->sl_RootConfiguration = value & 0xff;
+            err = 0;
+        }
+        break;
+    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_DEVICE, USR_GET_STATUS): /* GetStatus */
         D2(ebug("GetDeviceStatus: %d [%d]\n", value, index));
         if (value == 0 && index == 0) {
             buff[0] = 1;        /* Self Powered */
@@ -1286,276 +2801,1286 @@ static BYTE sl811hs_ControlXferRoot(struct sl811hs *sl, struct IOUsbHWReq *iou)
             err = sl811hs_AppendData(sl, iou, &length, 2, buff);
         }
         break;
-    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_INTERFACE, USR_GET_STATUS): /* GetStatus */
-        D2(ebug("GetInterfaceStatus: %d [%d]\n", value, index));
-        if (value == 0 && index == 0) {
-            buff[0] = 0;        
-            buff[1] = 0;
-            err = sl811hs_AppendData(sl, iou, &length, 2, buff);
+    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_INTERFACE, USR_GET_STATUS): /* GetStatus */
+        D2(ebug("GetInterfaceStatus: %d [%d]\n", value, index));
+        if (value == 0 && index == 0) {
+            buff[0] = 0;        
+            buff[1] = 0;
+            err = sl811hs_AppendData(sl, iou, &length, 2, buff);
+        }
+        break;
+    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_ENDPOINT, USR_GET_STATUS): /* GetStatus */
+        D2(ebug("GetEndpointStatus: %d [%d]\n", value, index));
+        if (value == 0 && index == 0) {
+            buff[0] = 0;        /* Not halted */ 
+            buff[1] = 0;
+            err = sl811hs_AppendData(sl, iou, &length, 2, buff);
+        }
+        break;
+     case CTLREQ(URTF_OUT | URTF_CLASS | URTF_DEVICE, USR_CLEAR_FEATURE): /* ClearHubFeature */
+        D2(ebug("ClearHubFeature: %d [%d]\n", value, index));
+        if (index == 0 && length == 0) {
+            /* Nothing to do */
+            err = 0;
+        }
+        break;
+    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_OTHER,  USR_CLEAR_FEATURE): /* ClearPortFeature */
+        /* (Usually) nothing to do */
+        D2(ebug("ClearPortFeature: %d [%d] (%04x %04x)\n", value, index, sl->sl_PortChange, sl->sl_PortStatus));
+        if ((index & 0xff) == 1) {
+            err = 0;
+
+            if (value < 16) {
+                switch (value) {
+                case PORT_SUSPEND:
+                    if (sl->sl_PortStatus & (1 << PORT_SUSPEND))
+                        err = sl811hs_Resume(sl);
+                    break;
+                case PORT_POWER:
+                    sl->sl_PortStatus &= ~(1 << value);
+                    break;
+                case PORT_ENABLE:
+                    sl->sl_PortStatus &= ~(1 << value);
+                    sl->sl_PortChange |= (1 << value);
+                    break;
+                }
+            } else {
+                /* Acknowledge change */
+                sl->sl_PortChange &= ~(1 << (value - 16));
+            }
+        }
+        break;
+    case CTLREQ(URTF_IN  | URTF_CLASS | URTF_DEVICE, USR_GET_DESCRIPTOR): /* GetHubDescriptor */
+        if (index == 0) {
+            D2(ebug("GetHubDescriptor: %d [%d]\n", value, index));
+            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_HubDesc), &sl811hs_HubDesc);
+        }
+        break;
+    case CTLREQ(URTF_IN  | URTF_CLASS | URTF_DEVICE, USR_GET_STATUS): /* GetHubStatus */
+        D2(ebug("GetHubStatus: %d [%d]\n", value, index));
+        if (value == 0 && index == 0) {
+            buff[0] = 0; /* HUB_LOCAL_POWER, HUB_OVER_CURRENT */
+            buff[1] = 0;
+            buff[2] = 0; /* C_HUB_LOCAL_POWER, C_HUB_OVER_CURRENT */
+            buff[3] = 0;
+            err = sl811hs_AppendData(sl, iou, &length, 4, buff);
+        }
+        break;
+    case CTLREQ(URTF_IN  | URTF_CLASS | URTF_OTHER,  USR_GET_STATUS): /* GetPortStatus/GetBusState */
+        if (value == 0 && index == 1) {
+            D2(ebug("GetPortStatus: %d [%d] (%04x %04x)\n", value, index, sl->sl_PortChange, sl->sl_PortStatus));
+            buff[0] = (sl->sl_PortStatus >> 0) & 0xff;
+            buff[1] = (sl->sl_PortStatus >> 8) & 0xff;
+            buff[2] = (sl->sl_PortChange >> 0) & 0xff;
+            buff[3] = (sl->sl_PortChange >> 8) & 0xff;
+            err = sl811hs_AppendData(sl, iou, &length, 4, buff);
+        } else
+            err = UHIOERR_STALL;
+        break;
+    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_DEVICE, USR_SET_FEATURE): /* SetHubFeature */
+        D2(ebug("SetHubFeature: %d [%d]\n", value, index));
+        /* Nothing to do */
+        err = 0;
+        break;
+    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_OTHER, USR_SET_FEATURE): /* SetPortFeature */
+        D2(ebug("SetPortFeature: %d [%d]\n", value, index));
+        if (index == 1) {
+            /* Nothing to do */
+            err = 0;
+            switch (value) {
+            case PORT_SUSPEND:
+                err = sl811hs_Suspend(sl);
+                break;
+            case PORT_POWER:
+                sl->sl_PortStatus |= (1 << value);
+                err = 0;
+                break;
+            case PORT_RESET:
+                sl811hs_ResetUSB(sl, TRUE);
+                err = sl811hs_ResetUSB(sl, FALSE);
+                break;
+            }
+        }
+        break;
+    default:
+        D(ebug("Unknown request - NAK\n"));
+        err = UHIOERR_NAK;
+        break;
+    }
+
+    D2(ebug("Return %d\n", err));
+    return err;
+}
+
+static BYTE sl811hs_InterruptXferRoot(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    UWORD length = (UWORD)iou->iouh_Length;
+    UBYTE port_one = (1 << 1);
+    BYTE err = UHIOERR_STALL;
+
+    D2(ebug("EndPoint %d\n", iou->iouh_Endpoint));
+
+    if (iou->iouh_Endpoint == 1) {
+        if (sl->sl_PortChange)
+            err = sl811hs_AppendData(sl, iou, &length, 1, &port_one);
+        else
+            err = UHIOERR_NAK;
+    }
+
+    return err;
+}
+
+/* Root hub status change endpoint
+ *
+ * A root hub interrupt request with no port change to report is
+ * parked on sl_RootIntWait, rather than NAKed and polled, and is
+ * completed here as soon as sl_PortChange has a bit set.
+ *
+ * Called with sl_RootLock held.
+ */
+static void sl811hs_RootNotify(struct sl811hs *sl, BOOL dead)
+{
+    struct IOUsbHWReq *iou, *iou_next;
+
+    ForeachNodeSafe(&sl->sl_RootIntWait, iou, iou_next) {
+        BYTE err;
+
+        if (dead || (iou->iouh_Req.io_Flags & IOF_ABORT))
+            err = IOERR_ABORTED;
+        else if (sl->sl_PortChange)
+            err = sl811hs_InterruptXferRoot(sl, iou);
+        else
+            continue;
+
+        if ((iou->iouh_Flags & UHFF_ALLOWRUNTPKTS) && err == UHIOERR_RUNTPACKET)
+            err = 0;
+
+        D2(ebug("%p Root hub change, %d\n", iou, err));
+        Remove((struct Node *)iou);
+        IOU_SETQUEUE(iou, QUEUE_NONE);
+        iou->iouh_Req.io_Error = err;
+        sl811hs_AbortReplied(sl, &iou->iouh_Req);
+        ReplyMsg((struct Message *)iou);
+    }
+}
+
+/* Driver core locks
+ *
+ * sl_TaskLock and sl_RootLock are only ever taken through these, which
+ * also count the holds in sl_CoreBusy, so that sl811hs_SoftIntServer
+ * can tell, at interrupt level, that no task is in the driver core.
+ */
+static inline void sl811hs_CoreObtain(struct sl811hs *sl, struct SignalSemaphore *ss)
+{
+    ObtainSemaphore(ss);
+    Disable();
+    sl->sl_CoreBusy++;
+    Enable();
+}
+
+static inline BOOL sl811hs_CoreAttempt(struct sl811hs *sl, struct SignalSemaphore *ss)
+{
+    if (!AttemptSemaphore(ss))
+        return FALSE;
+
+    Disable();
+    sl->sl_CoreBusy++;
+    Enable();
+    return TRUE;
+}
+
+static inline void sl811hs_CoreRelease(struct sl811hs *sl, struct SignalSemaphore *ss)
+{
+    Disable();
+    sl->sl_CoreBusy--;
+    Enable();
+    ReleaseSemaphore(ss);
+}
+
+static inline void sl811hs_Enqueue(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    /* Clear 'IOF_QUICK' flag */
+    iou->iouh_Req.io_Flags &= ~IOF_QUICK;
+
+    iou->iouh_DriverPrivate1 = NULL;
+    iou->iouh_DriverPrivate2 = NULL;
+    iou->iouh_Actual = 0;
+    IOU_SETQUEUE(iou, QUEUE_PORT);
+
+    /* Add to the list of commands to do */
+    PutMsg(sl->sl_CommandPort, (struct Message *)iou);
+}
+
+static inline LONG sl811hs_State(struct sl811hs *sl)
+{
+    return sl->sl_State;
+}
+
+/* Completes a root hub request in the caller's context, rather than
+ * in the CommandTask, and returns TRUE with io_Error set. Returns FALSE
+ * if it must be queued after all: port suspend, resume and reset touch
+ * the chip and sleep, a NAKed request has to be retried, anything at
+ * all is refused while the bus is not operational, and nothing waits
+ * for the CommandTask to let go of the root hub.
+ */
+static BOOL sl811hs_RootQuick(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    struct UsbSetupData *setup = &iou->iouh_SetupData;
+    UWORD value = AROS_LE2WORD(setup->wValue);
+    BYTE err;
+
+    if (iou->iouh_Req.io_Command == UHCMD_CONTROLXFER) {
+        switch (CTLREQ(setup->bmRequestType, setup->bRequest)) {
+        case CTLREQ(URTF_OUT | URTF_CLASS | URTF_OTHER, USR_CLEAR_FEATURE):
+            if (value == PORT_SUSPEND)
+                return FALSE;
+            break;
+        case CTLREQ(URTF_OUT | URTF_CLASS | URTF_OTHER, USR_SET_FEATURE):
+            if (value == PORT_SUSPEND || value == PORT_RESET)
+                return FALSE;
+            break;
+        }
+    }
+
+    /* As sl811hs_Enqueue() would */
+    iou->iouh_DriverPrivate1 = NULL;
+    iou->iouh_DriverPrivate2 = NULL;
+    iou->iouh_Actual = 0;
+
+    /* Never wait: the CommandTask holds it across port resets */
+    if (!sl811hs_CoreAttempt(sl, &sl->sl_RootLock))
+        return FALSE;
+
+    if (iou->iouh_DevAddr != sl->sl_RootDevAddr ||
+        sl811hs_State(sl) != UHSF_OPERATIONAL) {
+        err = UHIOERR_NAK;
+    } else if (iou->iouh_Req.io_Command == UHCMD_CONTROLXFER) {
+        err = sl811hs_ControlXferRoot(sl, iou);
+    } else {
+        err = sl811hs_InterruptXferRoot(sl, iou);
+    }
+    sl811hs_RootNotify(sl, FALSE);
+    sl811hs_CoreRelease(sl, &sl->sl_RootLock);
+
+    if (err == UHIOERR_NAK)
+        return FALSE;
+
+    if ((iou->iouh_Flags & UHFF_ALLOWRUNTPKTS) && err == UHIOERR_RUNTPACKET)
+        err = 0;
+
+    D2(ebug("%p Root hub, done in BeginIO (%d)\n", iou, err));
+    iou->iouh_Req.io_Error = err;
+    return TRUE;
+}
+
+struct sl811hs_NakTimer {
+    struct MinNode node;        /* On sl_NakPool, while free */
+    struct IOUsbHWReq *iou;
+    ULONG time;         /* in uFrames, including the current wait */
+    ULONG interval;     /* in uFrames */
+    int error;          /* error count */
+    BOOL framed;        /* In sl_FrameTable[], not on sl_Wheel[][] */
+    ULONG due;          /* sl_Frame, or wheel tick, to retry in */
+};
+
+#define UFRAME2MS(x)    ((x)/8)
+#define UFRAME2US(x)    ((x)*125)
+#define MS2UFRAME(x)    ((x)*8)
+
+static inline BOOL iouIsPeriodic(struct IOUsbHWReq *iou)
+{
+    return (iou->iouh_Req.io_Command == UHCMD_INTXFER ||
+            iou->iouh_Req.io_Command == UHCMD_ISOXFER) ? TRUE : FALSE;
+}
+
+/* Timer wheel
+ *
+ * NAKed packets wait for their retry on a hierarchical timer wheel,
+ * instead of each on its own timer.device request. The wheel turns
+ * one slot every SL811HS_WHEEL_TICK uFrames, driven by sl_WheelTick,
+ * which is only at timer.device while there are packets waiting.
+ *
+ * Level 0 holds the packets due in the next SL811HS_WHEEL_SLOTS ticks,
+ * level 1 those due in the next SL811HS_WHEEL_SLOTS^2 ticks, and so on,
+ * each in the slot picked by its due tick. Every time a level wraps
+ * around, the next slot of the level above is re-inserted into the
+ * levels below it, so both insertion and expiry are O(1).
+ */
+static void sl811hs_WheelInsert(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    struct sl811hs_NakTimer *nak = iou->iouh_DriverPrivate2;
+    ULONG due = nak->due;
+    ULONG delta;
+    int level;
+
+    /* Overdue packets, from a cascade, go in the current slot */
+    if ((LONG)(due - sl->sl_WheelNow) < 0)
+        due = sl->sl_WheelNow;
+
+    delta = due - sl->sl_WheelNow;
+    for (level = 0; level < SL811HS_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1UL << (SL811HS_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    /* Beyond the top level, park it in the last slot of the
+     * top level, and it will be re-inserted from there.
+     */
+    if (delta >= (1UL << (SL811HS_WHEEL_BITS * SL811HS_WHEEL_LEVELS)))
+        due = sl->sl_WheelNow + (1UL << (SL811HS_WHEEL_BITS * SL811HS_WHEEL_LEVELS)) - 1;
+
+    AddTail((struct List *)&sl->sl_Wheel[level][(due >> (SL811HS_WHEEL_BITS * level)) & (SL811HS_WHEEL_SLOTS - 1)], (struct Node *)iou);
+    IOU_SETQUEUE(iou, QUEUE_WHEEL);
+}
+
+static void sl811hs_WheelCascade(struct sl811hs *sl, int level)
+{
+    struct MinList *slot = &sl->sl_Wheel[level][(sl->sl_WheelNow >> (SL811HS_WHEEL_BITS * level)) & (SL811HS_WHEEL_SLOTS - 1)];
+    struct MinList todo;
+    struct IOUsbHWReq *iou;
+
+    NEWLIST(&todo);
+    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)slot)))
+        AddTail((struct List *)&todo, (struct Node *)iou);
+
+    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&todo)))
+        sl811hs_WheelInsert(sl, iou);
+}
+
+/* NAK retry policy
+ *
+ * SL811HS_NAKPOLICY_FIXED waits nak->interval between retries, and
+ * gives up after 3 NAKs unless UHFF_NAKTIMEOUT is set.
+ *
+ * SL811HS_NAKPOLICY_ADAPTIVE retries a control or bulk endpoint at
+ * once after its first NAK, in the next frame after its second, and
+ * then doubles the wait for every further NAK in a row, up to
+ * SL811HS_NAK_BACKOFF_MAX. The run of NAKs is counted per endpoint
+ * (ep_NakStreak, cleared by an ACK), so an endpoint that has been
+ * slow for a while starts its next request already backed off.
+ * Without UHFF_NAKTIMEOUT, it gives up after as long as the fixed
+ * policy would have waited. Periodic endpoints are always polled
+ * at their own interval.
+ */
+static ULONG sl811hs_NakWait(struct sl811hs *sl, struct IOUsbHWReq *iou, struct sl811hs_NakTimer *nak)
+{
+    struct sl811hs_EP *ep;
+    ULONG streak;
+
+    if (sl->sl_NakPolicy != SL811HS_NAKPOLICY_ADAPTIVE || iouIsPeriodic(iou))
+        return nak->interval;
+
+    ep = sl811hs_EPFind(sl, sl811hs_EPKey(iou));
+    streak = ep ? ep->ep_NakStreak : (ULONG)nak->error;
+
+    if (streak <= 1)
+        return 0;
+    if (streak - 2 >= 16 || (MS2UFRAME(1) << (streak - 2)) > SL811HS_NAK_BACKOFF_MAX)
+        return SL811HS_NAK_BACKOFF_MAX;
+
+    return MS2UFRAME(1) << (streak - 2);
+}
+
+static void sl811hs_Ready(struct sl811hs *sl, struct IOUsbHWReq *iou);
+
+static void sl811hs_ReplyOrRetry(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    struct sl811hs_NakTimer *nak;
+
+    IOU_SETQUEUE(iou, QUEUE_NONE);
+
+    do {
+        if (iou->iouh_Req.io_Command < CMD_NONSTD)
+            break;
+
+        /* Aborted while on the wire, so no more retries */
+        if ((iou->iouh_Req.io_Flags & IOF_ABORT) &&
+            iou->iouh_Req.io_Error == UHIOERR_NAK)
+            iou->iouh_Req.io_Error = IOERR_ABORTED;
+
+        /* Handle runt transactions */
+        if ((iou->iouh_Flags & UHFF_ALLOWRUNTPKTS) &&
+            (iou->iouh_Req.io_Error == UHIOERR_RUNTPACKET)) {
+            iou->iouh_Req.io_Error = 0;
+            break;
+        }
+
+        /* Handle non-NAK error codes
+         */
+        if (iou->iouh_Req.io_Error != UHIOERR_NAK) {
+            if (iou->iouh_DriverPrivate2) {
+                D2(ebug("%p Clear iouh_DriverPrivate2\n", iou));
+                nak = (struct sl811hs_NakTimer *)iou->iouh_DriverPrivate2;
+                nak->framed = FALSE;
+                nak->iou = NULL;
+                iou->iouh_DriverPrivate2 = NULL;
+                sl811hs_PoolPut(&sl->sl_NakPool, nak);
+                nak = NULL;
+            }
+            break;
+        }
+
+        /* From here on, we are in a NAK or Retry */
+        if (iou->iouh_DriverPrivate2 == NULL) {
+            nak = sl811hs_PoolGet(&sl->sl_NakPool);
+            if (nak != NULL) {
+                iou->iouh_DriverPrivate2 = nak;
+                nak->iou = iou;
+                nak->interval = iou->iouh_Interval;
+                nak->time = 0;
+                nak->error = 1;
+                nak->framed = FALSE;
+                if (sl->sl_PortStatus & (1 << PORT_LOW_SPEED))
+                    nak->interval = MS2UFRAME(nak->interval);
+                if (nak->interval == 0)
+                    nak->interval = MS2UFRAME(iou->iouh_NakTimeout) / 16;
+                if (nak->interval == 0)
+                    nak->interval = DEFAULT_INTERVAL;
+            }
+        } else {
+            BOOL done = FALSE;
+            nak = iou->iouh_DriverPrivate2;
+            if (iou->iouh_Flags & UHFF_NAKTIMEOUT) {
+                if (iou->iouh_NakTimeout && (nak->time >= MS2UFRAME(iou->iouh_NakTimeout))) {
+                    D2(ebug("%p timed out after %sms\n", iou, UFRAME2MS(nak->time)));
+                    done = TRUE;
+                }
+            } else if (sl->sl_NakPolicy == SL811HS_NAKPOLICY_ADAPTIVE) {
+                if (nak->time >= 3 * nak->interval) {
+                    D2(ebug("%p NAKed for %d frames\n", iou, nak->time));
+                    done = TRUE;
+                }
+            } else {
+                nak->error++;
+                if (nak->error > 3) {
+                    D2(ebug("%p received 3 NAKs\n", iou));
+                    done = TRUE;
+                }
+            }
+            if (done) {
+                sl->sl_NakGiveUp++;
+                nak->framed = FALSE;
+                nak->iou = NULL;
+                sl811hs_PoolPut(&sl->sl_NakPool, nak);
+                iou->iouh_DriverPrivate2 = NULL;
+                iou->iouh_Req.io_Error = ((iou->iouh_Flags & UHFF_NAKTIMEOUT)) ? UHIOERR_NAKTIMEOUT : UHIOERR_NAK;
+                break;
+            }
+        }
+
+        if (nak && sl->sl_FrameSched && iouIsPeriodic(iou)) {
+            /* Polled again from sl811hs_FrameTick(), bInterval
+             * frames from now.
+             */
+            ULONG frames = iou->iouh_Interval;
+            if (frames == 0)
+                frames = 1;
+            nak->interval = MS2UFRAME(frames);
+            nak->time += nak->interval;
+            nak->framed = TRUE;
+            nak->due = sl->sl_Frame + frames;
+            D2(ebug("%p NAK, retry in frame %d\n", iou, nak->due));
+            AddTail((struct List *)&sl->sl_FrameTable[nak->due & (SL811HS_FRAME_SLOTS - 1)], (struct Node *)nak->iou);
+            IOU_SETQUEUE(iou, QUEUE_FRAME);
+            sl->sl_FramePending++;
+            sl->sl_NakDeferred++;
+            return;
+        }
+
+        if (nak) {
+            ULONG wait = sl811hs_NakWait(sl, iou, nak);
+
+            if (wait == 0) {
+                D2(ebug("%p NAK, retry at once\n", iou));
+                sl->sl_NakImmediate++;
+                sl811hs_Ready(sl, iou);
+                return;
+            }
+
+            /* Never wait past the NAK timeout deadline, so
+             * the last retry goes out right at it.
+             */
+            if ((iou->iouh_Flags & UHFF_NAKTIMEOUT) && iou->iouh_NakTimeout &&
+                wait > MS2UFRAME(iou->iouh_NakTimeout) - nak->time)
+                wait = MS2UFRAME(iou->iouh_NakTimeout) - nak->time;
+
+            D(ebug("%p NAK, retry in %d ms, %d ms left (%d frames waited)\n", iou, UFRAME2MS(wait), (iou->iouh_Flags & UHFF_NAKTIMEOUT) ? (iou->iouh_NakTimeout - UFRAME2MS(nak->time)) : -1, nak->time));
+            nak->framed = FALSE;
+            nak->time += wait;
+            nak->due = sl->sl_WheelNow + (wait + SL811HS_WHEEL_TICK - 1) / SL811HS_WHEEL_TICK;
+            sl811hs_WheelInsert(sl, iou);
+            sl->sl_WheelPending++;
+            sl->sl_NakDeferred++;
+            return;
+        }
+
+        iou->iouh_Req.io_Error = UHIOERR_OUTOFMEMORY;
+
+    } while (0);
+
+    D2(ebug("%p ReplyMsg(%d)\n", iou, iou->iouh_Req.io_Error));
+    sl811hs_FifoForget(sl, iou);
+    sl811hs_AbortReplied(sl, &iou->iouh_Req);
+    ReplyMsg((struct Message *)iou);
+}
+
+/* Endpoint queues
+ *
+ * Every (device, endpoint, direction) has its own packet queue.
+ * An endpoint with packets waiting is on the ring of its class
+ * in sl_EPRing[], otherwise it is parked on sl_EPIdle, so that
+ * its queue is re-used the next time around.
+ *
+ * sl811hs_Schedule() visits each ring from the head, and moves
+ * an endpoint to the back of its ring as soon as one of its
+ * packets is issued, so endpoints of a class take turns, and a
+ * long bulk stream cannot hold up anything else.
+ */
+static inline int sl811hs_SchedClass(struct IOUsbHWReq *iou)
+{
+    if (iou->iouh_Req.io_Command == UHCMD_ISOXFER)
+        return SCHED_ISO;
+    if (iouIsPeriodic(iou))
+        return SCHED_PERIODIC;
+    if (iou->iouh_Req.io_Command == UHCMD_CONTROLXFER)
+        return SCHED_CONTROL;
+    return SCHED_BULK;
+}
+
+/* Queue a packet on its endpoint */
+static void sl811hs_Ready(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    struct sl811hs_EP *ep;
+    UWORD key = sl811hs_EPKey(iou);
+
+    ep = sl811hs_EPFind(sl, key);
+    if (ep == NULL) {
+        ep = sl811hs_EPAlloc(sl, key);
+        if (ep == NULL) {
+            iou->iouh_Req.io_Error = UHIOERR_OUTOFMEMORY;
+            sl811hs_ReplyOrRetry(sl, iou);
+            return;
         }
+    }
+
+    if (iou->iouh_MaxPktSize > ep->ep_MaxPktSize)
+        ep->ep_MaxPktSize = iou->iouh_MaxPktSize;
+
+    if (IsListEmpty((struct List *)&ep->ep_Packets)) {
+        ep->ep_Class = sl811hs_SchedClass(iou);
+        Remove((struct Node *)ep);
+        AddTail((struct List *)&sl->sl_EPRing[ep->ep_Class], (struct Node *)ep);
+    }
+
+    AddTail((struct List *)&ep->ep_Packets, (struct Node *)iou);
+    IOU_SETQUEUE(iou, QUEUE_EP);
+    D2(ebug("%p => EP %03x\n", iou, key));
+}
+
+/* Cancellation
+ *
+ * Takes a request off whichever driver queue it is on, see
+ * IOU_QUEUE(), and replies it at once with err. A request with a packet
+ * on the wire is left to finish that packet, and is replied by the
+ * CommandTask when it completes; FALSE is returned for those.
+ *
+ * Called with sl_TaskLock held.
+ */
+static BOOL sl811hs_Cancel(struct sl811hs *sl, struct IOUsbHWReq *iou, BYTE err)
+{
+    struct sl811hs_EP *ep;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        if (sl->sl_Xfer[i].state != XFER_FREE && sl->sl_Xfer[i].iou == iou)
+            return FALSE;
+    }
+
+    switch (IOU_QUEUE(iou)) {
+    case QUEUE_PORT:
+        Disable();
+        Remove((struct Node *)iou);
+        Enable();
         break;
-    case CTLREQ(URTF_IN | URTF_STANDARD | URTF_ENDPOINT, USR_GET_STATUS): /* GetStatus */
-        D2(ebug("GetEndpointStatus: %d [%d]\n", value, index));
-        if (value == 0 && index == 0) {
-            buff[0] = 0;        /* Not halted */ 
-            buff[1] = 0;
-            err = sl811hs_AppendData(sl, iou, &length, 2, buff);
+    case QUEUE_EP:
+        Remove((struct Node *)iou);
+        ep = sl811hs_EPFind(sl, sl811hs_EPKey(iou));
+        if (ep && IsListEmpty((struct List *)&ep->ep_Packets)) {
+            Remove((struct Node *)ep);
+            AddTail((struct List *)&sl->sl_EPIdle, (struct Node *)ep);
         }
         break;
-     case CTLREQ(URTF_OUT | URTF_CLASS | URTF_DEVICE, USR_CLEAR_FEATURE): /* ClearHubFeature */
-        D2(ebug("ClearHubFeature: %d [%d]\n", value, index));
-        if (index == 0 && length == 0) {
-            /* Nothing to do */
-            err = 0;
-        }
+    case QUEUE_WHEEL:
+        Remove((struct Node *)iou);
+        sl->sl_WheelPending--;
         break;
-    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_OTHER,  USR_CLEAR_FEATURE): /* ClearPortFeature */
-        /* (Usually) nothing to do */
-        D2(ebug("ClearPortFeature: %d [%d] (%04x %04x)\n", value, index, sl->sl_PortChange, sl->sl_PortStatus));
-        if ((index & 0xff) == 1) {
-            err = 0;
+    case QUEUE_FRAME:
+        Remove((struct Node *)iou);
+        sl->sl_FramePending--;
+        break;
+    case QUEUE_ROOT:
+        sl811hs_CoreObtain(sl, &sl->sl_RootLock);
+        Remove((struct Node *)iou);
+        sl811hs_CoreRelease(sl, &sl->sl_RootLock);
+        break;
+    default:
+        return FALSE;
+    }
 
-            if (value < 16) {
-                switch (value) {
-                case PORT_SUSPEND:
-                    if (sl->sl_PortStatus & (1 << PORT_SUSPEND))
-                        err = sl811hs_Resume(sl);
-                    break;
-                case PORT_POWER:
-                    sl->sl_PortStatus &= ~(1 << value);
-                    break;
-                case PORT_ENABLE:
-                    sl->sl_PortStatus &= ~(1 << value);
-                    sl->sl_PortChange |= (1 << value);
-                    break;
-                }
-            } else {
-                /* Acknowledge change */
-                sl->sl_PortChange &= ~(1 << (value - 16));
+    D2(ebug("%p Cancelled (%d)\n", iou, err));
+    iou->iouh_Req.io_Error = err;
+    sl811hs_ReplyOrRetry(sl, iou);
+    return TRUE;
+}
+
+static void sl811hs_CancelOne(struct sl811hs *sl, struct IOUsbHWReq *iou, BYTE err)
+{
+    /* Anything still on the wire stops at its next packet */
+    if (err == IOERR_ABORTED) {
+        Disable();
+        iou->iouh_Req.io_Flags |= IOF_ABORT;
+        Enable();
+    }
+
+    sl811hs_Cancel(sl, iou, err);
+}
+
+/* Cancel every request on the endpoint queues, the timer
+ * wheel and the frame table with err, or, if flagged, only
+ * those already marked IOF_ABORT.
+ */
+#define CANCEL_WANTED(iou, flagged) \
+    (!(flagged) || ((iou)->iouh_Req.io_Flags & IOF_ABORT))
+
+static void sl811hs_CancelAll(struct sl811hs *sl, BYTE err, BOOL flagged)
+{
+    struct sl811hs_EP *ep, *ep_next;
+    struct IOUsbHWReq *iou, *iou_next;
+    int i, j;
+
+    for (i = 0; i < SCHED_CLASSES; i++) {
+        ForeachNodeSafe(&sl->sl_EPRing[i], ep, ep_next) {
+            ForeachNodeSafe(&ep->ep_Packets, iou, iou_next) {
+                if (CANCEL_WANTED(iou, flagged))
+                    sl811hs_CancelOne(sl, iou, err);
             }
         }
-        break;
-    case CTLREQ(URTF_IN  | URTF_CLASS | URTF_DEVICE, USR_GET_DESCRIPTOR): /* GetHubDescriptor */
-        if (index == 0) {
-            D2(ebug("GetHubDescriptor: %d [%d]\n", value, index));
-            err = sl811hs_AppendData(sl, iou, &length, sizeof(sl811hs_HubDesc), &sl811hs_HubDesc);
+    }
+
+    for (i = 0; i < SL811HS_WHEEL_LEVELS; i++) {
+        for (j = 0; j < SL811HS_WHEEL_SLOTS; j++) {
+            ForeachNodeSafe(&sl->sl_Wheel[i][j], iou, iou_next) {
+                if (CANCEL_WANTED(iou, flagged))
+                    sl811hs_CancelOne(sl, iou, err);
+            }
         }
-        break;
-    case CTLREQ(URTF_IN  | URTF_CLASS | URTF_DEVICE, USR_GET_STATUS): /* GetHubStatus */
-        D2(ebug("GetHubStatus: %d [%d]\n", value, index));
-        if (value == 0 && index == 0) {
-            buff[0] = 0; /* HUB_LOCAL_POWER, HUB_OVER_CURRENT */
-            buff[1] = 0;
-            buff[2] = 0; /* C_HUB_LOCAL_POWER, C_HUB_OVER_CURRENT */
-            buff[3] = 0;
-            err = sl811hs_AppendData(sl, iou, &length, 4, buff);
+    }
+
+    for (i = 0; i < SL811HS_FRAME_SLOTS; i++) {
+        ForeachNodeSafe(&sl->sl_FrameTable[i], iou, iou_next) {
+            if (CANCEL_WANTED(iou, flagged))
+                sl811hs_CancelOne(sl, iou, err);
         }
-        break;
-    case CTLREQ(URTF_IN  | URTF_CLASS | URTF_OTHER,  USR_GET_STATUS): /* GetPortStatus/GetBusState */
-        if (value == 0 && index == 1) {
-            D2(ebug("GetPortStatus: %d [%d] (%04x %04x)\n", value, index, sl->sl_PortChange, sl->sl_PortStatus));
-            buff[0] = (sl->sl_PortStatus >> 0) & 0xff;
-            buff[1] = (sl->sl_PortStatus >> 8) & 0xff;
-            buff[2] = (sl->sl_PortChange >> 0) & 0xff;
-            buff[3] = (sl->sl_PortChange >> 8) & 0xff;
-            err = sl811hs_AppendData(sl, iou, &length, 4, buff);
-        } else
-            err = UHIOERR_STALL;
-        break;
-    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_DEVICE, USR_SET_FEATURE): /* SetHubFeature */
-        D2(ebug("SetHubFeature: %d [%d]\n", value, index));
-        /* Nothing to do */
-        err = 0;
-        break;
-    case CTLREQ(URTF_OUT | URTF_CLASS | URTF_OTHER, USR_SET_FEATURE): /* SetPortFeature */
-        D2(ebug("SetPortFeature: %d [%d]\n", value, index));
-        if (index == 1) {
-            /* Nothing to do */
-            err = 0;
-            switch (value) {
-            case PORT_SUSPEND:
-                err = sl811hs_Suspend(sl);
-                break;
-            case PORT_POWER:
-                sl->sl_PortStatus |= (1 << value);
-                err = 0;
-                break;
-            case PORT_RESET:
-                sl811hs_ResetUSB(sl, TRUE);
-                err = sl811hs_ResetUSB(sl, FALSE);
-                break;
+    }
+}
+
+/* Requests that AbortIO() marked, but did not take off their
+ * queue itself, are cancelled here by the CommandTask.
+ * Parked root hub requests are replied by sl811hs_RootNotify().
+ */
+static void sl811hs_CancelFlagged(struct sl811hs *sl)
+{
+    sl->sl_AbortPending = FALSE;
+    sl811hs_CancelAll(sl, IOERR_ABORTED, TRUE);
+}
+
+/* CMD_FLUSH: abort everything queued, and whatever is on the wire */
+static void sl811hs_Flush(struct sl811hs *sl)
+{
+    struct IOUsbHWReq *iou, *iou_next;
+    int i;
+
+    Disable();
+    for (i = 0; i < ARRAY_SIZE(sl->sl_Xfer); i++) {
+        if (sl->sl_Xfer[i].iou)
+            sl->sl_Xfer[i].iou->iouh_Req.io_Flags |= IOF_ABORT;
+    }
+    Enable();
+
+    sl811hs_CancelAll(sl, IOERR_ABORTED, FALSE);
+
+    sl811hs_CoreObtain(sl, &sl->sl_RootLock);
+    ForeachNodeSafe(&sl->sl_RootIntWait, iou, iou_next)
+        sl811hs_CancelOne(sl, iou, IOERR_ABORTED);
+    sl811hs_CoreRelease(sl, &sl->sl_RootLock);
+}
+
+/* Disconnect fast path
+ *
+ * The device is gone, so nothing queued for it can ever complete.
+ * Everything on the wire or queued is failed with UHIOERR_USBOFFLINE
+ * right away, rather than left to NAK and time out one at a time,
+ * and the endpoint contexts are reset for whatever is plugged in next.
+ * The root hub's own requests are not affected.
+ */
+static void sl811hs_Disconnect(struct sl811hs *sl)
+{
+    D(ebug("Device gone, failing all pending I/O\n"));
+
+    sl811hs_XferKill(sl, UHIOERR_USBOFFLINE);
+    sl811hs_CancelAll(sl, UHIOERR_USBOFFLINE, FALSE);
+    sl811hs_EPReset(sl);
+}
+
+/* Frame scheduling (sl_FrameSched)
+ *
+ * While there is anything waiting for a frame, the SOF timer
+ * interrupt is enabled, and every SOF wakes the CommandTask:
+ *
+ *  - sl811hs_FrameTick() releases the NAKed periodic packets
+ *    that are due in this frame, from its sl_FrameTable[] slot.
+ *    Intervals longer than the table simply go around again.
+ *  - sl811hs_Schedule() issues periodic packets first, then
+ *    control, then bulk, as long as they fit in what is left
+ *    of the frame. Anything that does not fit waits for the
+ *    next SOF (Errata 1.5, section 2: a packet must not
+ *    straddle the SOF).
+ *
+ * The remaining frame time is read once per pass from SOFHIGH,
+ * in units of 256 full speed bit times.
+ */
+static inline UWORD sl811hs_FrameCost(struct sl811hs *sl, UBYTE len)
+{
+    UWORD ticks = (len >> 3) + 3;
+
+    if (sl->sl_PortStatus & (1 << PORT_LOW_SPEED))
+        ticks <<= 3;
+
+    return ticks;
+}
+
+static void sl811hs_FrameTick(struct sl811hs *sl)
+{
+    struct IOUsbHWReq *iou, *iou_next;
+    ULONG frame = sl->sl_Frame;
+    ULONG slots;
+
+    if (frame == sl->sl_FrameSeen)
+        return;
+
+    /* Catch up on any frames we slept through */
+    slots = frame - sl->sl_FrameSeen;
+    if (slots > SL811HS_FRAME_SLOTS)
+        slots = SL811HS_FRAME_SLOTS;
+
+    sl->sl_FrameSeen = frame;
+
+    for (; slots > 0 && sl->sl_FramePending; slots--) {
+        struct MinList *slot = &sl->sl_FrameTable[(frame - slots + 1) & (SL811HS_FRAME_SLOTS - 1)];
+
+        ForeachNodeSafe(slot, iou, iou_next) {
+            struct sl811hs_NakTimer *nak = iou->iouh_DriverPrivate2;
+
+            if ((LONG)(frame - nak->due) < 0)
+                continue;
+
+            nak->framed = FALSE;
+            Remove((struct Node *)iou);
+            IOU_SETQUEUE(iou, QUEUE_NONE);
+            sl->sl_FramePending--;
+            sl811hs_Ready(sl, iou);
+        }
+    }
+}
+
+/* Enable the SOF timer interrupt only while we need it */
+static void sl811hs_FrameArm(struct sl811hs *sl)
+{
+    BOOL want, moderate;
+    UBYTE mask = SL811HS_INTMASK_CHANGED |
+                 SL811HS_INTMASK_USB_B |
+                 SL811HS_INTMASK_USB_A;
+
+    want = sl->sl_FrameSched &&
+           (sl->sl_PortStatus & (1 << PORT_ENABLE)) &&
+           (sl->sl_FrameDeferred || sl->sl_FramePending ||
+            GetHead(&sl->sl_EPRing[SCHED_ISO]) || GetHead(&sl->sl_IsoStaged));
+
+    /* Interrupt moderation flushes on SOF, so it is only
+     * worth it while there are packets on the wire, or held.
+     */
+    moderate = sl->sl_FrameSched && sl->sl_IrqBatch > 1 &&
+           (sl->sl_PortStatus & (1 << PORT_ENABLE)) &&
+           (sl811hs_XferBusy(sl) || sl811hs_DonePending(sl));
+
+    if (want || moderate)
+        mask |= SL811HS_INTMASK_SOF_TIMER;
+
+    sl->sl_FrameWanted = want;
+    sl->sl_IrqModerated = moderate;
+    sl->sl_IntEnable = mask;
+    wb(sl, SL811HS_INTENABLE, mask);
+
+    /* Let go of anything still held back */
+    if (!moderate && sl->sl_IrqHeld)
+        Signal(sl->sl_CommandTask, (1 << sl->sl_SigDone));
+}
+
+/* Advance the wheel by one tick, and queue up whatever is due */
+static void sl811hs_WheelTurn(struct sl811hs *sl)
+{
+    struct MinList *slot;
+    struct IOUsbHWReq *iou;
+    int level;
+
+    if (sl->sl_WheelPending == 0)
+        return;
+
+    sl->sl_WheelNow++;
+
+    for (level = 0; level < SL811HS_WHEEL_LEVELS - 1; level++) {
+        if ((sl->sl_WheelNow >> (SL811HS_WHEEL_BITS * level)) & (SL811HS_WHEEL_SLOTS - 1))
+            break;
+    }
+    for (; level > 0; level--)
+        sl811hs_WheelCascade(sl, level);
+
+    slot = &sl->sl_Wheel[0][sl->sl_WheelNow & (SL811HS_WHEEL_SLOTS - 1)];
+    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)slot))) {
+        IOU_SETQUEUE(iou, QUEUE_NONE);
+        sl->sl_WheelPending--;
+
+        /* Always retry. Even at the NAK timeout deadline the
+         * device gets one last chance, and only a real NAK on
+         * that retry ends the request, in sl811hs_ReplyOrRetry().
+         */
+        sl811hs_Ready(sl, iou);
+    }
+}
+
+/* Keep the wheel ticking while anything is on it */
+static void sl811hs_WheelArm(struct sl811hs *sl)
+{
+    struct timerequest *tr = &sl->sl_WheelTick;
+
+    if (sl->sl_WheelTicking || sl->sl_WheelPending == 0)
+        return;
+
+    tr->tr_node.io_Command = TR_ADDREQUEST;
+    tr->tr_time.tv_secs = 0;
+    tr->tr_time.tv_micro = UFRAME2US(SL811HS_WHEEL_TICK);
+    sl->sl_WheelTicking = TRUE;
+    SendIO((struct IORequest *)tr);
+}
+
+/* Isochronous streaming
+ *
+ * A UHCMD_ISOXFER is a run of frame packets: iouh_Data cut into
+ * iouh_MaxPktSize pieces, or, with UHFF_SL811HS_ISOFRAMES, an array
+ * of iouh_Length struct SL811HS_IsoFrame. IOU_STATE() is the
+ * index of the next packet to send, and each endpoint has at most
+ * one packet in a channel at a time, so one transaction per frame.
+ * Requests queued back to back on an endpoint stream without a gap.
+ */
+static BOOL sl811hs_IsoPacket(struct IOUsbHWReq *iou, ULONG idx, UBYTE **datap, UBYTE *lenp)
+{
+    if (iou->iouh_Flags & UHFF_SL811HS_ISOFRAMES) {
+        struct SL811HS_IsoFrame *f = iou->iouh_Data;
+
+        if (idx >= iou->iouh_Length)
+            return FALSE;
+
+        *datap = f[idx].if_Data;
+        *lenp = f[idx].if_Length;
+    } else {
+        ULONG off = idx * iou->iouh_MaxPktSize;
+
+        if (off >= iou->iouh_Length)
+            return FALSE;
+
+        *datap = (UBYTE *)iou->iouh_Data + off;
+        *lenp = (iou->iouh_Length - off) > iou->iouh_MaxPktSize ?
+                iou->iouh_MaxPktSize : (iou->iouh_Length - off);
+    }
+
+    return TRUE;
+}
+
+/* Load the next packet of every iso endpoint into a free channel,
+ * for sl811hs_IntServer to arm at the next SOF.
+ */
+static void sl811hs_IsoStage(struct sl811hs *sl, BOOL dead)
+{
+    struct sl811hs_EP *ep, *ep_next;
+    struct MinList served;
+    struct sl811hs_Xfer *xfer;
+    struct IOUsbHWReq *iou;
+    BOOL online = (sl->sl_PortStatus & (1 << PORT_ENABLE)) ? TRUE : FALSE;
+
+    /* Take back packets that will never see their SOF */
+    if (dead || !online) {
+        struct MinList todo;
+
+        NEWLIST(&todo);
+        Disable();
+        while ((xfer = (struct sl811hs_Xfer *)RemHead((struct List *)&sl->sl_IsoStaged)))
+            AddTail((struct List *)&todo, (struct Node *)xfer);
+        Enable();
+
+        while ((xfer = (struct sl811hs_Xfer *)RemHead((struct List *)&todo)))
+            sl811hs_XferFree(sl, xfer);
+    }
+
+    sl811hs_FifoAdapt(sl);
+
+    NEWLIST(&served);
+    ForeachNodeSafe(&sl->sl_EPRing[SCHED_ISO], ep, ep_next) {
+        UBYTE *data, len, ctl;
+        ULONG idx;
+
+        if (ep->ep_Busy)
+            continue;
+
+        while ((iou = (struct IOUsbHWReq *)GetHead(&ep->ep_Packets))) {
+            if (dead || (iou->iouh_Req.io_Flags & IOF_ABORT)) {
+                iou->iouh_Req.io_Error = IOERR_ABORTED;
+            } else if (!online) {
+                iou->iouh_Req.io_Error = UHIOERR_USBOFFLINE;
+            } else {
+                idx = IOU_STATE(iou);
+                if (sl811hs_IsoPacket(iou, idx, &data, &len))
+                    break;
             }
+
+            /* Done, one way or another */
+            Remove((struct Node *)iou);
+            sl811hs_ReplyOrRetry(sl, iou);
         }
-        break;
-    default:
-        D(ebug("Unknown request - NAK\n"));
-        err = UHIOERR_NAK;
-        break;
+
+        if (iou == NULL) {
+            Remove((struct Node *)ep);
+            AddTail((struct List *)&sl->sl_EPIdle, (struct Node *)ep);
+            continue;
+        }
+
+        xfer = sl811hs_XferClaim(sl, sl811hs_FifoDemand(iou));
+        if (xfer == NULL) {
+            D2(ebug("%p No channel for this frame\n", iou));
+            break;
+        }
+
+        if (iouIsOut(iou)) {
+            ctl = SL811HS_HOSTCTRL_DIR_OUT;
+            xfer->pidep = SL811HS_HOSTID_PIDEP(SL811HS_PID_OUT, iou->iouh_Endpoint);
+            xfer->nstate = DRV1_STATE_ISO_OUT;
+        } else {
+            ctl = SL811HS_HOSTCTRL_DIR_IN;
+            xfer->pidep = SL811HS_HOSTID_PIDEP(SL811HS_PID_IN, iou->iouh_Endpoint);
+            xfer->nstate = DRV1_STATE_ISO_IN;
+        }
+        ctl |= SL811HS_HOSTCTRL_ISO | SL811HS_HOSTCTRL_ENABLE | SL811HS_HOSTCTRL_ARM;
+
+        xfer->iou = iou;
+        xfer->ep = ep;
+        ep->ep_Busy++;
+        xfer->data = data;
+        xfer->len = len;
+        xfer->dev = iou->iouh_DevAddr;
+        xfer->frame = idx;
+        xfer->ctl = ctl;
+        sl811hs_XferLoad(sl, xfer, ctl);
+
+        IOU_SETSTATE(iou, idx + 1);
+
+        /* Frame it goes out in */
+        if (idx == 0)
+            iou->iouh_Frame = (UWORD)(sl->sl_Frame + 1);
+        if (iou->iouh_Flags & UHFF_SL811HS_ISOFRAMES)
+            ((struct SL811HS_IsoFrame *)iou->iouh_Data)[idx].if_Frame = (UWORD)(sl->sl_Frame + 1);
+
+        SIM_ARMED(sl);
+        if (sl->sl_FrameSched) {
+            Disable();
+            xfer->state = XFER_STAGED;
+            AddTail((struct List *)&sl->sl_IsoStaged, (struct Node *)xfer);
+            Enable();
+        } else {
+            /* No SOF timer, so no frame to wait for */
+            SL811HS_BARRIER();
+            xfer->state = XFER_ACTIVE;
+            wb(sl, xfer->ab + SL811HS_HOSTCTRL, ctl);
+        }
+
+        /* Let the other iso endpoints at the free channels first */
+        Remove((struct Node *)ep);
+        AddTail((struct List *)&served, (struct Node *)ep);
     }
 
-    D2(ebug("Return %d\n", err));
-    return err;
+    /* ..once the walk is over, so none is visited twice */
+    while ((ep = (struct sl811hs_EP *)RemHead((struct List *)&served)))
+        AddTail((struct List *)&sl->sl_EPRing[SCHED_ISO], (struct Node *)ep);
 }
 
-static BYTE sl811hs_InterruptXferRoot(struct sl811hs *sl, struct IOUsbHWReq *iou)
+/* Record how an iso packet went. There are no retries. */
+static void sl811hs_IsoComplete(struct sl811hs *sl, struct sl811hs_Xfer *xfer)
 {
-    UWORD length = (UWORD)iou->iouh_Length;
-    UBYTE port_one = (1 << 1);
-    BYTE err = UHIOERR_STALL;
+    struct IOUsbHWReq *iou = xfer->iou;
+    UBYTE status, len = 0;
+    BYTE err;
 
-    D2(ebug("EndPoint %d\n", iou->iouh_Endpoint));
+    status = rb(sl, xfer->ab + SL811HS_HOSTSTATUS);
 
-    if (iou->iouh_Endpoint == 1) {
-        if (sl->sl_PortChange)
-            err = sl811hs_AppendData(sl, iou, &length, 1, &port_one);
-        else
-            err = UHIOERR_NAK;
+    if (!(sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        err = UHIOERR_USBOFFLINE;
+    else if (status & SL811HS_HOSTSTATUS_ERROR)
+        err = UHIOERR_CRCERROR;
+    else if (status & SL811HS_HOSTSTATUS_OVERFLOW)
+        err = UHIOERR_OVERFLOW;
+    else if (status & SL811HS_HOSTSTATUS_TIMEOUT)
+        err = UHIOERR_TIMEOUT;
+    else if (status & SL811HS_HOSTSTATUS_STALL)
+        err = UHIOERR_STALL;
+    else if (status & SL811HS_HOSTSTATUS_ACK)
+        err = UHIOERR_NO_ERROR;
+    else
+        err = UHIOERR_HOSTERROR;
+
+    if (err == UHIOERR_NO_ERROR) {
+        if (xfer->ctl & SL811HS_HOSTCTRL_DIR) {
+            len = xfer->len;
+        } else {
+            UBYTE left = rb(sl, xfer->ab + SL811HS_HOSTTXLEFT);
+            len = (left > xfer->len) ? 0 : (xfer->len - left);
+            sl811hs_FifoRead(sl, xfer->base, xfer->data, len);
+        }
+        iou->iouh_Actual += len;
     }
 
-    return err;
-}
-
-static inline void sl811hs_Enqueue(struct sl811hs *sl, struct IOUsbHWReq *iou)
-{
-    /* Clear 'IOF_QUICK' flag */
-    iou->iouh_Req.io_Flags &= ~IOF_QUICK;
+    D2(ebug("%p ISO frame %d: %d bytes, status %02x, error %d\n", iou, (int)xfer->frame, len, status, err));
 
-    iou->iouh_DriverPrivate1 = NULL;
-    iou->iouh_DriverPrivate2 = NULL;
-    iou->iouh_Actual = 0;
+    if (iou->iouh_Flags & UHFF_SL811HS_ISOFRAMES) {
+        struct SL811HS_IsoFrame *f = &((struct SL811HS_IsoFrame *)iou->iouh_Data)[xfer->frame];
+        f->if_Actual = len;
+        f->if_Error = err;
+    } else if (err && !iou->iouh_Req.io_Error) {
+        /* Only the first error of the run can be reported */
+        iou->iouh_Req.io_Error = err;
+    }
 
-    /* Add to the list of commands to do */
-    PutMsg(sl->sl_CommandPort, (struct Message *)iou);
+    sl811hs_XferFree(sl, xfer);
 }
 
-static inline LONG sl811hs_State(struct sl811hs *sl)
+static void sl811hs_Schedule(struct sl811hs *sl, BOOL dead)
 {
-    return sl->sl_State;
-}
-
-struct sl811hs_NakTimer {
-    struct timerequest tr;
+    struct sl811hs_EP *ep, *ep_next;
+    struct MinList served;
     struct IOUsbHWReq *iou;
-    ULONG time;         /* in uFrames */
-    ULONG interval;     /* in uFrames */
-    int error;          /* error count */
-};
+    BOOL full = FALSE;
+    WORD budget;
+    int cls;
 
-#define UFRAME2MS(x)    ((x)/8)
-#define UFRAME2US(x)    ((x)*125)
-#define MS2UFRAME(x)    ((x)*8)
+    sl811hs_FrameTick(sl);
+    sl811hs_FifoAdapt(sl);
 
-static void sl811hs_ReplyOrRetry(struct sl811hs *sl, struct IOUsbHWReq *iou)
-{
-    struct sl811hs_NakTimer *nak;
+    sl->sl_FrameDeferred = FALSE;
+    if (sl->sl_FrameSched && (sl->sl_PortStatus & (1 << PORT_ENABLE)))
+        budget = rb(sl, SL811HS_SOFHIGH);
+    else
+        budget = 0x7fff;
+
+    for (cls = SCHED_PERIODIC; cls < SCHED_CLASSES && !full; cls++) {
+        NEWLIST(&served);
+        ForeachNodeSafe(&sl->sl_EPRing[cls], ep, ep_next) {
+            struct sl811hs_Xfer *xfer;
+            enum sl811hs_Perform_e state;
+            UBYTE want;
+            UWORD cost;
+
+            /* If we're dead, or aborted, just reply it */
+            while ((iou = (struct IOUsbHWReq *)GetHead(&ep->ep_Packets)) &&
+                   (dead || (iou->iouh_Req.io_Flags & IOF_ABORT))) {
+                D2(ebug("%p Aborted\n", iou));
+                Remove((struct Node *)iou);
+                iou->iouh_Req.io_Error = IOERR_ABORTED;
+                sl811hs_ReplyOrRetry(sl, iou);
+            }
 
-    do {
-        if (iou->iouh_Req.io_Command < CMD_NONSTD)
-            break;
+            if (iou == NULL) {
+                Remove((struct Node *)ep);
+                AddTail((struct List *)&sl->sl_EPIdle, (struct Node *)ep);
+                continue;
+            }
 
-        /* Handle runt transactions */
-        if ((iou->iouh_Flags & UHFF_ALLOWRUNTPKTS) &&
-            (iou->iouh_Req.io_Error == UHIOERR_RUNTPACKET)) {
-            iou->iouh_Req.io_Error = 0;
-            break;
-        }
+            D2(ebug("EP %03x => %p\n", ep->ep_Key, iou));
 
-        /* Handle non-NAK error codes
-         */
-        if (iou->iouh_Req.io_Error != UHIOERR_NAK) {
-            if (iou->iouh_DriverPrivate2) {
-                D2(ebug("%p Clear iouh_DriverPrivate2\n", iou));
-                nak = (struct sl811hs_NakTimer *)iou->iouh_DriverPrivate2;
-                AbortIO((struct IORequest *)nak);
-                WaitIO((struct IORequest *)nak);
-                nak->iou = NULL;
-                iou->iouh_DriverPrivate2 = NULL;
-                AddTail((struct List *)&sl->sl_NakTimersFree, (struct Node *)nak);
-                nak = NULL;
+            /* Keep per-endpoint ordering (and toggles) */
+            if (ep->ep_Busy)
+                continue;
+
+            if (IsListEmpty((struct List *)&sl->sl_XfersFree)) {
+                D2(ebug("No free Xfers available\n"));
+                full = TRUE;
+                break;
             }
-            break;
-        }
 
-        /* From here on, we are in a NAK or Retry */
-        if (iou->iouh_DriverPrivate2 == NULL) {
-            nak = (struct sl811hs_NakTimer *)RemHead((struct List *)&sl->sl_NakTimersFree);
-            if (nak == NULL) {
-                /* Allocate a new timer, and clone the request from the main thread */
-                nak = AllocMem(sizeof(*nak), MEMF_ANY);
-                if (nak != NULL) { 
-                    CopyMem(sl->sl_TimeRequest, &nak->tr, sizeof(struct timerequest));
-                }
+            want = sl811hs_FifoDemand(iou);
+            cost = sl811hs_FrameCost(sl, want);
+            if (cost > budget) {
+                D2(ebug("%p Waiting for the next frame\n", iou));
+                sl->sl_FrameDeferred = TRUE;
+                continue;
             }
-            if (nak != NULL) {
-                iou->iouh_DriverPrivate2 = nak;
-                nak->iou = iou;
-                nak->interval = iou->iouh_Interval;
-                nak->time = 0;
-                nak->error = 1;
-                if (sl->sl_PortStatus & (1 << PORT_LOW_SPEED))
-                    nak->interval = MS2UFRAME(nak->interval);
-                if (nak->interval == 0)
-                    nak->interval = MS2UFRAME(iou->iouh_NakTimeout) / 16;
-                if (nak->interval == 0)
-                    nak->interval = DEFAULT_INTERVAL;
+
+            xfer = sl811hs_XferClaim(sl, want);
+            if (!xfer) {
+                D2(ebug("%p Waiting for a larger FIFO window\n", iou));
+                continue;
             }
-        } else {
-            BOOL done = FALSE;
-            nak = iou->iouh_DriverPrivate2;
-            if (iou->iouh_Flags & UHFF_NAKTIMEOUT) {
-                if (iou->iouh_NakTimeout && (UFRAME2MS(nak->time) > iou->iouh_NakTimeout)) {
-                    D2(ebug("%p timed out after %sms\n", iou, UFRAME2MS(nak->time)));
-                    done = TRUE;
-                }
+
+            Remove((struct Node *)iou);
+            IOU_SETQUEUE(iou, QUEUE_NONE);
+
+            /* Round-robin: to the back of the ring, after the walk */
+            Remove((struct Node *)ep);
+            if (IsListEmpty((struct List *)&ep->ep_Packets))
+                AddTail((struct List *)&sl->sl_EPIdle, (struct Node *)ep);
+            else
+                AddTail((struct List *)&served, (struct Node *)ep);
+
+            xfer->ep = ep;
+            ep->ep_Busy++;
+
+            state = sl811hs_Perform(sl, xfer, iou);
+            if (state == PERFORM_DONE) {
+                sl811hs_XferFree(sl, xfer);
+                sl811hs_ReplyOrRetry(sl, iou);
             } else {
-                nak->error++;
-                if (nak->error > 3) {
-                    D2(ebug("%p received 3 NAKs\n", iou));
-                    done = TRUE;
-                }
-            }
-            if (done) {
-                AbortIO((struct IORequest *)nak);
-                WaitIO((struct IORequest *)nak);
-                nak->iou = NULL;
-                AddTail((struct List *)&sl->sl_NakTimersFree, (struct Node *)nak);
-                iou->iouh_DriverPrivate2 = NULL;
-                iou->iouh_Req.io_Error = ((iou->iouh_Flags & UHFF_NAKTIMEOUT)) ? UHIOERR_NAKTIMEOUT : UHIOERR_NAK;
-                break;
+                budget -= cost;
+                sl811hs_XferStage(sl, xfer);
             }
         }
 
-        if (nak) {
-            nak->tr.tr_time.tv_secs  = UFRAME2US(nak->interval) / 1000000;
-            nak->tr.tr_time.tv_micro = UFRAME2US(nak->interval) % 1000000;
-            nak->tr.tr_node.io_Command = TR_ADDREQUEST;
-            D(ebug("%p NAK, retry in %d ms, %d ms left (%d frames waited)\n", iou, UFRAME2MS(nak->interval), (iou->iouh_Flags & UHFF_NAKTIMEOUT) ? (iou->iouh_NakTimeout - UFRAME2MS(nak->time)) : -1, nak->time));
-            AddTail((struct List *)&sl->sl_PacketsDelayed, (struct Node *)nak->iou);
-            SendIO((struct IORequest *)nak);
-            return;
+        while ((ep = (struct sl811hs_EP *)RemHead((struct List *)&served)))
+            AddTail((struct List *)&sl->sl_EPRing[cls], (struct Node *)ep);
+    }
+
+    sl->sl_BulkYield = (GetHead(&sl->sl_EPRing[SCHED_ISO]) ||
+                        GetHead(&sl->sl_EPRing[SCHED_PERIODIC]) ||
+                        GetHead(&sl->sl_EPRing[SCHED_CONTROL])) ? TRUE : FALSE;
+}
+
+/* Process the completed Xfers on sl_DoneRing[]. From sl_SoftInt,
+ * it stops short of anything that could need AllocMem(), and
+ * returns FALSE to leave the rest to the CommandTask.
+ */
+static BOOL sl811hs_DoneDrain(struct sl811hs *sl, BOOL soft)
+{
+    struct sl811hs_Xfer *xfer, *next;
+    struct IOUsbHWReq *iou;
+    BYTE err;
+
+    for (;;) {
+        if (soft && (!sl811hs_PoolSpare(&sl->sl_NakPool, 1) ||
+                     !sl811hs_PoolSpare(&sl->sl_EPPool, 1)))
+            return sl811hs_DonePending(sl) ? FALSE : TRUE;
+
+        xfer = sl811hs_DonePop(sl);
+        if (!xfer)
+            break;
+        next = xfer->chain;
+        xfer->chain = NULL;
+        iou = xfer->iou;
+
+        sl811hs_LatencySample(sl, xfer, soft);
+
+        /* Its request was already failed by sl811hs_XferKill() */
+        if (iou == NULL) {
+            sl811hs_XferFree(sl, xfer);
+            continue;
         }
 
-        iou->iouh_Req.io_Error = UHIOERR_OUTOFMEMORY;
+        if (xfer->ctl & SL811HS_HOSTCTRL_ISO) {
+            sl811hs_IsoComplete(sl, xfer);
+            continue;
+        }
 
-    } while (0);
+        err = sl811hs_XferComplete(sl, xfer);
+
+        if (next && next->state != XFER_STAGED) {
+            /* The IRQ handler already armed the next
+             * packet on the other channel, which now
+             * carries the stream. Stage behind it,
+             * if it is still on the wire.
+             */
+            sl811hs_XferFree(sl, xfer);
+            if (!err)
+                sl811hs_XferStage(sl, next);
+            continue;
+        }
 
-    D2(ebug("%p ReplyMsg(%d)\n", iou, iou->iouh_Req.io_Error));
-    ReplyMsg((struct Message *)iou);
+        /* Staged, but never armed */
+        if (next)
+            sl811hs_XferFree(sl, next);
+
+        if ((err || (sl811hs_Perform(sl, xfer, iou) != PERFORM_ACTIVE))) {
+            sl811hs_XferFree(sl, xfer);
+            sl811hs_ReplyOrRetry(sl, iou);
+        } else {
+            sl811hs_XferStage(sl, xfer);
+        }
+    }
+
+    return TRUE;
 }
 
-/* Get expired NAKs
+/* Software interrupt core (sl_SoftMode)
+ *
+ * Cause()d by sl811hs_IntServer for completed packets. It does what
+ * the CommandTask would on its done signal, without the task switch,
+ * including staging the next iso frame packets, but only while no task
+ * is in the driver core (sl_CoreBusy): if the CommandTask,
+ * sl811hs_BeginIO or sl811hs_AbortIO hold sl_TaskLock or sl_RootLock,
+ * the CommandTask is signalled to do it instead.
+ *
+ * This all runs at software interrupt level: the chip register
+ * sequences of sl811hs_XferIssue() and friends, sl811hs_FrameArm()'s
+ * INTENABLE write, and the SendIO() of the wheel tick by
+ * sl811hs_WheelArm(), which timer.device allows from interrupts.
+ * Nothing here may block or allocate memory, so the pools are not
+ * grown, and port changes, resets and the wheel's turning are left
+ * to the CommandTask.
  */
-static struct IOUsbHWReq *sl811hs_GetNak(struct sl811hs *sl)
+static AROS_INTH1(sl811hs_SoftIntServer, struct sl811hs *, sl)
 {
-    struct sl811hs_NakTimer *nak;
+    AROS_INTFUNC_INIT
 
-    nak = (struct sl811hs_NakTimer *)GetMsg(sl->sl_TimeRequest->tr_node.io_Message.mn_ReplyPort);
-    if (!nak)
-        return NULL;
+    BOOL done = FALSE;
+
+    if (sl->sl_SoftMode && sl->sl_CoreBusy == 0) {
+        sl->sl_NakPool.sp_NoGrow = TRUE;
+        sl->sl_EPPool.sp_NoGrow = TRUE;
+
+        done = sl811hs_DoneDrain(sl, TRUE);
+        sl811hs_IsoStage(sl, FALSE);
+        sl811hs_Schedule(sl, FALSE);
+        sl811hs_FrameArm(sl);
+        sl811hs_WheelArm(sl);
+
+        sl->sl_NakPool.sp_NoGrow = FALSE;
+        sl->sl_EPPool.sp_NoGrow = FALSE;
+    }
+
+    if (done) {
+        sl->sl_SoftRuns++;
+    } else {
+        sl->sl_SoftDeferred++;
+        sl->sl_IrqWakeups++;
+        Signal(sl->sl_CommandTask, (1 << sl->sl_SigDone));
+    }
 
-    nak->time += nak->interval;
+    return FALSE;
 
-    return nak->iou;
+    AROS_INTFUNC_EXIT
 }
 
 #if __EXEC_LIBAPI__ >= 50
@@ -1599,6 +4124,16 @@ static void sl811hs_CommandTask(void)
                 ULONG sigftime;
 
                 sl->sl_TimeRequest = tr;
+                {
+                    struct Device *TimerBase = tr->tr_node.io_Device;
+                    struct EClockVal ev;
+
+                    sl->sl_EClockFreq = ReadEClock(&ev);
+                }
+
+                /* The timer wheel ticks on the same port */
+                CopyMem(tr, &sl->sl_WheelTick, sizeof(*tr));
+                sl->sl_WheelTicking = FALSE;
 
                 sl->sl_SigDone = AllocSignal(-1);
                 sigfdone = (1 << sl->sl_SigDone);
@@ -1613,14 +4148,19 @@ static void sl811hs_CommandTask(void)
                 sl->sl_Interrupt.is_Node.ln_Name = "sl811hs";
                 sl->sl_Interrupt.is_Data = sl;
                 sl->sl_Interrupt.is_Code = (VOID (*)())sl811hs_IntServer;
+                sl->sl_SoftInt.is_Node.ln_Pri = 0;
+                sl->sl_SoftInt.is_Node.ln_Type = NT_INTERRUPT;
+                sl->sl_SoftInt.is_Node.ln_Name = "sl811hs";
+                sl->sl_SoftInt.is_Data = sl;
+                sl->sl_SoftInt.is_Code = (VOID (*)())sl811hs_SoftIntServer;
                 D2(ebug("Initializing IRQ handler (IRQ %d, handler %p)\n", sl->sl_Irq, &sl->sl_Interrupt));
-#if DEBUG
-                if (sl->sl_Addr == NULL)
-                    sl811hs_sim_Init(&sl->sl_Sim, &sl->sl_Interrupt);
-                else
+#if SL811HS_BUS_SIM
+                sl811hs_sim_Init(&sl->sl_Sim, &sl->sl_Interrupt);
+#else
+                AddIntServer(sl->sl_Irq, &sl->sl_Interrupt);
 #endif
-                    AddIntServer(sl->sl_Irq, &sl->sl_Interrupt);
 
+                sl811hs_CoreObtain(sl, &sl->sl_TaskLock);
                 sl811hs_ResetHW(sl);
 
                 for (;;) {
@@ -1628,55 +4168,54 @@ static void sl811hs_CommandTask(void)
                     struct MinList todo;
                     NEWLIST(&todo);
 
+                    sl811hs_Idle(sl);
+                    sl811hs_CoreRelease(sl, &sl->sl_TaskLock);
                     sigset = Wait(sigmask);
+                    sl811hs_CoreObtain(sl, &sl->sl_TaskLock);
 
-                    /* Add NAKed-but-want-to-retry packets to
-                     * the PacketsReady.
+                    /* Turn the timer wheel, adding the NAKed packets
+                     * that are due for a retry to their endpoint queues.
                      */
                     if (sigset & sigftime) {
-                        while ((iou = sl811hs_GetNak(sl))) {
-                            /* Move to the sl_PacketsReady list */
-                            Remove((struct Node *)iou);
-                            AddTail((struct List *)&sl->sl_PacketsReady, (struct Node *)iou);
+                        if (GetMsg(tr_mp)) {
+                            sl->sl_WheelTicking = FALSE;
+                            sl811hs_WheelTurn(sl);
                         }
                     }
 
                     /* Signal from IRQ handler when there is something to do
                      */
                     if (sigset & sigfdone) {
-                        BYTE err;
+                        BOOL gone;
 
                         /* Scan for any port status changes */
-                        sl811hs_PortScan(sl);
+                        sl811hs_CoreObtain(sl, &sl->sl_RootLock);
+                        gone = sl811hs_PortScan(sl);
+                        sl811hs_CoreRelease(sl, &sl->sl_RootLock);
+
+                        /* Unplugged? Fail everything for it now */
+                        if (gone)
+                            sl811hs_Disconnect(sl);
 
                         /* Completed xfers need to be processed and
                          * returned to the free list */
-                        while (1) {
-                            struct sl811hs_Xfer *xfer;
-
-                            Disable();
-                            xfer = (struct sl811hs_Xfer *)RemHead((struct List *)&sl->sl_XfersDone);
-                            Enable();
-                            if (!xfer)
-                                break;
-                            err = sl811hs_XferComplete(sl, xfer);
-
-                            if ((err || (sl811hs_Perform(sl, xfer, xfer->iou) != PERFORM_ACTIVE))) {
-                                struct IOUsbHWReq *iou = xfer->iou;
-                                AddTail((struct List *)&sl->sl_XfersFree, (struct Node *)xfer);
-                                sl811hs_ReplyOrRetry(sl, iou);
-                            }
-                        }
+                        sl811hs_DoneDrain(sl, FALSE);
                     }
 
+                    /* Aborts handed over by sl811hs_UnitAbortIO() */
+                    if (sl->sl_AbortPending)
+                        sl811hs_CancelFlagged(sl);
+
                     if (sigset & sigfport) {
                         while ((iou = (struct IOUsbHWReq *)GetMsg(sl->sl_CommandPort))) {
+                            IOU_SETQUEUE(iou, QUEUE_NONE);
                             AddTail((struct List *)&todo, (struct Node *)iou);
                         }
                     }
 
                     while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&todo))) {
                         ULONG state = sl811hs_State(sl);
+                        BOOL parked = FALSE;
                         BYTE err;
 
                         D2(ebug("%p Async processing, cmd %d\n", iou, (WORD)iou->iouh_Req.io_Command));
@@ -1684,6 +4223,8 @@ static void sl811hs_CommandTask(void)
                         /* Command of Death */
                         if (iou->iouh_Req.io_Command == 0xffff) {
                             dead =  (struct Message *)iou;
+                            sl->sl_DirectIssue = FALSE;
+                            sl->sl_SoftMode = FALSE;
                             continue;
                         }
 
@@ -1693,6 +4234,7 @@ static void sl811hs_CommandTask(void)
                          * NOTE: The initial 'Are you started?' message is
                          *       an empty io_Flags = IOF_ABORT message.
                          */
+                        sl811hs_CoreObtain(sl, &sl->sl_RootLock);
                         if (dead || (iou->iouh_Req.io_Flags & IOF_ABORT)) {
                             D(ebug("Aborting %p\n", iou));
                             err = IOERR_ABORTED;
@@ -1702,15 +4244,8 @@ static void sl811hs_CommandTask(void)
                             err = IOERR_NOCMD;
                             break;
                         case CMD_FLUSH:
-                            /* Ditch any pending transfers, by marking
-                             * their abort flag
-                             */
-                            Disable();
-                            if (sl->sl_Xfer[0].iou)
-                                sl->sl_Xfer[0].iou->iouh_Req.io_Flags |= IOF_ABORT;
-                            if (sl->sl_Xfer[1].iou)
-                                sl->sl_Xfer[1].iou->iouh_Req.io_Flags |= IOF_ABORT;
-                            Enable();
+                            /* Ditch any pending transfers */
+                            sl811hs_Flush(sl);
                             err = 0;
                             break;
                         case CMD_RESET:
@@ -1780,6 +4315,12 @@ static void sl811hs_CommandTask(void)
                                 if (iou->iouh_DevAddr == sl->sl_RootDevAddr) {
                                     /* Simulated host port */
                                     err = sl811hs_InterruptXferRoot(sl, iou);
+                                    if (err == UHIOERR_NAK) {
+                                        /* Nothing to report until the port changes */
+                                        AddTail((struct List *)&sl->sl_RootIntWait, (struct Node *)iou);
+                                        IOU_SETQUEUE(iou, QUEUE_ROOT);
+                                        parked = TRUE;
+                                    }
                                 } else {
                                     /* Real transfer */
                                     err = sl811hs_InterruptXfer(sl, iou);
@@ -1824,14 +4365,17 @@ static void sl811hs_CommandTask(void)
                             err = IOERR_NOCMD;
                             break;
                         }
+                        sl811hs_CoreRelease(sl, &sl->sl_RootLock);
+
+                        if (parked)
+                            continue;
 
                         /* Queue up transactions that require
                          * an interrupt.
                          */
                         if (err == IOERR_UNITBUSY) {
                             iou->iouh_Req.io_Error = 0;
-                            AddTail((struct List *)&sl->sl_PacketsReady, (struct Node *)iou);
-                            D2(ebug("%p => PacketsReady\n", iou));
+                            sl811hs_Ready(sl, iou);
                         } else {
                             /* Retry or reply */
                             iou->iouh_Req.io_Error = err;
@@ -1839,61 +4383,80 @@ static void sl811hs_CommandTask(void)
                         }
                     }
 
-                    /* Handle the next queued transaction(s) */
-                    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&sl->sl_PacketsReady))) {
-                        D2(ebug("PacketsReady => %p\n", iou));
-                        /* If we're dead, or aborted, just remove it */
-                        if (dead || (iou->iouh_Req.io_Flags & IOF_ABORT)) {
-                            D2(ebug("%p Aborted\n", iou));
-                            iou->iouh_Req.io_Error = IOERR_ABORTED;
-                            continue;
-                        } else {
-                            struct sl811hs_Xfer *xfer;
-                            enum sl811hs_Perform_e state;
+                    /* Complete the root hub interrupt requests,
+                     * if the port has changed since.
+                     */
+                    sl811hs_CoreObtain(sl, &sl->sl_RootLock);
+                    sl811hs_RootNotify(sl, dead ? TRUE : FALSE);
+                    sl811hs_CoreRelease(sl, &sl->sl_RootLock);
 
-                            xfer = (struct sl811hs_Xfer *)RemHead((struct List *)&sl->sl_XfersFree);
-                            if (!xfer) {
-                                D2(ebug("No free Xfers available\n"));
-                                break;
-                            }
+                    /* Handle the next queued transaction(s) */
+                    sl811hs_IsoStage(sl, dead ? TRUE : FALSE);
+                    sl811hs_Schedule(sl, dead ? TRUE : FALSE);
+                    sl811hs_FrameArm(sl);
+                    sl811hs_WheelArm(sl);
 
-                            state = sl811hs_Perform(sl, xfer, iou);
-                            if (state == PERFORM_DONE) {
-                                AddTail((struct List *)&sl->sl_XfersFree, (struct Node *)xfer);
-                                sl811hs_ReplyOrRetry(sl, iou);
-                            }
-                        }
-                    }
+                    if (sl->sl_PollMode && !dead)
+                        sl811hs_Poll(sl, sigmask);
                 }
 
                 /* Shut down interrupts */
                 wb(sl, SL811HS_INTENABLE, 0);
-#if DEBUG
-                if (sl->sl_Addr != NULL)
+#if !SL811HS_BUS_SIM
+                RemIntServer(sl->sl_Irq, &sl->sl_Interrupt);
 #endif
-                    RemIntServer(sl->sl_Irq, &sl->sl_Interrupt);
 
                 FreeSignal(sl->sl_SigDone);
 
                 /* Abort any delayed packets */
-                if (GetHead(&sl->sl_PacketsDelayed)) {
-                    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&sl->sl_PacketsDelayed))) {
+                if (sl->sl_WheelTicking) {
+                    AbortIO((struct IORequest *)&sl->sl_WheelTick);
+                    WaitIO((struct IORequest *)&sl->sl_WheelTick);
+                    sl->sl_WheelTicking = FALSE;
+                }
+                for (int i = 0; i < SL811HS_WHEEL_LEVELS; i++) {
+                    for (int j = 0; j < SL811HS_WHEEL_SLOTS; j++) {
+                        while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&sl->sl_Wheel[i][j]))) {
+                            struct sl811hs_NakTimer *nak;
+                            nak = (struct sl811hs_NakTimer *)iou->iouh_DriverPrivate2;
+                            nak->iou = NULL;
+                            iou->iouh_Req.io_Error = IOERR_ABORTED;
+                            ReplyMsg((struct Message *)iou);
+                            sl811hs_PoolPut(&sl->sl_NakPool, nak);
+                        }
+                    }
+                }
+                sl->sl_WheelPending = 0;
+
+                /* ..and any waiting for their frame */
+                for (int i = 0; i < SL811HS_FRAME_SLOTS; i++) {
+                    while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&sl->sl_FrameTable[i]))) {
                         struct sl811hs_NakTimer *nak;
                         nak = (struct sl811hs_NakTimer *)iou->iouh_DriverPrivate2;
-                        AbortIO((struct IORequest *)nak);
-                        WaitIO((struct IORequest *)nak);
+                        nak->framed = FALSE;
                         nak->iou = NULL;
                         iou->iouh_Req.io_Error = IOERR_ABORTED;
                         ReplyMsg((struct Message *)iou);
-                        AddTail((struct List *)&sl->sl_NakTimersFree, (struct Node *)nak);
+                        sl811hs_PoolPut(&sl->sl_NakPool, nak);
                     }
                 }
+                sl->sl_FramePending = 0;
 
-                /* Purge any NakTimers we may have allocated */
-                if (GetHead(&sl->sl_NakTimersFree)) {
-                    struct sl811hs_NakTimer *nak;
-                    while ((nak = (struct sl811hs_NakTimer *)RemHead((struct List *)&sl->sl_NakTimersFree))) 
-                        FreeMem(nak, sizeof(*nak));
+                /* Purge the endpoint queues */
+                for (int i = 0; i < SCHED_CLASSES; i++) {
+                    struct sl811hs_EP *ep;
+                    while ((ep = (struct sl811hs_EP *)RemHead((struct List *)&sl->sl_EPRing[i]))) {
+                        while ((iou = (struct IOUsbHWReq *)RemHead((struct List *)&ep->ep_Packets))) {
+                            iou->iouh_Req.io_Error = IOERR_ABORTED;
+                            sl811hs_ReplyOrRetry(sl, iou);
+                        }
+                        AddTail((struct List *)&sl->sl_EPIdle, (struct Node *)ep);
+                    }
+                }
+                {
+                    struct sl811hs_EP *ep;
+                    while ((ep = (struct sl811hs_EP *)GetHead(&sl->sl_EPIdle)))
+                        sl811hs_EPFree(sl, ep);
                 }
 
                 CloseDevice((struct IORequest *)tr);
@@ -1910,11 +4473,73 @@ static void sl811hs_CommandTask(void)
     ReplyMsg(dead);
 }
 
+/* Direct issue (sl_DirectIssue)
+ *
+ * Issues the first packet of a bulk or interrupt request from the
+ * caller's context, as the CommandTask would have. Returns FALSE if
+ * the request has to be queued to the CommandTask instead, ie if the
+ * CommandTask is busy, or anything else is waiting to be issued.
+ */
+static BOOL sl811hs_DirectIssue(struct sl811hs *sl, struct IOUsbHWReq *iou)
+{
+    BYTE err;
+    int i;
+
+    if (!sl->sl_DirectIssue || iou->iouh_DevAddr == sl->sl_RootDevAddr)
+        return FALSE;
+
+    if (!sl811hs_CoreAttempt(sl, &sl->sl_TaskLock))
+        return FALSE;
+
+    if (!sl->sl_DirectIssue ||
+        sl811hs_State(sl) != UHSF_OPERATIONAL ||
+        IsListEmpty((struct List *)&sl->sl_XfersFree) ||
+        sl811hs_DonePending(sl)) {
+        sl811hs_CoreRelease(sl, &sl->sl_TaskLock);
+        return FALSE;
+    }
+
+    /* Don't overtake anything */
+    for (i = 0; i < SCHED_CLASSES; i++) {
+        if (GetHead(&sl->sl_EPRing[i])) {
+            sl811hs_CoreRelease(sl, &sl->sl_TaskLock);
+            return FALSE;
+        }
+    }
+
+    if (iou->iouh_Req.io_Command == UHCMD_BULKXFER)
+        err = sl811hs_BulkXfer(sl, iou);
+    else
+        err = sl811hs_InterruptXfer(sl, iou);
+
+    if (err != IOERR_UNITBUSY) {
+        /* Let the CommandTask reply it, as it always has */
+        sl811hs_CoreRelease(sl, &sl->sl_TaskLock);
+        return FALSE;
+    }
+
+    D2(ebug("%p Direct issue\n", iou));
+
+    /* As if it had been through sl811hs_Enqueue() */
+    iou->iouh_Req.io_Flags &= ~IOF_QUICK;
+    iou->iouh_Req.io_Message.mn_Node.ln_Type = NT_MESSAGE;
+    iou->iouh_Req.io_Error = 0;
+    iou->iouh_DriverPrivate2 = NULL;
+
+    sl811hs_Ready(sl, iou);
+    sl811hs_Schedule(sl, FALSE);
+    sl811hs_FrameArm(sl);
+
+    sl811hs_Idle(sl);
+    sl811hs_CoreRelease(sl, &sl->sl_TaskLock);
+    return TRUE;
+}
+
 #define DC(field)       D2(ebug("%p->io_%s = 0x%x (%s)\n", ior, #field, ior->io_##field, CMDNAME(ior->io_##field)));
 #define DF(field)       D2(ebug("%p->io_%s = 0x%x\n", ior, #field, ior->io_##field));
 #define DU(field)       D2(ebug("%p->iouh_%s = 0x%x\n", iou, #field, iou->iouh_##field));
 
-void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
+static void sl811hs_UnitBeginIO(struct sl811hs *sl, struct IORequest *ior)
 {
     struct IOUsbHWReq *iou = (struct IOUsbHWReq *)ior;
     LONG err;
@@ -1936,6 +4561,9 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
     }
 #endif
 
+    /* Not on any of our queues yet */
+    IOU_SETQUEUE(iou, QUEUE_NONE);
+
     switch (ior->io_Command) {
     case CMD_FLUSH:
         /* Abort all UHCMD_CONTROLXFER, UHCMD_ISOXFER, UHCMD_INTXFER
@@ -1959,7 +4587,8 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
         DU(SplitHubAddr);
         DU(SplitHubPort);
         DU(NakTimeout);
-        sl811hs_Enqueue(sl, iou);
+        if (!sl811hs_DirectIssue(sl, iou))
+            sl811hs_Enqueue(sl, iou);
         break;
     case UHCMD_CONTROLXFER:
         /* Start a control transfer */
@@ -1973,7 +4602,10 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
         DU(SplitHubAddr);
         DU(SplitHubPort);
         DU(NakTimeout);
-        sl811hs_Enqueue(sl, iou);
+        if (iou->iouh_DevAddr == sl->sl_RootDevAddr && sl811hs_RootQuick(sl, iou))
+            err = iou->iouh_Req.io_Error;
+        else
+            sl811hs_Enqueue(sl, iou);
         break;
     case UHCMD_INTXFER:
         /* Start an interrupt transfer */
@@ -1988,7 +4620,13 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
         DU(SplitHubAddr);
         DU(SplitHubPort);
         DU(NakTimeout);
-        sl811hs_Enqueue(sl, iou);
+        /* A hub status change that is already pending is answered
+         * at once; otherwise the CommandTask holds on to it.
+         */
+        if (iou->iouh_DevAddr == sl->sl_RootDevAddr && sl811hs_RootQuick(sl, iou))
+            err = iou->iouh_Req.io_Error;
+        else if (!sl811hs_DirectIssue(sl, iou))
+            sl811hs_Enqueue(sl, iou);
         break;
     case UHCMD_ISOXFER:
         /* Start an isochronous transfer */
@@ -2026,7 +4664,8 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
                     tmp->ti_Data = 1;
                     break;
                 case UHA_Revision:
-                    tmp->ti_Data = ((rb(sl, SL811HS_HWREVISION) & 0xf0) == 0x10) ? 2 : 5;
+                    /* Cached at attach, so we don't race the command task */
+                    tmp->ti_Data = (sl->sl_Errata == SL811HS_ERRATA_1_2) ? 2 : 5;
                     break;
                 case UHA_Description:
                     tmp->ti_Data = (IPTR)"USB 1.1 Host";
@@ -2037,6 +4676,116 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
                 case UHA_DriverVersion:
                     tmp->ti_Data = 0x200;
                     break;
+                case UHA_SL811HS_FifoLayout:
+                    tmp->ti_Data = sl811hs_FifoLayout(sl);
+                    break;
+                case UHA_SL811HS_NakPolicy:
+                    tmp->ti_Data = sl->sl_NakPolicy;
+                    break;
+                case UHA_SL811HS_SetNakPolicy:
+                    if (tmp->ti_Data == SL811HS_NAKPOLICY_FIXED ||
+                        tmp->ti_Data == SL811HS_NAKPOLICY_ADAPTIVE) {
+                        UBYTE old = sl->sl_NakPolicy;
+                        sl->sl_NakPolicy = (UBYTE)tmp->ti_Data;
+                        tmp->ti_Data = old;
+                    } else {
+                        tmp->ti_Data = sl->sl_NakPolicy;
+                    }
+                    break;
+                case UHA_SL811HS_NakImmediate:
+                    tmp->ti_Data = sl->sl_NakImmediate;
+                    break;
+                case UHA_SL811HS_NakDeferred:
+                    tmp->ti_Data = sl->sl_NakDeferred;
+                    break;
+                case UHA_SL811HS_NakGiveUp:
+                    tmp->ti_Data = sl->sl_NakGiveUp;
+                    break;
+                case UHA_SL811HS_NakTimerPeak:
+                    tmp->ti_Data = sl->sl_NakPool.sp_Peak;
+                    break;
+                case UHA_SL811HS_EPPeak:
+                    tmp->ti_Data = sl->sl_EPPool.sp_Peak;
+                    break;
+                case UHA_SL811HS_IrqBatch:
+                    tmp->ti_Data = sl->sl_IrqBatch;
+                    break;
+                case UHA_SL811HS_SetIrqBatch:
+                    {
+                        UBYTE old = sl->sl_IrqBatch;
+                        sl->sl_IrqBatch = (tmp->ti_Data < 1) ? 1 : (tmp->ti_Data > 255) ? 255 : tmp->ti_Data;
+                        tmp->ti_Data = old;
+                    }
+                    break;
+                case UHA_SL811HS_IrqFrames:
+                    tmp->ti_Data = sl->sl_IrqFrames;
+                    break;
+                case UHA_SL811HS_SetIrqFrames:
+                    {
+                        UBYTE old = sl->sl_IrqFrames;
+                        sl->sl_IrqFrames = (tmp->ti_Data < 1) ? 1 : (tmp->ti_Data > 255) ? 255 : tmp->ti_Data;
+                        tmp->ti_Data = old;
+                    }
+                    break;
+                case UHA_SL811HS_IrqWakeups:
+                    tmp->ti_Data = sl->sl_IrqWakeups;
+                    break;
+                case UHA_SL811HS_IrqSaved:
+                    tmp->ti_Data = sl->sl_IrqSaved;
+                    break;
+                case UHA_SL811HS_PollMode:
+                    tmp->ti_Data = sl->sl_PollMode;
+                    break;
+                case UHA_SL811HS_SetPollMode:
+                    {
+                        BOOL old = sl->sl_PollMode;
+                        sl->sl_PollMode = tmp->ti_Data ? TRUE : FALSE;
+                        tmp->ti_Data = old;
+                    }
+                    break;
+                case UHA_SL811HS_IrqLatency:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_Latency[0], FALSE);
+                    break;
+                case UHA_SL811HS_IrqLatencyMax:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_Latency[0], TRUE);
+                    break;
+                case UHA_SL811HS_PollLatency:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_Latency[1], FALSE);
+                    break;
+                case UHA_SL811HS_PollLatencyMax:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_Latency[1], TRUE);
+                    break;
+                case UHA_SL811HS_AbortLatency:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_AbortLatency, FALSE);
+                    break;
+                case UHA_SL811HS_AbortLatencyMax:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_AbortLatency, TRUE);
+                    break;
+                case UHA_SL811HS_AbortDeferred:
+                    tmp->ti_Data = sl->sl_AbortDeferred;
+                    break;
+                case UHA_SL811HS_SoftIntMode:
+                    tmp->ti_Data = sl->sl_SoftMode;
+                    break;
+                case UHA_SL811HS_SetSoftIntMode:
+                    {
+                        BOOL old = sl->sl_SoftMode;
+                        sl->sl_SoftMode = tmp->ti_Data ? TRUE : FALSE;
+                        tmp->ti_Data = old;
+                    }
+                    break;
+                case UHA_SL811HS_SoftLatency:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_Latency[2], FALSE);
+                    break;
+                case UHA_SL811HS_SoftLatencyMax:
+                    tmp->ti_Data = sl811hs_LatencyUs(sl, &sl->sl_Latency[2], TRUE);
+                    break;
+                case UHA_SL811HS_SoftIntRuns:
+                    tmp->ti_Data = sl->sl_SoftRuns;
+                    break;
+                case UHA_SL811HS_SoftIntDeferred:
+                    tmp->ti_Data = sl->sl_SoftDeferred;
+                    break;
                 default:
                     tmp->ti_Data = 0;
                     break;
@@ -2082,26 +4831,52 @@ void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
     }
 }
 
-LONG sl811hs_AbortIO(struct sl811hs *sl, struct IORequest *ior)
+static LONG sl811hs_UnitAbortIO(struct sl811hs *sl, struct IORequest *ior)
 {
+    BOOL done = FALSE;
+
     Disable();
     ior->io_Flags |= IOF_ABORT;
     Enable();
 
+    sl811hs_AbortNote(sl, ior);
+
+    /* Off its queue and replied now, unless it is on the wire.
+     * Never wait for sl_TaskLock: the CommandTask holds it across
+     * port resets. Anything not cancelled here is left to the
+     * CommandTask, which is woken to sweep it, or a parked root
+     * hub request, off its queue.
+     */
+    if (sl811hs_CoreAttempt(sl, &sl->sl_TaskLock)) {
+        if (ior->io_Message.mn_Node.ln_Type == NT_REPLYMSG ||
+            sl811hs_Cancel(sl, (struct IOUsbHWReq *)ior, IOERR_ABORTED))
+            done = TRUE;
+        sl811hs_CoreRelease(sl, &sl->sl_TaskLock);
+    }
+
+    if (!done) {
+        Disable();
+        sl->sl_AbortDeferred++;
+        sl->sl_AbortPending = TRUE;
+        Enable();
+        Signal(sl->sl_CommandTask, (1 << sl->sl_SigDone));
+    }
+
     return 0;
 }
 
-struct sl811hs *sl811hs_Attach(IPTR addr, IPTR data, int irq)
+static struct sl811hs *sl811hs_UnitAttach(const struct sl811hs_Bus *bus, IPTR addr, IPTR data, int irq)
 {
     struct sl811hs *sl;
 
-#if DEBUG < 1
+#if !SL811HS_BUS_SIM
     /* A tiny bit of sanity checking */
     if (addr == 0 || data == 0 || addr == data)
         return NULL;
 #endif
 
     sl = AllocMem(sizeof(*sl), MEMF_ANY | MEMF_CLEAR);
+    sl->sl_Bus = bus;
     sl->sl_Addr = (volatile UBYTE *)addr;
     sl->sl_Data = (volatile UBYTE *)data;
     sl->sl_Irq = irq;
@@ -2116,31 +4891,61 @@ struct sl811hs *sl811hs_Attach(IPTR addr, IPTR data, int irq)
         return NULL;
     }
 
-    NEWLIST(&sl->sl_NakTimersFree);
-    NEWLIST(&sl->sl_PacketsDelayed);
-    NEWLIST(&sl->sl_PacketsReady);
+    /* Select the FIFO burst routines. Only 1.5 gets this far,
+     * so the hardware always takes the errata path.
+     */
+    sl->sl_Errata = rb(sl, SL811HS_HWREVISION) & 0xf0;
+#if SL811HS_BUS_SIM
+    sl->sl_FifoWrite = sl811hs_FifoWriteSim;
+    sl->sl_FifoRead  = sl811hs_FifoReadSim;
+    sl->sl_AutoInc = TRUE;
+#else
+    sl->sl_FifoWrite = sl811hs_FifoWriteErrata;
+    sl->sl_FifoRead  = sl811hs_FifoReadErrata;
+    sl->sl_AutoInc = FALSE;
+#endif
+
+    /* Sized for a handful of devices; both grow on demand */
+    sl811hs_PoolInit(&sl->sl_NakPool, sizeof(struct sl811hs_NakTimer), SL811HS_POOL_NAKTIMERS);
+    sl811hs_PoolInit(&sl->sl_EPPool, sizeof(struct sl811hs_EP), SL811HS_POOL_EPS);
+    for (int i = 0; i < SL811HS_WHEEL_LEVELS; i++) {
+        for (int j = 0; j < SL811HS_WHEEL_SLOTS; j++)
+            NEWLIST(&sl->sl_Wheel[i][j]);
+    }
+    for (int i = 0; i < SL811HS_FRAME_SLOTS; i++)
+        NEWLIST(&sl->sl_FrameTable[i]);
+    for (int i = 0; i < SCHED_CLASSES; i++)
+        NEWLIST(&sl->sl_EPRing[i]);
+    NEWLIST(&sl->sl_EPIdle);
+    NEWLIST(&sl->sl_IsoStaged);
+    NEWLIST(&sl->sl_RootIntWait);
     NEWLIST(&sl->sl_XfersFree);
-    NEWLIST(&sl->sl_XfersActive);
-    NEWLIST(&sl->sl_XfersDone);
 
+    /* USB-A and USB-B start with half of the FIFO each,
+     * see sl811hs_FifoAdapt()
+     */
     sl->sl_Xfer[0].ab = 0;
-    sl->sl_Xfer[0].base = 16;
-#ifdef ENABLE_B
-    sl->sl_Xfer[0].maxlen = 120;
-    sl->sl_Xfer[1].ab = 8;
-    sl->sl_Xfer[1].base = 136;
-    sl->sl_Xfer[1].maxlen = 120;
-#else
-    sl->sl_Xfer[0].maxlen = 240;
     sl->sl_Xfer[1].ab = 8;
-    sl->sl_Xfer[1].base = 0;
-    sl->sl_Xfer[1].maxlen = 0;
-#endif
+    sl811hs_FifoPartition(sl, SL811HS_FIFO_SIZE / 2);
 
-    AddHead((struct List *)&sl->sl_XfersFree, (struct Node *)&sl->sl_Xfer[0]);
-#ifdef ENABLE_B
-    AddHead((struct List *)&sl->sl_XfersFree, (struct Node *)&sl->sl_Xfer[1]);
-#endif
+    sl811hs_XferFree(sl, &sl->sl_Xfer[0]);
+    sl811hs_XferFree(sl, &sl->sl_Xfer[1]);
+
+    sl->sl_PingPong = TRUE;
+    sl->sl_IrqContinue = TRUE;
+    sl->sl_DirectIssue = TRUE;
+
+    /* The simulator has no SOF timer, so it stays on the timer wheel */
+    sl->sl_FrameSched = SL811HS_BUS_SIM ? FALSE : TRUE;
+
+    sl->sl_NakPolicy = SL811HS_NAKPOLICY_ADAPTIVE;
+
+    /* No interrupt moderation, until asked for */
+    sl->sl_IrqBatch = 1;
+    sl->sl_IrqFrames = 1;
+
+    InitSemaphore(&sl->sl_RootLock);
+    InitSemaphore(&sl->sl_TaskLock);
 
 #if __EXEC_LIBAPI__ >= 50
     sl->sl_CommandTask = NewCreateTask(TASKTAG_PC, sl811hs_CommandTask,
@@ -2178,6 +4983,8 @@ struct sl811hs *sl811hs_Attach(IPTR addr, IPTR data, int irq)
 #endif
 
     if (!sl->sl_CommandTask) {
+        sl811hs_PoolFree(&sl->sl_NakPool);
+        sl811hs_PoolFree(&sl->sl_EPPool);
         FreeMem(sl, sizeof(*sl));
     } else {
         /* Send, then wait for, startup message */
@@ -2194,7 +5001,7 @@ struct sl811hs *sl811hs_Attach(IPTR addr, IPTR data, int irq)
     return sl;
 }
 
-void sl811hs_Detach(struct sl811hs *sl)
+static void sl811hs_UnitDetach(struct sl811hs *sl)
 {
     struct IORequest io;
 
@@ -2213,5 +5020,20 @@ void sl811hs_Detach(struct sl811hs *sl)
     wb(sl, SL811HS_HOSTCTRL+8, 0);
     wb(sl, SL811HS_CONTROL1, 0);
 
+    sl811hs_PoolFree(&sl->sl_NakPool);
+    sl811hs_PoolFree(&sl->sl_EPPool);
+
     FreeMem(sl, sizeof(*sl));
 }
+
+const struct sl811hs_Bus SL811HS_BUS = {
+#if SL811HS_BUS_SIM
+    .sb_Name    = "sim",
+#else
+    .sb_Name    = "clockport",
+#endif
+    .sb_Attach  = sl811hs_UnitAttach,
+    .sb_Detach  = sl811hs_UnitDetach,
+    .sb_BeginIO = sl811hs_UnitBeginIO,
+    .sb_AbortIO = sl811hs_UnitAbortIO,
+};
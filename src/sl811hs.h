@@ -29,6 +29,8 @@
 #include <exec/libraries.h>
 #include <exec/io.h>
 
+#include <devices/usbhardware.h>
+
 #define SL811HS_CP_ADDR       0xd80001
 #define SL811HS_CP_DATA       0xd80005
 
@@ -115,6 +117,121 @@
 #define  SL811HS_CONTROL2_LOW_SPEED     (1 << 6)
 #define  SL811HS_CONTROL2_SOF_HIGH(x)   ((x) & 0x3f)
 
+/********* Packet FIFO **************/
+
+#define SL811HS_FIFO_BASE       0x10
+#define SL811HS_FIFO_SIZE       240
+
+/********* UHCMD_QUERYDEVICE extensions **************/
+
+#define UHA_SL811HS_Dummy       (UHA_Dummy + 0x8100)
+
+/* Current FIFO partitioning, as:
+ *   bits 31-24: USB-A window base
+ *   bits 23-16: USB-A window length
+ *   bits 15-8:  USB-B window base
+ *   bits 7-0:   USB-B window length
+ */
+#define UHA_SL811HS_FifoLayout  (UHA_SL811HS_Dummy + 1)
+
+/* NAK retry policy, see SL811HS_NAKPOLICY_* */
+#define UHA_SL811HS_NakPolicy   (UHA_SL811HS_Dummy + 2)
+
+/* Selects the NAK retry policy given in ti_Data,
+ * and returns the one it replaces. An unknown
+ * policy is ignored, and the current one returned.
+ */
+#define UHA_SL811HS_SetNakPolicy (UHA_SL811HS_Dummy + 3)
+
+/* NAK retry counters, since attach */
+#define UHA_SL811HS_NakImmediate (UHA_SL811HS_Dummy + 4) /* Retried at once */
+#define UHA_SL811HS_NakDeferred  (UHA_SL811HS_Dummy + 5) /* Retried in a later frame */
+#define UHA_SL811HS_NakGiveUp    (UHA_SL811HS_Dummy + 6) /* Replied with a NAK error */
+
+/* Most driver objects ever in use at once, since attach */
+#define UHA_SL811HS_NakTimerPeak (UHA_SL811HS_Dummy + 7) /* NAK timers (NAKed requests) */
+#define UHA_SL811HS_EPPeak       (UHA_SL811HS_Dummy + 8) /* Endpoint contexts */
+
+/* Interrupt moderation. The CommandTask is woken once per IrqBatch
+ * completed packets, or IrqFrames frames after the first of them,
+ * whichever comes first. An IrqBatch of 1 (the default) wakes it for
+ * every packet. The Set tags take the new value in ti_Data (clamped
+ * to 1..255), and return the one it replaces.
+ */
+#define UHA_SL811HS_IrqBatch     (UHA_SL811HS_Dummy + 9)
+#define UHA_SL811HS_SetIrqBatch  (UHA_SL811HS_Dummy + 10)
+#define UHA_SL811HS_IrqFrames    (UHA_SL811HS_Dummy + 11)
+#define UHA_SL811HS_SetIrqFrames (UHA_SL811HS_Dummy + 12)
+
+/* Interrupt moderation counters, since attach */
+#define UHA_SL811HS_IrqWakeups   (UHA_SL811HS_Dummy + 13) /* CommandTask wakeups */
+#define UHA_SL811HS_IrqSaved     (UHA_SL811HS_Dummy + 14) /* Wakeups saved by moderation */
+
+/* Poll mode: the driver spins on the chip while packets are on the
+ * wire, rather than waiting for its interrupt. SetPollMode takes
+ * TRUE or FALSE in ti_Data, and returns the mode it replaces.
+ */
+#define UHA_SL811HS_PollMode     (UHA_SL811HS_Dummy + 15)
+#define UHA_SL811HS_SetPollMode  (UHA_SL811HS_Dummy + 16)
+
+/* Completion latency, in microseconds, since attach */
+#define UHA_SL811HS_IrqLatency     (UHA_SL811HS_Dummy + 17) /* Average, by interrupt */
+#define UHA_SL811HS_IrqLatencyMax  (UHA_SL811HS_Dummy + 18) /* Worst, by interrupt */
+#define UHA_SL811HS_PollLatency    (UHA_SL811HS_Dummy + 19) /* Average, in poll mode */
+#define UHA_SL811HS_PollLatencyMax (UHA_SL811HS_Dummy + 20) /* Worst, in poll mode */
+
+/* AbortIO() to reply, in microseconds, since attach. AbortIO()
+ * never waits for the driver: a request it cannot cancel at once,
+ * because it has a packet on the wire or the driver is busy, is
+ * replied later by the driver, and also counted in AbortDeferred.
+ */
+#define UHA_SL811HS_AbortLatency    (UHA_SL811HS_Dummy + 21) /* Average */
+#define UHA_SL811HS_AbortLatencyMax (UHA_SL811HS_Dummy + 22) /* Worst */
+#define UHA_SL811HS_AbortDeferred   (UHA_SL811HS_Dummy + 23) /* Not replied by AbortIO() itself */
+
+/* Software interrupt core: completed packets are processed by a
+ * software interrupt rather than by the CommandTask, whenever no
+ * other task is in the driver. SetSoftIntMode takes TRUE or FALSE
+ * in ti_Data, and returns the mode it replaces. Compare SoftLatency
+ * with IrqLatency, and IrqWakeups before and after, for the cost of
+ * either model.
+ */
+#define UHA_SL811HS_SoftIntMode     (UHA_SL811HS_Dummy + 24)
+#define UHA_SL811HS_SetSoftIntMode  (UHA_SL811HS_Dummy + 25)
+#define UHA_SL811HS_SoftLatency     (UHA_SL811HS_Dummy + 26) /* Average, in microseconds */
+#define UHA_SL811HS_SoftLatencyMax  (UHA_SL811HS_Dummy + 27) /* Worst, in microseconds */
+#define UHA_SL811HS_SoftIntRuns     (UHA_SL811HS_Dummy + 28) /* Runs that needed no task switch */
+#define UHA_SL811HS_SoftIntDeferred (UHA_SL811HS_Dummy + 29) /* Runs that woke the CommandTask */
+
+#define SL811HS_NAKPOLICY_FIXED         0       /* Fixed interval, 3 NAKs */
+#define SL811HS_NAKPOLICY_ADAPTIVE      1       /* Exponential backoff per endpoint */
+
+/********* UHCMD_ISOXFER extensions **************/
+
+/* With this set in iouh_Flags, iouh_Data of a UHCMD_ISOXFER points to
+ * an array of iouh_Length struct SL811HS_IsoFrame, one packet per frame,
+ * rather than to a buffer cut up into iouh_MaxPktSize packets.
+ *
+ * iouh_MaxPktSize of a UHCMD_ISOXFER must fit in one FIFO window of
+ * the chip, 232 bytes, and a request is at most 16M packets; larger
+ * ones fail with UHIOERR_BADPARAMS.
+ *
+ * iouh_Frame (of the first packet) and if_Frame are the driver's own
+ * count of SOF timer interrupts, truncated to 16 bits, and not the USB
+ * frame number the chip sends in the SOF token. They only tell how
+ * far apart two packets went out.
+ */
+#define UHFF_SL811HS_ISOFRAMES  (1 << 15)
+
+struct SL811HS_IsoFrame {
+    APTR  if_Data;              /* Packet buffer */
+    UWORD if_Length;            /* Bytes to send, or room to receive */
+    UWORD if_Actual;            /* Set by the driver: bytes transferred */
+    UWORD if_Frame;             /* Set by the driver: frame it was sent in */
+    BYTE  if_Error;             /* Set by the driver: UHIOERR_* */
+    UBYTE if_Reserved;
+};
+
 /* This is a 'struct Node' internally,
  * so feel free to use it in a list.
  */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2026, The poseidon-sl811hs contributors
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <aros/debug.h>
+
+#include "sl811hs.h"
+#include "sl811hs_bus.h"
+
+#define SL811HS_BUS_OF(sl)  (((struct sl811hs_Head *)(sl))->sh_Bus)
+
+struct sl811hs *sl811hs_Attach(IPTR addr, IPTR data, int irq)
+{
+    const struct sl811hs_Bus *bus = &sl811hs_BusHW;
+
+#if SL811HS_SIM
+    /* No clockport at all - attach the simulation */
+    if (addr == 0 && data == 0)
+        bus = &sl811hs_BusSim;
+#endif
+
+    D(bug("%s: $%lx/$%lx on the %s bus\n", __func__, (ULONG)addr, (ULONG)data, bus->sb_Name));
+
+    return bus->sb_Attach(bus, addr, data, irq);
+}
+
+void sl811hs_Detach(struct sl811hs *sl)
+{
+    if (sl == NULL)
+        return;
+
+    SL811HS_BUS_OF(sl)->sb_Detach(sl);
+}
+
+void sl811hs_BeginIO(struct sl811hs *sl, struct IORequest *ior)
+{
+    SL811HS_BUS_OF(sl)->sb_BeginIO(sl, ior);
+}
+
+LONG sl811hs_AbortIO(struct sl811hs *sl, struct IORequest *ior)
+{
+    return SL811HS_BUS_OF(sl)->sb_AbortIO(sl, ior);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2026, The poseidon-sl811hs contributors
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met: 
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer. 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SL811HS_BUS_H
+#define SL811HS_BUS_H
+
+#include <exec/nodes.h>
+#include <exec/io.h>
+
+/* Build the simulation backend (used by pathway.device unit 16)
+ * in addition to the clockport backend.
+ */
+#ifndef SL811HS_SIM
+#define SL811HS_SIM     1
+#endif
+
+struct sl811hs;
+
+/* The driver core (sl811hs.c) is compiled once per bus backend,
+ * and each instance exports one of these. The choice of backend
+ * is made once, in sl811hs_Attach(), after which every register
+ * access in that unit is a direct, inlined, bus cycle.
+ */
+struct sl811hs_Bus {
+    CONST_STRPTR sb_Name;
+    struct sl811hs *(*sb_Attach)(const struct sl811hs_Bus *bus, IPTR addr, IPTR data, int irq);
+    void (*sb_Detach)(struct sl811hs *sl);
+    void (*sb_BeginIO)(struct sl811hs *sl, struct IORequest *ior);
+    LONG (*sb_AbortIO)(struct sl811hs *sl, struct IORequest *ior);
+};
+
+/* Common head of every backend's struct sl811hs */
+struct sl811hs_Head {
+    struct Node sh_Node;
+    const struct sl811hs_Bus *sh_Bus;
+};
+
+extern const struct sl811hs_Bus sl811hs_BusHW;
+#if SL811HS_SIM
+extern const struct sl811hs_Bus sl811hs_BusSim;
+#endif
+
+#endif /* SL811HS_BUS_H */
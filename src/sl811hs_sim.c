@@ -26,6 +26,7 @@
 #include <aros/debug.h>
 
 #include <proto/exec.h>
+#include <exec/execbase.h>
 #include <exec/interrupts.h>
 
 #include "sl811hs.h"
@@ -54,14 +55,85 @@ void sl811hs_sim_Init(struct sl811hs_sim *ss, struct Interrupt *ihook)
 
     ss->ss_InIrq = FALSE;
 
+#if SL811HS_SIM_STRESS
+    ss->ss_IrqDelay = 0;
+    ss->ss_Seed = 1;
+#endif
+
     if (!ss->ss_Port)
         ss->ss_Port = massbulk_Attach();
 }
 
+/* Call the driver's interrupt while anything enabled is pending */
+static void sl811hs_sim_Irq(struct sl811hs_sim *ss)
+{
+    UBYTE mask;
+
+    mask = ((ss->ss_Reg[SL811HS_CONTROL1] & SL811HS_CONTROL1_SUSPEND) ? SL811HS_INTMASK_DETECT : 0) |
+           SL811HS_INTMASK_CHANGED |
+           
+           ((ss->ss_Reg[SL811HS_CONTROL1] & SL811HS_CONTROL1_SOF_ENABLE) ? SL811HS_INTMASK_SOF_TIMER : 0) |
+           SL811HS_INTMASK_USB_B |
+           SL811HS_INTMASK_USB_A;
+
+    if (!ss->ss_InIrq) {
+        ss->ss_InIrq = TRUE;
+        D(bug("%s: Call interrupt? IS=%02x, IE=%02x, IM=%02x = %02x\n", __func__, ss->ss_Reg[SL811HS_INTSTATUS], ss->ss_Reg[SL811HS_INTENABLE], mask, (ss->ss_Reg[SL811HS_INTSTATUS] & ss->ss_Reg[SL811HS_INTENABLE]) & mask));
+        while ((ss->ss_Reg[SL811HS_INTSTATUS] & ss->ss_Reg[SL811HS_INTENABLE]) & mask) {
+            D(bug("%s: Call interrupt! IS=%02x, IE=%02x, IM=%02x = %02x\n", __func__, ss->ss_Reg[SL811HS_INTSTATUS], ss->ss_Reg[SL811HS_INTENABLE], mask, (ss->ss_Reg[SL811HS_INTSTATUS] & ss->ss_Reg[SL811HS_INTENABLE]) & mask));
+            AROS_INTC3(ss->ss_Interrupt->is_Code, ss->ss_Interrupt->is_Data, (1 << 6), (APTR)0xdff000);
+        }
+        ss->ss_InIrq = FALSE;
+    } else {
+        D(bug("%s: In IRQ\n", __func__));
+    }
+}
+
+#if SL811HS_SIM_STRESS
+/* One bus cycle closer to a deferred interrupt */
+static void sl811hs_sim_Tick(struct sl811hs_sim *ss)
+{
+    if (ss->ss_InIrq || ss->ss_IrqDelay == 0)
+        return;
+
+    if (--ss->ss_IrqDelay > 0)
+        return;
+
+    /* Held off by Disable(), as a real one would be */
+    if (SysBase->IDNestCnt >= 0) {
+        ss->ss_IrqDelay = 1;
+        return;
+    }
+
+    sl811hs_sim_Irq(ss);
+}
+
+static UBYTE sl811hs_sim_Delay(struct sl811hs_sim *ss)
+{
+    ss->ss_Seed = ss->ss_Seed * 1103515245 + 12345;
+    return 1 + (ss->ss_Seed >> 16) % SL811HS_SIM_STRESS_DELAY;
+}
+#endif
+
+/* The driver is about to sleep: let anything deferred in */
+void sl811hs_sim_Idle(struct sl811hs_sim *ss)
+{
+#if SL811HS_SIM_STRESS
+    if (ss->ss_IrqDelay) {
+        ss->ss_IrqDelay = 0;
+        sl811hs_sim_Irq(ss);
+    }
+#endif
+}
+
 UBYTE sl811hs_sim_Read(struct sl811hs_sim *ss, int a0)
 {
     UBYTE val;
 
+#if SL811HS_SIM_STRESS
+    sl811hs_sim_Tick(ss);
+#endif
+
     if (a0 == 0) {
         val = ss->ss_Addr;
     } else {
@@ -75,6 +147,12 @@ UBYTE sl811hs_sim_Read(struct sl811hs_sim *ss, int a0)
         case SL811HS_HOSTSTATUS+8:
             val = ss->ss_HostStatus[1];
             break;
+        case SL811HS_HOSTTXLEFT+0:
+            val = ss->ss_TxLeft[0];
+            break;
+        case SL811HS_HOSTTXLEFT+8:
+            val = ss->ss_TxLeft[1];
+            break;
         default:
             val = ss->ss_Reg[ss->ss_Addr];
             break;
@@ -87,9 +165,12 @@ UBYTE sl811hs_sim_Read(struct sl811hs_sim *ss, int a0)
 
 void  sl811hs_sim_Write(struct sl811hs_sim *ss, int a0, UBYTE val)
 {
-    UBYTE mask;
     BOOL update = FALSE;
 
+#if SL811HS_SIM_STRESS
+    sl811hs_sim_Tick(ss);
+#endif
+
     if (a0 == 0) {
         ss->ss_Addr = val;
     } else {
@@ -123,17 +204,19 @@ void  sl811hs_sim_Write(struct sl811hs_sim *ss, int a0, UBYTE val)
 
             if (isArmed & isEnabled) {
                 UBYTE buff[256];
+                size_t len;
                 UBYTE ctl = ss->ss_Reg[SL811HS_HOSTCTRL+i];
                 int ep  = SL811HS_HOSTID_EP_of(ss->ss_Reg[SL811HS_HOSTID+i]);
                 UBYTE pid = SL811HS_HOSTID_PID_of(ss->ss_Reg[SL811HS_HOSTID+i]);
-                buff[0] = ss->ss_Reg[SL811HS_HOSTDEVICEADDR] | ((ep & 1) << 7);
+                buff[0] = ss->ss_Reg[SL811HS_HOSTDEVICEADDR+i] | ((ep & 1) << 7);
                 buff[1] = ((ep & 0xe) << 4) | 0;    /* CRC5 is ignored */
                 D(bug("%s: Send USB%c command %02x %02x\n", __func__, i ? 'B' : 'A', buff[0], buff[1]));
                 usbsim_Out(ss->ss_Port, pid, buff, 2);
+                ss->ss_TxLeft[i/8] = 0;
                 switch (pid) {
                 case PID_SETUP:
                 case PID_OUT:
-                    usbsim_Out(ss->ss_Port, (ctl & SL811HS_HOSTCTRL_DATA) ? PID_DATA1 : PID_DATA0, &ss->ss_Reg[ss->ss_Reg[SL811HS_HOSTBASE]], ss->ss_Reg[SL811HS_HOSTLEN]);
+                    usbsim_Out(ss->ss_Port, (ctl & SL811HS_HOSTCTRL_DATA) ? PID_DATA1 : PID_DATA0, &ss->ss_Reg[ss->ss_Reg[SL811HS_HOSTBASE+i]], ss->ss_Reg[SL811HS_HOSTLEN+i]);
                     usbsim_In(ss->ss_Port, &pid, NULL, 0);
                     switch (pid) {
                     case PID_ACK:
@@ -151,10 +234,12 @@ void  sl811hs_sim_Write(struct sl811hs_sim *ss, int a0, UBYTE val)
                     break;
                 case PID_IN:
                     ss->ss_HostStatus[i/8] = 0;
-                    usbsim_In(ss->ss_Port, &pid, &ss->ss_Reg[ss->ss_Reg[SL811HS_HOSTBASE]], ss->ss_Reg[SL811HS_HOSTLEN]);
+                    len = usbsim_In(ss->ss_Port, &pid, &ss->ss_Reg[ss->ss_Reg[SL811HS_HOSTBASE+i]], ss->ss_Reg[SL811HS_HOSTLEN+i]);
                     switch (pid) {
                     case PID_DATA0:
                     case PID_DATA1:
+                        /* A short packet leaves part of the window */
+                        ss->ss_TxLeft[i/8] = ss->ss_Reg[SL811HS_HOSTLEN+i] - len;
                         ss->ss_HostStatus[i/8] |= SL811HS_HOSTSTATUS_ACK;
                         if (pid == PID_DATA1)
                             ss->ss_HostStatus[i/8] |= SL811HS_HOSTSTATUS_SEQ;
@@ -183,26 +268,15 @@ void  sl811hs_sim_Write(struct sl811hs_sim *ss, int a0, UBYTE val)
         for (i = 0; i < 2; i++) {
             D(bug("%s: Reset USB%c state\n", __func__, i ? 'B' : 'A'));
             ss->ss_HostStatus[i] = 0;
+            ss->ss_TxLeft[i] = 0;
         }
     }
 
     /* Signals any pending interrupts */
-    mask = ((ss->ss_Reg[SL811HS_CONTROL1] & SL811HS_CONTROL1_SUSPEND) ? SL811HS_INTMASK_DETECT : 0) |
-           SL811HS_INTMASK_CHANGED |
-           
-           ((ss->ss_Reg[SL811HS_CONTROL1] & SL811HS_CONTROL1_SOF_ENABLE) ? SL811HS_INTMASK_SOF_TIMER : 0) |
-           SL811HS_INTMASK_USB_B |
-           SL811HS_INTMASK_USB_A;
-
-    if (!ss->ss_InIrq) {
-        ss->ss_InIrq = TRUE;
-        D(bug("%s: Call interrupt? IS=%02x, IE=%02x, IM=%02x = %02x\n", __func__, ss->ss_Reg[SL811HS_INTSTATUS], ss->ss_Reg[SL811HS_INTENABLE], mask, (ss->ss_Reg[SL811HS_INTSTATUS] & ss->ss_Reg[SL811HS_INTENABLE]) & mask));
-        while ((ss->ss_Reg[SL811HS_INTSTATUS] & ss->ss_Reg[SL811HS_INTENABLE]) & mask) {
-            D(bug("%s: Call interrupt! IS=%02x, IE=%02x, IM=%02x = %02x\n", __func__, ss->ss_Reg[SL811HS_INTSTATUS], ss->ss_Reg[SL811HS_INTENABLE], mask, (ss->ss_Reg[SL811HS_INTSTATUS] & ss->ss_Reg[SL811HS_INTENABLE]) & mask));
-            AROS_INTC3(ss->ss_Interrupt->is_Code, ss->ss_Interrupt->is_Data, (1 << 6), (APTR)0xdff000);
-        }
-        ss->ss_InIrq = FALSE;
-    } else {
-        D(bug("%s: In IRQ\n", __func__));
-    }
+#if SL811HS_SIM_STRESS
+    if (ss->ss_IrqDelay == 0)
+        ss->ss_IrqDelay = sl811hs_sim_Delay(ss);
+#else
+    sl811hs_sim_Irq(ss);
+#endif
 }
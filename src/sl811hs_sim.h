@@ -28,6 +28,24 @@
 
 #include "usb_sim.h"
 
+/* Stress mode: the interrupt for a register write is delivered a
+ * random 1..SL811HS_SIM_STRESS_DELAY bus cycles later, rather than
+ * at once, so that it lands anywhere in the driver outside Disable().
+ * The driver checks that no completion is lost every time it goes
+ * idle, and Alert()s if one is (see sl811hs_SimAudit in sl811hs.c).
+ *
+ * To run it, build with -DSL811HS_SIM_STRESS=1 (see mmakefile.src),
+ * and let Poseidon use pathway.device unit 16: enumerating and
+ * mounting the simulated mass storage device, and copying files to
+ * and from it, drives control, bulk and NAKed packets through the
+ * driver.
+ */
+#ifndef SL811HS_SIM_STRESS
+#define SL811HS_SIM_STRESS      0
+#endif
+
+#define SL811HS_SIM_STRESS_DELAY 8
+
 struct sl811hs_sim {
     struct Interrupt *ss_Interrupt;
     UBYTE ss_Reg[256];
@@ -35,12 +53,19 @@ struct sl811hs_sim {
     BOOL ss_InIrq;
 
     BYTE ss_HostStatus[2];
+    UBYTE ss_TxLeft[2];         /* HOSTTXLEFT: window left unfilled by an IN */
 
     struct USBSim *ss_Port;
+
+#if SL811HS_SIM_STRESS
+    UBYTE ss_IrqDelay;          /* Bus cycles to the interrupt, or 0 */
+    ULONG ss_Seed;
+#endif
 };
 
 void  sl811hs_sim_Init(struct sl811hs_sim *sim, struct Interrupt *ihook);
 UBYTE sl811hs_sim_Read(struct sl811hs_sim *sim, int a0);
 void  sl811hs_sim_Write(struct sl811hs_sim *sim, int a0, UBYTE val);
+void  sl811hs_sim_Idle(struct sl811hs_sim *sim);
 
 #endif /* SL811HS_SIM_H */
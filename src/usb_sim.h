@@ -45,7 +45,8 @@ struct USBSim {
     struct Node us_Node;
     void (*reset)(struct USBSim *sim);
     void (*out)(struct USBSim *sim, UBYTE pid, const UBYTE *packet, size_t len);
-    void (*in)(struct USBSim *sim, UBYTE *pidp, UBYTE *packet, size_t maxlen);
+    /* Returns the bytes of a DATA0/DATA1 reply put in packet */
+    size_t (*in)(struct USBSim *sim, UBYTE *pidp, UBYTE *packet, size_t maxlen);
 };
 
 static inline void usbsim_Reset(struct USBSim *sim)
@@ -58,9 +59,9 @@ static inline void usbsim_Out(struct USBSim *sim, UBYTE pid, const UBYTE *packet
     sim->out(sim, pid, packet, len);
 }
 
-static inline void usbsim_In(struct USBSim *sim, UBYTE *pidp, UBYTE *packet, size_t maxlen)
+static inline size_t usbsim_In(struct USBSim *sim, UBYTE *pidp, UBYTE *packet, size_t maxlen)
 {
-    sim->in(sim, pidp, packet, maxlen);
+    return sim->in(sim, pidp, packet, maxlen);
 }
 
 #endif /* USB_SIM_H */